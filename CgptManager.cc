@@ -2,7 +2,19 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
 
 #include "CgptManager.h"
 
@@ -11,6 +23,7 @@ extern "C" {
 }
 
 using std::string;
+using std::vector;
 
 // We don't use these variables for the libcgpt version.
 const char* progname = "";
@@ -19,9 +32,334 @@ void (*uuid_generator)(uint8_t* buffer) = NULL;
 
 
 // This file implements the C++ wrapper methods over the C cgpt methods.
+// Creating the table, adding partitions and the PMBR go through libcgpt.
+// Everything else is done here directly: reads are served from a snapshot
+// of the table, read in as few reads as possible, and changes to entries
+// are staged in the snapshot and written back sector by sector.
+
+namespace {
+
+const size_t kSectorSize = 512;
+
+// The protective MBR, the primary header and the 128 entries cgpt creates
+// all fit in the first 34 sectors, so they normally come in one read.
+const size_t kGptStartSectors = 34;
+
+// More than any real table has, just to bound what a bad header can ask
+// us to read.
+const uint32_t kMaxEntries = 1024;
+
+const char kGptSignature[] = "EFI PART";
+
+// The GPT header as it is on disk, little endian.
+struct DiskGptHeader {
+  char signature[8];
+  uint32_t revision;
+  uint32_t size;
+  uint32_t header_crc32;
+  uint32_t reserved_zero;
+  uint64_t my_lba;
+  uint64_t alternate_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  Guid disk_uuid;
+  uint64_t entries_lba;
+  uint32_t number_of_entries;
+  uint32_t size_of_entry;
+  uint32_t entries_crc32;
+} __attribute__((packed));
+
+// ChromeOS keeps its kernel attributes in the top 16 bits of attrs.
+const int kPriorityOffset = 48;
+const uint64_t kPriorityMask = 0xf;
+const int kTriesOffset = 52;
+const uint64_t kTriesMask = 0xf;
+const int kSuccessfulOffset = 56;
+const uint64_t kSuccessfulMask = 0x1;
+
+uint64_t GetAttribute(const GptEntry& entry, int offset, uint64_t mask) {
+  return (le64toh(entry.attrs.whole) >> offset) & mask;
+}
+
+void SetAttribute(GptEntry* entry, int offset, uint64_t mask,
+                  uint64_t value) {
+  uint64_t attrs = le64toh(entry->attrs.whole);
+  attrs &= ~(mask << offset);
+  attrs |= (value & mask) << offset;
+  entry->attrs.whole = htole64(attrs);
+}
+
+// The partition types SetHighestPriority ranks: ChromeOS kernels and
+// CoreOS usr partitions.
+const Guid kChromeOSKernelType =
+    {{{0xfe3a2a5d,0x4f32,0x41a7,0xb7,0x25,{0xac,0xcc,0x32,0x85,0xa3,0x09}}}};
+const Guid kCoreOSUsrType =
+    {{{0x5dfbf5f4,0x2848,0x4bac,0xaa,0x5e,{0x0d,0x9a,0x20,0xb7,0x45,0xa6}}}};
+
+bool GuidEquals(const Guid& a, const Guid& b) {
+  return !memcmp(&a, &b, sizeof(a));
+}
+
+// Same limit cgpt has for the highest priority it will set.
+const uint8_t kMaxPriority = 15;
+
+// Converts a UTF-8 label to the UTF-16LE a GPT entry holds, zero padded.
+// Fails on bad UTF-8 or if it doesn't fit.
+bool LabelToName(const string& label, uint16_t* name, size_t name_size) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(label.data());
+  const uint8_t* end = in + label.size();
+  size_t out = 0;
+
+  memset(name, 0, name_size * sizeof(*name));
+  while (in < end) {
+    uint32_t code = *in++;
+    int extra = 0;
+
+    if (code >= 0xf5) {
+      return false;
+    } else if (code >= 0xf0) {
+      code &= 0x07;
+      extra = 3;
+    } else if (code >= 0xe0) {
+      code &= 0x0f;
+      extra = 2;
+    } else if (code >= 0xc2) {
+      code &= 0x1f;
+      extra = 1;
+    } else if (code >= 0x80) {
+      return false;
+    }
+    if (end - in < extra)
+      return false;
+    for (int i = 0; i < extra; i++, in++) {
+      if ((*in & 0xc0) != 0x80)
+        return false;
+      code = code << 6 | (*in & 0x3f);
+    }
+    if (code > 0x10ffff || (code >= 0xd800 && code < 0xe000))
+      return false;
+
+    // Outside the BMP takes a surrogate pair.
+    if (code >= 0x10000) {
+      if (out + 2 > name_size)
+        return false;
+      code -= 0x10000;
+      name[out++] = htole16(0xd800 | code >> 10);
+      name[out++] = htole16(0xdc00 | (code & 0x3ff));
+    } else {
+      if (out + 1 > name_size)
+        return false;
+      name[out++] = htole16(code);
+    }
+  }
+  return true;
+}
+
+// The CRC32 the GPT uses (the one zlib and ethernet use).
+uint32_t Crc32(const void* data, size_t size) {
+  static uint32_t table[256];
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint32_t crc = 0xffffffff;
+
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++)
+        c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+      table[i] = c;
+    }
+  }
+
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Checks the header sector read from lba and reads the entries it points
+// at. start is what was read from the beginning of the device; entries
+// that are in it aren't read again.
+bool ReadEntries(int fd, const string& sector, uint64_t lba,
+                 const string& start, vector<GptEntry>* entries) {
+  const DiskGptHeader* header =
+      reinterpret_cast<const DiskGptHeader*>(sector.data());
+  uint32_t size = le32toh(header->size);
+
+  if (sector.size() != kSectorSize ||
+      memcmp(header->signature, kGptSignature, sizeof(header->signature)) ||
+      size < sizeof(*header) || size > kSectorSize ||
+      le64toh(header->my_lba) != lba)
+    return false;
+
+  // The header CRC is taken with its own field zeroed.
+  string copy = sector.substr(0, size);
+  memset(&copy[offsetof(DiskGptHeader, header_crc32)], 0,
+         sizeof(header->header_crc32));
+  if (Crc32(copy.data(), copy.size()) != le32toh(header->header_crc32))
+    return false;
+
+  uint32_t count = le32toh(header->number_of_entries);
+  if (le32toh(header->size_of_entry) != sizeof(GptEntry) ||
+      count == 0 || count > kMaxEntries)
+    return false;
+
+  size_t bytes = count * sizeof(GptEntry);
+  uint64_t offset = le64toh(header->entries_lba) * kSectorSize;
+  entries->resize(count);
+  char* buffer = reinterpret_cast<char*>(&(*entries)[0]);
+
+  if (offset + bytes <= start.size())
+    memcpy(buffer, start.data() + offset, bytes);
+  else if (pread(fd, buffer, bytes, offset) != static_cast<ssize_t>(bytes))
+    return false;
+
+  return Crc32(buffer, bytes) == le32toh(header->entries_crc32);
+}
+
+// Converts the UTF-16LE name of a GPT entry to a UTF-8 label, up to its
+// first NUL. Unpaired surrogates become U+FFFD.
+string NameToLabel(const GptEntry& entry) {
+  const size_t name_size = sizeof(entry.name) / sizeof(entry.name[0]);
+  uint16_t name[name_size];
+  string label;
+
+  memcpy(name, entry.name, sizeof(name));
+
+  for (size_t i = 0; i < name_size; i++) {
+    uint32_t code = le16toh(name[i]);
+    if (!code)
+      break;
+
+    if (code >= 0xd800 && code < 0xdc00 && i + 1 < name_size &&
+        le16toh(name[i + 1]) >= 0xdc00 && le16toh(name[i + 1]) < 0xe000) {
+      code = 0x10000 + ((code - 0xd800) << 10) +
+             (le16toh(name[++i]) - 0xdc00);
+    } else if (code >= 0xd800 && code < 0xe000) {
+      code = 0xfffd;
+    }
+
+    if (code < 0x80) {
+      label += code;
+    } else if (code < 0x800) {
+      label += 0xc0 | code >> 6;
+      label += 0x80 | (code & 0x3f);
+    } else if (code < 0x10000) {
+      label += 0xe0 | code >> 12;
+      label += 0x80 | (code >> 6 & 0x3f);
+      label += 0x80 | (code & 0x3f);
+    } else {
+      label += 0xf0 | code >> 18;
+      label += 0x80 | (code >> 12 & 0x3f);
+      label += 0x80 | (code >> 6 & 0x3f);
+      label += 0x80 | (code & 0x3f);
+    }
+  }
+  return label;
+}
+
+string GuidKey(const Guid& guid) {
+  return string(reinterpret_cast<const char*>(guid.u.raw),
+                sizeof(guid.u.raw));
+}
+
+// Returns a copy of the header sector base moved to my_lba, pointing at
+// the other header and at its own entries, with its CRCs updated.
+string MakeHeader(const string& base, uint64_t my_lba, uint64_t alternate_lba,
+                  uint64_t entries_lba, uint32_t entries_crc32) {
+  string sector = base;
+  DiskGptHeader* header = reinterpret_cast<DiskGptHeader*>(&sector[0]);
+
+  header->my_lba = htole64(my_lba);
+  header->alternate_lba = htole64(alternate_lba);
+  header->entries_lba = htole64(entries_lba);
+  header->entries_crc32 = htole32(entries_crc32);
+  header->header_crc32 = 0;
+  header->header_crc32 = htole32(Crc32(sector.data(),
+                                       le32toh(header->size)));
+  return sector;
+}
+
+// Reads size bytes at offset with O_DIRECT, which needs its buffer, offset
+// and size aligned; this alignment covers any logical block size.
+const size_t kDirectAlignment = 4096;
+
+bool ReadDirect(int fd, uint64_t offset, size_t size, string* data) {
+  uint64_t start = offset / kDirectAlignment * kDirectAlignment;
+  size_t length = (offset + size - start + kDirectAlignment - 1) /
+                  kDirectAlignment * kDirectAlignment;
+  void* buffer;
+
+  if (posix_memalign(&buffer, kDirectAlignment, length))
+    return false;
+
+  ssize_t bytes = pread(fd, buffer, length, start);
+  bool result = bytes >= static_cast<ssize_t>(offset + size - start);
+  if (result)
+    data->assign(static_cast<char*>(buffer) + (offset - start), size);
+
+  free(buffer);
+  return result;
+}
+
+bool WriteAt(int fd, const char* data, size_t size, uint64_t lba) {
+  return pwrite(fd, data, size, lba * kSectorSize) ==
+      static_cast<ssize_t>(size);
+}
+
+// Brings one copy of the table on the device up to date: first the entry
+// sectors that differ from what is there, then the header, flushing after
+// each. The old header keeps covering the old entries until the new
+// entries are down, and if the entries are torn this copy just fails its
+// CRC, so the other copy has to be intact while this runs.
+bool WriteTableCopy(int fd, const string& header, uint64_t header_lba,
+                    const string& entries, uint64_t entries_lba) {
+  string old_entries(entries.size(), '\0');
+  string old_header(kSectorSize, '\0');
+
+  // What can't be read is treated as all different.
+  if (pread(fd, &old_entries[0], old_entries.size(),
+            entries_lba * kSectorSize) !=
+      static_cast<ssize_t>(old_entries.size()))
+    old_entries.clear();
+  if (pread(fd, &old_header[0], old_header.size(),
+            header_lba * kSectorSize) != static_cast<ssize_t>(kSectorSize))
+    old_header.clear();
+
+  // Changed sectors that are next to each other go in one write.
+  bool wrote_entries = false;
+  size_t sectors = entries.size() / kSectorSize;
+  for (size_t i = 0; i < sectors; i++) {
+    size_t first = i;
+    while (i < sectors &&
+           (old_entries.empty() ||
+            memcmp(&entries[i * kSectorSize], &old_entries[i * kSectorSize],
+                   kSectorSize)))
+      i++;
+    if (i == first)
+      continue;
+
+    if (!WriteAt(fd, &entries[first * kSectorSize],
+                 (i - first) * kSectorSize, entries_lba + first))
+      return false;
+    wrote_entries = true;
+  }
+
+  if (wrote_entries && fdatasync(fd))
+    return false;
+
+  if (header == old_header)
+    return true;
+
+  return WriteAt(fd, header.data(), header.size(), header_lba) &&
+         fdatasync(fd) == 0;
+}
+
+}  // namespace
 
 CgptManager::CgptManager():
-  is_initialized_(false) {
+  is_initialized_(false),
+  has_gpt_(false),
+  header_lba_(0),
+  in_transaction_(false) {
 }
 
 CgptManager::~CgptManager() {
@@ -30,6 +368,291 @@ CgptManager::~CgptManager() {
 CgptErrorCode CgptManager::Initialize(const string& device_name) {
   device_name_ = device_name;
   is_initialized_ = true;
+
+  // A blank device is fine, ClearAll and AddPartition can still make a
+  // table on it.
+  Refresh();
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::Refresh() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  has_gpt_ = false;
+  in_transaction_ = false;
+  primary_header_.clear();
+  header_.clear();
+  entries_.clear();
+  BuildIndexes();
+
+  int fd = open(device_name_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return kCgptUnknownError;
+
+  string start(kGptStartSectors * kSectorSize, '\0');
+  ssize_t bytes = pread(fd, &start[0], start.size(), 0);
+  if (bytes < static_cast<ssize_t>(2 * kSectorSize)) {
+    close(fd);
+    return kCgptUnknownError;
+  }
+  start.resize(bytes);
+  primary_header_ = start.substr(kSectorSize, kSectorSize);
+
+  has_gpt_ = ReadEntries(fd, primary_header_, 1, start, &entries_);
+  if (has_gpt_) {
+    header_ = primary_header_;
+    header_lba_ = 1;
+  }
+
+  // Fall back on the backup header in the last sector, and its entries.
+  if (!has_gpt_) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    string backup(kSectorSize, '\0');
+
+    if (end >= static_cast<off_t>(2 * kSectorSize)) {
+      uint64_t last = end / kSectorSize - 1;
+      if (pread(fd, &backup[0], backup.size(), last * kSectorSize) ==
+          static_cast<ssize_t>(kSectorSize))
+        has_gpt_ = ReadEntries(fd, backup, last, start, &entries_);
+      if (has_gpt_) {
+        header_ = backup;
+        header_lba_ = last;
+      }
+    }
+  }
+
+  close(fd);
+
+  if (!has_gpt_) {
+    entries_.clear();
+    return kCgptUnknownError;
+  }
+
+  BuildIndexes();
+  return kCgptSuccess;
+}
+
+void CgptManager::BuildIndexes() {
+  unique_id_index_.clear();
+  label_index_.clear();
+  type_index_.clear();
+
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const GptEntry& entry = entries_[i];
+    if (GuidIsZero(&entry.type))
+      continue;
+
+    uint32_t number = i + 1;
+    unique_id_index_.insert(std::make_pair(GuidKey(entry.unique), number));
+    label_index_.insert(std::make_pair(NameToLabel(entry), number));
+    type_index_[GuidKey(entry.type)].push_back(number);
+  }
+}
+
+CgptErrorCode CgptManager::IsStale(bool* is_stale) const {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!is_stale)
+    return kCgptInvalidArgument;
+
+  string sector;
+  if (!ReadPrimaryHeader(&sector))
+    return kCgptUnknownError;
+
+  *is_stale = sector != primary_header_;
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::BeginTransaction() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (in_transaction_)
+    return kCgptInvalidArgument;
+
+  // Start from what is on the device now, so the commit only fails if
+  // something changes it while we are staging.
+  CgptErrorCode result = Refresh();
+  if (result != kCgptSuccess)
+    return result;
+
+  in_transaction_ = true;
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::CommitTransaction() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!in_transaction_)
+    return kCgptInvalidArgument;
+
+  in_transaction_ = false;
+
+  int fd = open(device_name_.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    Refresh();
+    return kCgptUnknownError;
+  }
+
+  // Someone else wrote the table since we read it; our changes would
+  // undo theirs.
+  string sector(kSectorSize, '\0');
+  if (pread(fd, &sector[0], sector.size(), kSectorSize) !=
+          static_cast<ssize_t>(kSectorSize) ||
+      sector != primary_header_) {
+    close(fd);
+    Refresh();
+    return kCgptUnknownError;
+  }
+
+  // Both copies of the table are laid out from whichever header was valid.
+  // A backup's entries sit right before it, the way cgpt puts them.
+  const DiskGptHeader* header =
+      reinterpret_cast<const DiskGptHeader*>(header_.data());
+  size_t bytes = entries_.size() * sizeof(GptEntry);
+  uint64_t entries_sectors = (bytes + kSectorSize - 1) / kSectorSize;
+  uint64_t primary_entries_lba = 2;
+  uint64_t backup_lba = header_lba_;
+
+  if (header_lba_ == 1) {
+    primary_entries_lba = le64toh(header->entries_lba);
+    backup_lba = le64toh(header->alternate_lba);
+  }
+
+  uint64_t backup_entries_lba = backup_lba - entries_sectors;
+  if (backup_lba <= entries_sectors ||
+      backup_entries_lba < primary_entries_lba + entries_sectors) {
+    close(fd);
+    Refresh();
+    return kCgptUnknownError;
+  }
+
+  string entries(entries_sectors * kSectorSize, '\0');
+  memcpy(&entries[0], &entries_[0], bytes);
+  uint32_t entries_crc32 = Crc32(entries.data(), bytes);
+
+  string primary = MakeHeader(header_, 1, backup_lba, primary_entries_lba,
+                              entries_crc32);
+  string backup = MakeHeader(header_, backup_lba, 1, backup_entries_lba,
+                             entries_crc32);
+
+  // The copy the snapshot wasn't read from goes first, so that there is
+  // always one valid copy: the one we read while the other is rewritten,
+  // then the new other one while it is. Normally that means the backup
+  // first; with a damaged primary the backup is the only valid copy, so
+  // the primary is rebuilt before the backup is touched. Only what
+  // changed is written.
+  bool written;
+  if (header_lba_ == 1) {
+    written =
+        WriteTableCopy(fd, backup, backup_lba, entries, backup_entries_lba) &&
+        WriteTableCopy(fd, primary, 1, entries, primary_entries_lba);
+  } else {
+    written =
+        WriteTableCopy(fd, primary, 1, entries, primary_entries_lba) &&
+        WriteTableCopy(fd, backup, backup_lba, entries, backup_entries_lba);
+  }
+  close(fd);
+
+  Refresh();
+  return written ? kCgptSuccess : kCgptUnknownError;
+}
+
+CgptErrorCode CgptManager::EndTransaction(CgptErrorCode result) {
+  if (result == kCgptSuccess)
+    return CommitTransaction();
+
+  AbortTransaction();
+  return result;
+}
+
+CgptErrorCode CgptManager::AbortTransaction() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!in_transaction_)
+    return kCgptInvalidArgument;
+
+  return Refresh();
+}
+
+CgptErrorCode CgptManager::Flush() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!has_gpt_ || in_transaction_)
+    return kCgptUnknownError;
+
+  int fd = open(device_name_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return kCgptUnknownError;
+
+  // fsync sends a block device a cache flush too; BLKFLSBUF drops its
+  // buffers, which files don't have.
+  bool flushed = fsync(fd) == 0 &&
+                 (ioctl(fd, BLKFLSBUF, 0) == 0 || errno == ENOTTY);
+  close(fd);
+  if (!flushed)
+    return kCgptUnknownError;
+
+  // Filesystems that can't do O_DIRECT (tmpfs) have nothing underneath
+  // to read back from anyway.
+  fd = open(device_name_.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(device_name_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return kCgptUnknownError;
+
+  const DiskGptHeader* header =
+      reinterpret_cast<const DiskGptHeader*>(header_.data());
+  size_t bytes = entries_.size() * sizeof(GptEntry);
+  string sector, entries;
+
+  bool matches =
+      ReadDirect(fd, header_lba_ * kSectorSize, kSectorSize, &sector) &&
+      ReadDirect(fd, le64toh(header->entries_lba) * kSectorSize, bytes,
+                 &entries) &&
+      sector == header_ && !memcmp(entries.data(), &entries_[0], bytes);
+  close(fd);
+
+  return matches ? kCgptSuccess : kCgptUnknownError;
+}
+
+CgptErrorCode CgptManager::GetStagedEntry(uint32_t partition_number,
+                                          GptEntry** entry) {
+  const GptEntry* snapshot_entry;
+  CgptErrorCode result = GetEntry(partition_number, &snapshot_entry);
+  if (result != kCgptSuccess)
+    return result;
+
+  *entry = &entries_[partition_number - 1];
+  return kCgptSuccess;
+}
+
+bool CgptManager::ReadPrimaryHeader(string* sector) const {
+  int fd = open(device_name_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  sector->assign(kSectorSize, '\0');
+  ssize_t bytes = pread(fd, &(*sector)[0], kSectorSize, kSectorSize);
+  close(fd);
+  return bytes == static_cast<ssize_t>(kSectorSize);
+}
+
+CgptErrorCode CgptManager::GetEntry(uint32_t partition_number,
+                                    const GptEntry** entry) const {
+  if (!has_gpt_)
+    return kCgptUnknownError;
+
+  // Partitions are numbered from 1.
+  if (partition_number < 1 || partition_number > entries_.size())
+    return kCgptInvalidArgument;
+
+  *entry = &entries_[partition_number - 1];
   return kCgptSuccess;
 }
 
@@ -47,6 +670,7 @@ CgptErrorCode CgptManager::ClearAll() {
   if (retval != CGPT_OK)
     return kCgptUnknownError;
 
+  Refresh();
   return kCgptSuccess;
 }
 
@@ -82,6 +706,7 @@ CgptErrorCode CgptManager::AddPartition(const string& label,
   if (retval != CGPT_OK)
     return kCgptUnknownError;
 
+  Refresh();
   return kCgptSuccess;
 }
 
@@ -92,16 +717,16 @@ CgptErrorCode CgptManager::GetNumNonEmptyPartitions(uint8_t* num_partitions) con
   if (!num_partitions)
     return kCgptInvalidArgument;
 
-  CgptShowParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  int retval = CgptGetNumNonEmptyPartitions(&params);
-
-  if (retval != CGPT_OK)
+  if (!has_gpt_)
     return kCgptUnknownError;
 
-  *num_partitions = params.num_partitions;
+  uint8_t count = 0;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (!GuidIsZero(&entries_[i].type))
+      count++;
+  }
+
+  *num_partitions = count;
   return kCgptSuccess;
 }
 
@@ -155,19 +780,19 @@ CgptErrorCode CgptManager::SetSuccessful(
   if (!is_initialized_)
     return kCgptNotInitialized;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  params.successful = is_successful;
-  params.set_successful = true;
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetSuccessful(partition_number, is_successful);
+    return EndTransaction(result);
+  }
 
-  int retval = CgptSetAttributes(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
+  SetAttribute(entry, kSuccessfulOffset, kSuccessfulMask, is_successful);
   return kCgptSuccess;
 }
 
@@ -179,17 +804,12 @@ CgptErrorCode CgptManager::GetSuccessful(uint32_t partition_number,
   if (!is_successful)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  *is_successful = params.successful;
+  *is_successful = GetAttribute(*entry, kSuccessfulOffset, kSuccessfulMask);
   return kCgptSuccess;
 }
 
@@ -198,19 +818,22 @@ CgptErrorCode CgptManager::SetNumTriesLeft(uint32_t partition_number,
   if (!is_initialized_)
     return kCgptNotInitialized;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetNumTriesLeft(partition_number, numTries);
+    return EndTransaction(result);
+  }
 
-  params.tries = numTries;
-  params.set_tries = true;
+  if (numTries < 0 || static_cast<uint64_t>(numTries) > kTriesMask)
+    return kCgptInvalidArgument;
 
-  int retval = CgptSetAttributes(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
+  SetAttribute(entry, kTriesOffset, kTriesMask, numTries);
   return kCgptSuccess;
 }
 
@@ -222,17 +845,12 @@ CgptErrorCode CgptManager::GetNumTriesLeft(uint32_t partition_number,
   if (!numTries)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
-
-  *numTries = params.tries;
+  *numTries = GetAttribute(*entry, kTriesOffset, kTriesMask);
   return kCgptSuccess;
 }
 
@@ -241,19 +859,22 @@ CgptErrorCode CgptManager::SetPriority(uint32_t partition_number,
   if (!is_initialized_)
     return kCgptNotInitialized;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetPriority(partition_number, priority);
+    return EndTransaction(result);
+  }
 
-  params.priority = priority;
-  params.set_priority = true;
+  if (priority > kPriorityMask)
+    return kCgptInvalidArgument;
 
-  int retval = CgptSetAttributes(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
+  SetAttribute(entry, kPriorityOffset, kPriorityMask, priority);
   return kCgptSuccess;
 }
 
@@ -265,17 +886,12 @@ CgptErrorCode CgptManager::GetPriority(uint32_t partition_number,
   if (!priority)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
-
-  *priority = params.priority;
+  *priority = GetAttribute(*entry, kPriorityOffset, kPriorityMask);
   return kCgptSuccess;
 }
 
@@ -287,17 +903,12 @@ CgptErrorCode CgptManager::GetBeginningOffset(uint32_t partition_number,
   if (!offset)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  *offset = params.begin;
+  *offset = le64toh(entry->starting_lba);
   return kCgptSuccess;
 }
 
@@ -309,17 +920,12 @@ CgptErrorCode CgptManager::GetNumSectors(uint32_t partition_number,
   if (!num_sectors)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
-
-  *num_sectors = params.size;
+  *num_sectors = le64toh(entry->ending_lba) - le64toh(entry->starting_lba) + 1;
   return kCgptSuccess;
 }
 
@@ -331,17 +937,12 @@ CgptErrorCode CgptManager::GetPartitionTypeId(uint32_t partition_number,
   if (!type_id)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  *type_id = params.type_guid;
+  *type_id = entry->type;
   return kCgptSuccess;
 }
 
@@ -353,17 +954,12 @@ CgptErrorCode CgptManager::GetPartitionUniqueId(uint32_t partition_number,
   if (!unique_id)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
-
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.partition = partition_number;
-
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
-    return kCgptUnknownError;
+  const GptEntry* entry;
+  CgptErrorCode result = GetEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
 
-  *unique_id = params.unique_guid;
+  *unique_id = entry->unique;
   return kCgptSuccess;
 }
 
@@ -376,54 +972,237 @@ CgptErrorCode CgptManager::GetPartitionNumberByUniqueId(
   if (!partition_number)
     return kCgptInvalidArgument;
 
-  CgptAddParams params;
-  memset(&params, 0, sizeof(params));
+  if (!has_gpt_)
+    return kCgptUnknownError;
 
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.unique_guid = unique_id;
-  params.set_unique = 1;
+  NumberIndex::const_iterator it = unique_id_index_.find(GuidKey(unique_id));
+  if (it == unique_id_index_.end())
+    return kCgptUnknownError;
 
-  int retval = CgptGetPartitionDetails(&params);
-  if (retval != CGPT_OK)
+  *partition_number = it->second;
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::GetPartitionNumberByLabel(
+                    const string& label,
+                    uint32_t* partition_number) const {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!partition_number)
+    return kCgptInvalidArgument;
+
+  if (!has_gpt_)
     return kCgptUnknownError;
 
-  *partition_number = params.partition;
+  NumberIndex::const_iterator it = label_index_.find(label);
+  if (it == label_index_.end())
+    return kCgptUnknownError;
+
+  *partition_number = it->second;
   return kCgptSuccess;
 }
 
-CgptErrorCode CgptManager::SetHighestPriority(uint32_t partition_number,
-                                              uint8_t highest_priority) {
+CgptErrorCode CgptManager::GetPartitionNumbersByType(
+                    const Guid& type_id,
+                    vector<uint32_t>* partition_numbers) const {
   if (!is_initialized_)
     return kCgptNotInitialized;
 
-  CgptPrioritizeParams params;
-  memset(&params, 0, sizeof(params));
+  if (!partition_numbers)
+    return kCgptInvalidArgument;
 
-  params.drive_name = const_cast<char *>(device_name_.c_str());
-  params.set_partition = partition_number;
-  params.max_priority = highest_priority;
+  if (!has_gpt_)
+    return kCgptUnknownError;
 
-  int retval = CgptPrioritize(&params);
-  if (retval != CGPT_OK)
+  NumbersIndex::const_iterator it = type_index_.find(GuidKey(type_id));
+  if (it == type_index_.end())
+    partition_numbers->clear();
+  else
+    *partition_numbers = it->second;
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::GetAllPartitions(
+                    vector<CgptPartition>* partitions) const {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!partitions)
+    return kCgptInvalidArgument;
+
+  if (!has_gpt_)
     return kCgptUnknownError;
 
+  partitions->clear();
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const GptEntry& entry = entries_[i];
+    if (GuidIsZero(&entry.type))
+      continue;
+
+    CgptPartition partition;
+    memset(&partition, 0, sizeof(partition));
+    partition.number = i + 1;
+    partition.type = entry.type;
+    partition.unique_id = entry.unique;
+    partition.beginning_offset = le64toh(entry.starting_lba);
+    partition.num_sectors =
+        le64toh(entry.ending_lba) - le64toh(entry.starting_lba) + 1;
+    partition.priority = GetAttribute(entry, kPriorityOffset, kPriorityMask);
+    partition.tries = GetAttribute(entry, kTriesOffset, kTriesMask);
+    partition.successful =
+        GetAttribute(entry, kSuccessfulOffset, kSuccessfulMask);
+
+    // The longest name always fits.
+    string label = NameToLabel(entry);
+    memcpy(partition.label, label.data(), label.size());
+
+    partitions->push_back(partition);
+  }
   return kCgptSuccess;
 }
 
+CgptErrorCode CgptManager::SetHighestPriority(uint32_t partition_number,
+                                              uint8_t highest_priority) {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = StageHighestPriority(partition_number, highest_priority);
+    return EndTransaction(result);
+  }
+
+  return StageHighestPriority(partition_number, highest_priority);
+}
+
 CgptErrorCode CgptManager::SetHighestPriority(uint32_t partition_number) {
-  // The internal implementation in CgptPrioritize automatically computes the
-  // right priority number if we supply 0 for the highest_priority argument.
+  // StageHighestPriority automatically computes the right priority number if
+  // we supply 0 for the highest_priority argument.
   return SetHighestPriority(partition_number, 0);
 }
 
-CgptErrorCode CgptManager::Validate() {
+CgptErrorCode CgptManager::StageHighestPriority(uint32_t partition_number,
+                                                uint8_t highest_priority) {
+  if (highest_priority > kMaxPriority)
+    return kCgptInvalidArgument;
+
+  GptEntry* target;
+  CgptErrorCode result = GetStagedEntry(partition_number, &target);
+  if (result != kCgptSuccess)
+    return result;
+
+  if (!GuidEquals(target->type, kChromeOSKernelType) &&
+      !GuidEquals(target->type, kCoreOSUsrType))
+    return kCgptInvalidArgument;
+
+  // The same ranking CgptPrioritize does: the partitions of the target's
+  // type, grouped by priority, highest first, with the target alone above
+  // all of them. Partitions at priority 0 are left there.
+  std::map<uint64_t, vector<GptEntry*>, std::greater<uint64_t> > groups;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    GptEntry* entry = &entries_[i];
+    if (entry == target)
+      groups[kPriorityMask + 1].push_back(entry);
+    else if (GuidEquals(entry->type, target->type))
+      groups[GetAttribute(*entry, kPriorityOffset,
+                          kPriorityMask)].push_back(entry);
+  }
+  groups.erase(0);
+
+  // Without a highest priority the groups count down to 1, but never
+  // from above the most there can be.
+  uint64_t priority = highest_priority;
+  if (!priority)
+    priority = std::min<uint64_t>(groups.size(), kMaxPriority);
+
+  std::map<uint64_t, vector<GptEntry*>, std::greater<uint64_t> >::iterator it;
+  for (it = groups.begin(); it != groups.end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); i++)
+      SetAttribute(it->second[i], kPriorityOffset, kPriorityMask, priority);
+    if (priority > 1)
+      priority--;
+  }
+
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::SetLabel(uint32_t partition_number,
+                                    const string& label) {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetLabel(partition_number, label);
+    return EndTransaction(result);
+  }
+
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
+
+  uint16_t name[sizeof(entry->name) / sizeof(entry->name[0])];
+  if (!LabelToName(label, name, sizeof(name) / sizeof(name[0])))
+    return kCgptInvalidArgument;
+
+  memcpy(entry->name, name, sizeof(name));
+  BuildIndexes();
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::SetPartitionTypeId(uint32_t partition_number,
+                                              const Guid& type_id) {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
+
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetPartitionTypeId(partition_number, type_id);
+    return EndTransaction(result);
+  }
+
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
+
+  entry->type = type_id;
+  BuildIndexes();
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::SetPartitionUniqueId(uint32_t partition_number,
+                                                const Guid& unique_id) {
   if (!is_initialized_)
     return kCgptNotInitialized;
 
-  uint8_t num_partitions;
+  if (!in_transaction_) {
+    CgptErrorCode result = BeginTransaction();
+    if (result == kCgptSuccess)
+      result = SetPartitionUniqueId(partition_number, unique_id);
+    return EndTransaction(result);
+  }
+
+  GptEntry* entry;
+  CgptErrorCode result = GetStagedEntry(partition_number, &entry);
+  if (result != kCgptSuccess)
+    return result;
+
+  entry->unique = unique_id;
+  BuildIndexes();
+  return kCgptSuccess;
+}
+
+CgptErrorCode CgptManager::Validate() {
+  if (!is_initialized_)
+    return kCgptNotInitialized;
 
-  // GetNumNonEmptyPartitions does the check for GptSanityCheck.
-  // so call it (ignore the num_partitions result) and just return
-  // its success/failure result.
-  return GetNumNonEmptyPartitions(&num_partitions);
+  // Refresh checks the signatures and CRCs of the headers and entries,
+  // and re-reading means this checks the device rather than the snapshot.
+  return Refresh();
 }
@@ -6,6 +6,8 @@
 #define VBOOT_REFERENCE_CGPT_CGPTMANAGER_H_
 
 #include <string>
+#include <tr1/unordered_map>
+#include <vector>
 #include "gpt.h"
 
 // This file defines a simple C++ wrapper class interface for the cgpt methods.
@@ -19,9 +21,35 @@ typedef enum CgptErrorCode
   kCgptInvalidArgument = 3,
 } CgptErrorCode;
 
+// Room for the longest label a GPT entry can hold, 36 UTF-16 code units,
+// in UTF-8 and NUL terminated.
+const size_t kCgptMaxLabelSize = 36 * 3 + 1;
+
+// All of the fields of one partition table entry, decoded.
+struct CgptPartition {
+  uint32_t number;
+  Guid type;
+  Guid unique_id;
+  uint64_t beginning_offset;
+  uint64_t num_sectors;
+  uint8_t priority;
+  uint8_t tries;
+  bool successful;
+  char label[kCgptMaxLabelSize];
+};
 
 // CgptManager exposes methods to manipulate the Guid Partition Table as needed
 // for ChromeOS scenarios.
+//
+// The partition table is read once, by Initialize, into an in-memory
+// snapshot that answers all of the Get methods without touching the device.
+// Changes made through this object refresh the snapshot; Refresh picks up
+// changes made by anything else, and IsStale tells if there were any.
+//
+// The Set methods for partition attributes, labels and GUIDs write only
+// the sectors of the table they change. Between BeginTransaction and
+// CommitTransaction they only change the snapshot, and CommitTransaction
+// writes them all out at once.
 class CgptManager {
   public:
     // Default constructor. The Initialize method must be called before
@@ -35,10 +63,56 @@ class CgptManager {
     // with the Guid Partition Table of that device. This is the first method
     // that should be called on this class.  Otherwise those methods will
     // return kCgptNotInitialized.
+    // A device without a valid GPT (yet) still initializes, but the Get
+    // methods fail until there is one.
     // Returns kCgptSuccess or an appropriate error code.
     // This device is automatically closed when this object is destructed.
     CgptErrorCode Initialize(const std::string& device_name);
 
+    // Re-reads the GPT from the device into the snapshot, for when something
+    // other than this object may have changed it. Uses the backup header
+    // and entries if the primary ones are damaged.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode Refresh();
+
+    // Populates is_stale with whether the primary GPT header on the device
+    // differs from the one the snapshot was read with. The header holds the
+    // CRC of the entries, so this catches any change to the table while
+    // reading just one sector.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode IsStale(bool* is_stale) const;
+
+    // Starts staging changes in the snapshot instead of writing each one.
+    // SetSuccessful, SetNumTriesLeft, SetPriority, SetHighestPriority,
+    // SetLabel, SetPartitionTypeId and SetPartitionUniqueId are staged; the
+    // Get methods return the staged values. Re-reads the table first.
+    // Refresh, Validate and the changes that still go straight to the
+    // device (ClearAll, AddPartition) end the transaction and drop
+    // what was staged.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode BeginTransaction();
+
+    // Writes everything staged since BeginTransaction, with new CRCs:
+    // first the copy of the table the snapshot wasn't read from (the
+    // backup, or the primary if it was damaged), then the other, each as
+    // only the entry sectors that changed followed by the header, flushing
+    // the device after each step so a crash always leaves one valid copy.
+    // If the table on the device changed since the transaction began,
+    // nothing is written, the staged changes are dropped and this fails.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode CommitTransaction();
+
+    // Drops everything staged since BeginTransaction.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode AbortTransaction();
+
+    // Makes sure the table in the snapshot is durable on the device:
+    // flushes the device's buffers and write cache, then reads the valid
+    // header and its entries back from the device itself, bypassing the
+    // page cache, and checks they match.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode Flush();
+
     // Clears all the existing contents of the GPT and PMBR on the current
     // device.
     CgptErrorCode ClearAll();
@@ -138,6 +212,26 @@ class CgptManager {
                       const Guid& unique_id,
                       uint32_t* partition_number) const;
 
+    // Populates the partition_number parameter with the number of the first
+    // partition with the given label.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode GetPartitionNumberByLabel(
+                      const std::string& label,
+                      uint32_t* partition_number) const;
+
+    // Populates partition_numbers with the numbers of all the partitions of
+    // the given type, in order; it is empty if there are none.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode GetPartitionNumbersByType(
+                      const Guid& type_id,
+                      std::vector<uint32_t>* partition_numbers) const;
+
+    // Populates partitions with every non-empty partition in the table, in
+    // order, for callers that want several fields of several partitions.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode GetAllPartitions(
+                      std::vector<CgptPartition>* partitions) const;
+
     // Sets the "Priority" attribute of given kernelPartition to the value
     // specified in higestPriority parameter. In addition, also reduces the
     // priorities of all the other kernel partitions, if necessary, to ensure
@@ -155,6 +249,22 @@ class CgptManager {
     // Returns kCgptSuccess or an appropriate error code.
     CgptErrorCode SetHighestPriority(uint32_t partition_number);
 
+    // Sets the label of the given partition, given in UTF-8; at most 36
+    // UTF-16 code units fit.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode SetLabel(uint32_t partition_number,
+                           const std::string& label);
+
+    // Sets the partition type id of the given partition.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode SetPartitionTypeId(uint32_t partition_number,
+                                     const Guid& type_id);
+
+    // Sets the Guid that uniquely identifies the given partition.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode SetPartitionUniqueId(uint32_t partition_number,
+                                       const Guid& unique_id);
+
     // Runs the sanity checks on the CGPT and MBR and
     // Returns kCgptSuccess if everything is valid or an appropriate error code
     // if there's anything invalid or if there's any error encountered during
@@ -162,9 +272,54 @@ class CgptManager {
     CgptErrorCode Validate();
 
   private:
+    // Points entry at the snapshot's entry for partition_number.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode GetEntry(uint32_t partition_number,
+                           const GptEntry** entry) const;
+
+    // Points entry at the snapshot's entry for partition_number, to stage a
+    // change in it. Only valid in a transaction.
+    // Returns kCgptSuccess or an appropriate error code.
+    CgptErrorCode GetStagedEntry(uint32_t partition_number, GptEntry** entry);
+
+    // Commits the transaction a single Set method started if result is
+    // kCgptSuccess, aborts it otherwise.
+    // Returns the result of the whole change.
+    CgptErrorCode EndTransaction(CgptErrorCode result);
+
+    // Stages the new priorities SetHighestPriority sets.
+    CgptErrorCode StageHighestPriority(uint32_t partition_number,
+                                       uint8_t highest_priority);
+
+    // Reads the primary GPT header sector into sector.
+    bool ReadPrimaryHeader(std::string* sector) const;
+
+    // Rebuilds the lookup indexes below from the snapshot.
+    void BuildIndexes();
+
     std::string device_name_;
     bool is_initialized_;
 
+    // The snapshot: whether there is a valid GPT, the primary header sector
+    // as it was read (for IsStale), the valid header the entries came from
+    // and its lba, and the partition entries.
+    bool has_gpt_;
+    std::string primary_header_;
+    std::string header_;
+    uint64_t header_lba_;
+    std::vector<GptEntry> entries_;
+
+    // Partition numbers of the non-empty entries, by unique id, by label
+    // (the first one with it) and by type. Guids are keyed by their bytes.
+    typedef std::tr1::unordered_map<std::string, uint32_t> NumberIndex;
+    typedef std::tr1::unordered_map<std::string,
+                                    std::vector<uint32_t> > NumbersIndex;
+    NumberIndex unique_id_index_;
+    NumberIndex label_index_;
+    NumbersIndex type_index_;
+
+    bool in_transaction_;
+
     CgptManager(const CgptManager &);
     void operator=(const CgptManager &);
 };
@@ -0,0 +1,686 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "CgptManager.h"
+#include "chromeos_markgood.h"
+#include "inst_util.h"
+
+using std::string;
+using std::vector;
+
+class CgptManagerTest : public ::testing::Test { };
+
+const uint64_t kImageSectors = 2048;
+const uint32_t kEntryCount = 128;
+
+const Guid kKernelType =
+    {{{0xfe3a2a5d,0x4f32,0x41a7,0xb7,0x25,{0xac,0xcc,0x32,0x85,0xa3,0x09}}}};
+
+uint32_t TestCrc32(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint32_t crc = 0xffffffff;
+
+  for (size_t i = 0; i < size; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+void PutLe32(string* buffer, size_t offset, uint32_t value) {
+  value = htole32(value);
+  memcpy(&(*buffer)[offset], &value, sizeof(value));
+}
+
+void PutLe64(string* buffer, size_t offset, uint64_t value) {
+  value = htole64(value);
+  memcpy(&(*buffer)[offset], &value, sizeof(value));
+}
+
+Guid MakeGuid(uint8_t seed) {
+  Guid guid;
+  for (size_t i = 0; i < sizeof(guid.u.raw); i++)
+    guid.u.raw[i] = seed + i;
+  return guid;
+}
+
+// Entry i (partition i + 1) of the test table, or an empty one.
+GptEntry MakeEntry(uint32_t i, uint64_t priority, uint64_t tries,
+                   uint64_t successful) {
+  GptEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.type = MakeGuid(0x10 * (i + 1));
+  entry.unique = MakeGuid(0x80 + i);
+  entry.starting_lba = htole64(64 + 100 * i);
+  entry.ending_lba = htole64(64 + 100 * i + 99);
+  entry.attrs.whole = htole64(priority << 48 | tries << 52 |
+                              successful << 56);
+  return entry;
+}
+
+// A header for entries at entries_lba, written at my_lba.
+string MakeHeader(uint64_t my_lba, uint64_t alternate_lba,
+                  uint64_t entries_lba, const string& entries) {
+  string header(512, '\0');
+
+  memcpy(&header[0], "EFI PART", 8);
+  PutLe32(&header, 8, 0x00010000);
+  PutLe32(&header, 12, 92);
+  PutLe64(&header, 24, my_lba);
+  PutLe64(&header, 32, alternate_lba);
+  PutLe64(&header, 40, 34);
+  PutLe64(&header, 48, kImageSectors - 34);
+  PutLe64(&header, 72, entries_lba);
+  PutLe32(&header, 80, kEntryCount);
+  PutLe32(&header, 84, sizeof(GptEntry));
+  PutLe32(&header, 88, TestCrc32(entries.data(), entries.size()));
+  PutLe32(&header, 16, TestCrc32(header.data(), 92));
+  return header;
+}
+
+// A disk image with a primary and a backup GPT holding entries.
+string GptImage(const vector<GptEntry>& entries) {
+  string table(kEntryCount * sizeof(GptEntry), '\0');
+  memcpy(&table[0], &entries[0], entries.size() * sizeof(GptEntry));
+
+  string image(kImageSectors * 512, '\0');
+  uint64_t backup_entries = kImageSectors - 33;
+  image.replace(512, 512, MakeHeader(1, kImageSectors - 1, 2, table));
+  image.replace(2 * 512, table.size(), table);
+  image.replace(backup_entries * 512, table.size(), table);
+  image.replace((kImageSectors - 1) * 512, 512,
+                MakeHeader(kImageSectors - 1, 1, backup_entries, table));
+  return image;
+}
+
+void WriteGptImage(const string& path, const vector<GptEntry>& entries) {
+  ASSERT_TRUE(WriteStringToFile(GptImage(entries), path));
+}
+
+// Writes image as a sparse file, with holes where it is all zeros, so
+// that the blocks it uses show which sectors have been written.
+void WriteSparseImage(const string& path, const string& image) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ftruncate(fd, image.size()), 0);
+  for (size_t offset = 0; offset < image.size(); offset += 512) {
+    if (image.find_first_not_of('\0', offset) >= offset + 512)
+      continue;
+    ASSERT_EQ(pwrite(fd, &image[offset], 512, offset), 512);
+  }
+  close(fd);
+}
+
+blkcnt_t AllocatedBlocks(const string& path) {
+  struct stat st;
+  EXPECT_EQ(stat(path.c_str(), &st), 0);
+  return st.st_blocks;
+}
+
+void SetName(GptEntry* entry, const char* name) {
+  for (size_t i = 0; name[i]; i++)
+    entry->name[i] = htole16(name[i]);
+}
+
+vector<GptEntry> TestEntries() {
+  vector<GptEntry> entries;
+  entries.push_back(MakeEntry(0, 0, 0, 0));
+  entries.push_back(MakeEntry(1, 2, 0, 1));
+  entries.push_back(MakeEntry(2, 1, 5, 0));
+  // An empty slot between partitions
+  GptEntry empty;
+  memset(&empty, 0, sizeof(empty));
+  entries.push_back(empty);
+  entries.push_back(MakeEntry(4, 15, 15, 1));
+  // Two kernels to rank
+  entries[1].type = kKernelType;
+  entries[4].type = kKernelType;
+  SetName(&entries[1], "KERN-A");
+  SetName(&entries[2], "ROOT-A");
+  SetName(&entries[4], "KERN-B");
+  return entries;
+}
+
+bool GuidsEqual(const Guid& a, const Guid& b) {
+  return !memcmp(&a, &b, sizeof(a));
+}
+
+TEST(CgptManagerTest, GettersUseSnapshot) {
+  const string file = "/tmp/cgpt_image";
+  WriteGptImage(file, TestEntries());
+
+  CgptManager cgpt;
+  uint8_t priority;
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptNotInitialized);
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+
+  // Everything below comes from memory, the image is gone.
+  unlink(file.c_str());
+
+  uint8_t count;
+  EXPECT_EQ(cgpt.GetNumNonEmptyPartitions(&count), kCgptSuccess);
+  EXPECT_EQ(count, 4);
+
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+  EXPECT_EQ(cgpt.GetPriority(5, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 15);
+
+  int tries;
+  EXPECT_EQ(cgpt.GetNumTriesLeft(3, &tries), kCgptSuccess);
+  EXPECT_EQ(tries, 5);
+
+  bool successful;
+  EXPECT_EQ(cgpt.GetSuccessful(2, &successful), kCgptSuccess);
+  EXPECT_TRUE(successful);
+  EXPECT_EQ(cgpt.GetSuccessful(3, &successful), kCgptSuccess);
+  EXPECT_FALSE(successful);
+
+  uint64_t offset, sectors;
+  EXPECT_EQ(cgpt.GetBeginningOffset(3, &offset), kCgptSuccess);
+  EXPECT_EQ(offset, 264);
+  EXPECT_EQ(cgpt.GetNumSectors(3, &sectors), kCgptSuccess);
+  EXPECT_EQ(sectors, 100);
+
+  Guid guid, expected = MakeGuid(0x30);
+  EXPECT_EQ(cgpt.GetPartitionTypeId(3, &guid), kCgptSuccess);
+  EXPECT_EQ(memcmp(&guid, &expected, sizeof(guid)), 0);
+  expected = MakeGuid(0x84);
+  EXPECT_EQ(cgpt.GetPartitionUniqueId(5, &guid), kCgptSuccess);
+  EXPECT_EQ(memcmp(&guid, &expected, sizeof(guid)), 0);
+
+  uint32_t number;
+  EXPECT_EQ(cgpt.GetPartitionNumberByUniqueId(expected, &number),
+            kCgptSuccess);
+  EXPECT_EQ(number, 5);
+  EXPECT_EQ(cgpt.GetPartitionNumberByUniqueId(MakeGuid(0x1), &number),
+            kCgptUnknownError);
+
+  // Bad arguments
+  EXPECT_EQ(cgpt.GetPriority(0, &priority), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.GetPriority(kEntryCount + 1, &priority),
+            kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.GetPriority(2, NULL), kCgptInvalidArgument);
+
+  // The device is gone, so re-reading it fails.
+  bool is_stale;
+  EXPECT_EQ(cgpt.IsStale(&is_stale), kCgptUnknownError);
+  EXPECT_EQ(cgpt.Validate(), kCgptUnknownError);
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptUnknownError);
+}
+
+TEST(CgptManagerTest, RefreshPicksUpOutsideChanges) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  WriteGptImage(file, entries);
+
+  CgptManager cgpt;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+
+  bool is_stale = true;
+  EXPECT_EQ(cgpt.IsStale(&is_stale), kCgptSuccess);
+  EXPECT_FALSE(is_stale);
+
+  // Someone else bumps partition 3 to the top.
+  entries[2] = MakeEntry(2, 3, 1, 0);
+  WriteGptImage(file, entries);
+
+  EXPECT_EQ(cgpt.IsStale(&is_stale), kCgptSuccess);
+  EXPECT_TRUE(is_stale);
+  uint8_t priority;
+  EXPECT_EQ(cgpt.GetPriority(3, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 1);
+
+  EXPECT_EQ(cgpt.Refresh(), kCgptSuccess);
+  EXPECT_EQ(cgpt.IsStale(&is_stale), kCgptSuccess);
+  EXPECT_FALSE(is_stale);
+  EXPECT_EQ(cgpt.GetPriority(3, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 3);
+  EXPECT_EQ(cgpt.Validate(), kCgptSuccess);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, FallsBackOnBackupGpt) {
+  const string file = "/tmp/cgpt_image";
+  WriteGptImage(file, TestEntries());
+
+  string image;
+  ASSERT_TRUE(ReadFileToString(file, &image));
+
+  // A damaged primary entry array fails its CRC, the backup is used.
+  string damaged = image;
+  damaged[2 * 512 + sizeof(GptEntry) + 40] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+
+  CgptManager cgpt;
+  uint8_t priority;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+
+  // So is a damaged primary header.
+  damaged = image;
+  damaged[512 + 30] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+  EXPECT_EQ(cgpt.Refresh(), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetPriority(5, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 15);
+
+  // Nothing valid at all still initializes, but there is nothing to get.
+  damaged[(kImageSectors - 1) * 512] = 'X';
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+  CgptManager blank;
+  EXPECT_EQ(blank.Initialize(file), kCgptSuccess);
+  EXPECT_EQ(blank.GetPriority(2, &priority), kCgptUnknownError);
+  uint8_t count;
+  EXPECT_EQ(blank.GetNumNonEmptyPartitions(&count), kCgptUnknownError);
+  EXPECT_EQ(blank.Validate(), kCgptUnknownError);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, TransactionWritesOnce) {
+  const string file = "/tmp/cgpt_image";
+  WriteGptImage(file, TestEntries());
+
+  CgptManager cgpt, other;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  ASSERT_EQ(other.Initialize(file), kCgptSuccess);
+  EXPECT_EQ(cgpt.CommitTransaction(), kCgptInvalidArgument);
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.BeginTransaction(), kCgptInvalidArgument);
+
+  // Only kernels (and CoreOS usr partitions) are ranked.
+  EXPECT_EQ(cgpt.SetHighestPriority(3), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.SetPartitionTypeId(3, kKernelType), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetHighestPriority(2), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetNumTriesLeft(2, 1), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetSuccessful(2, false), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetLabel(3, "ROOT-\xc3\xbc"), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetPartitionUniqueId(3, MakeGuid(0x40)), kCgptSuccess);
+
+  EXPECT_EQ(cgpt.SetNumTriesLeft(2, 16), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.SetPriority(2, 16), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.SetLabel(3, string(37, 'x')), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.SetLabel(3, "\xff"), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.SetSuccessful(kEntryCount + 1, true), kCgptInvalidArgument);
+
+  // The getters see what is staged, the device doesn't have it yet.
+  uint8_t priority;
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 3);
+  EXPECT_EQ(other.Refresh(), kCgptSuccess);
+  EXPECT_EQ(other.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+
+  ASSERT_EQ(cgpt.CommitTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.CommitTransaction(), kCgptInvalidArgument);
+
+  string image;
+  ASSERT_TRUE(ReadFileToString(file, &image));
+
+  // Both copies have everything; check the backup by breaking the primary.
+  for (int copy = 0; copy < 2; copy++) {
+    EXPECT_EQ(other.Refresh(), kCgptSuccess);
+
+    // The new one first, then the others in the order they were.
+    EXPECT_EQ(other.GetPriority(2, &priority), kCgptSuccess);
+    EXPECT_EQ(priority, 3);
+    EXPECT_EQ(other.GetPriority(5, &priority), kCgptSuccess);
+    EXPECT_EQ(priority, 2);
+    EXPECT_EQ(other.GetPriority(3, &priority), kCgptSuccess);
+    EXPECT_EQ(priority, 1);
+    EXPECT_EQ(other.GetPriority(1, &priority), kCgptSuccess);
+    EXPECT_EQ(priority, 0);
+
+    int tries;
+    EXPECT_EQ(other.GetNumTriesLeft(2, &tries), kCgptSuccess);
+    EXPECT_EQ(tries, 1);
+    bool successful = true;
+    EXPECT_EQ(other.GetSuccessful(2, &successful), kCgptSuccess);
+    EXPECT_FALSE(successful);
+
+    Guid guid;
+    EXPECT_EQ(other.GetPartitionTypeId(3, &guid), kCgptSuccess);
+    EXPECT_TRUE(GuidsEqual(guid, kKernelType));
+    EXPECT_EQ(other.GetPartitionUniqueId(3, &guid), kCgptSuccess);
+    EXPECT_TRUE(GuidsEqual(guid, MakeGuid(0x40)));
+
+    string damaged = image;
+    damaged[512 + 30] ^= 1;
+    ASSERT_TRUE(WriteStringToFile(damaged, file));
+  }
+
+  // The label is UTF-16LE, zero padded.
+  const char name[] = "R\0O\0O\0T\0-\0\xfc\0\0\0";
+  EXPECT_EQ(image.compare(2 * 512 + 2 * sizeof(GptEntry) + 56,
+                          sizeof(name) - 1, name, sizeof(name) - 1), 0);
+  EXPECT_EQ(image.compare((kImageSectors - 33) * 512 +
+                          2 * sizeof(GptEntry) + 56,
+                          sizeof(name) - 1, name, sizeof(name) - 1), 0);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, TransactionKeepsOutsideChanges) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  WriteGptImage(file, entries);
+
+  CgptManager cgpt;
+  uint8_t priority;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+
+  // Aborting puts back what is on the device.
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetPriority(2, 9), kCgptSuccess);
+  EXPECT_EQ(cgpt.AbortTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.AbortTransaction(), kCgptInvalidArgument);
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+
+  // Someone else writes the table in the middle of a transaction; the
+  // commit must not undo their change.
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetPriority(2, 9), kCgptSuccess);
+  entries[4] = MakeEntry(4, 7, 15, 1);
+  WriteGptImage(file, entries);
+  EXPECT_EQ(cgpt.CommitTransaction(), kCgptUnknownError);
+
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+  EXPECT_EQ(cgpt.GetPriority(5, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 7);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, BulkQueries) {
+  const string file = "/tmp/cgpt_image";
+  WriteGptImage(file, TestEntries());
+
+  CgptManager cgpt;
+  vector<CgptPartition> partitions;
+  EXPECT_EQ(cgpt.GetAllPartitions(&partitions), kCgptNotInitialized);
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetAllPartitions(NULL), kCgptInvalidArgument);
+
+  ASSERT_EQ(cgpt.GetAllPartitions(&partitions), kCgptSuccess);
+  ASSERT_EQ(partitions.size(), 4);
+  EXPECT_EQ(partitions[0].number, 1);
+  EXPECT_EQ(partitions[1].number, 2);
+  EXPECT_EQ(partitions[3].number, 5);
+
+  const CgptPartition& root = partitions[2];
+  EXPECT_EQ(root.number, 3);
+  EXPECT_TRUE(GuidsEqual(root.type, MakeGuid(0x30)));
+  EXPECT_TRUE(GuidsEqual(root.unique_id, MakeGuid(0x82)));
+  EXPECT_EQ(root.beginning_offset, 264);
+  EXPECT_EQ(root.num_sectors, 100);
+  EXPECT_EQ(root.priority, 1);
+  EXPECT_EQ(root.tries, 5);
+  EXPECT_FALSE(root.successful);
+  EXPECT_STREQ(root.label, "ROOT-A");
+  EXPECT_STREQ(partitions[0].label, "");
+  EXPECT_TRUE(partitions[3].successful);
+
+  uint32_t number;
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("KERN-B", &number), kCgptSuccess);
+  EXPECT_EQ(number, 5);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("KERN-C", &number),
+            kCgptUnknownError);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("KERN-B", NULL),
+            kCgptInvalidArgument);
+
+  vector<uint32_t> numbers;
+  EXPECT_EQ(cgpt.GetPartitionNumbersByType(kKernelType, &numbers),
+            kCgptSuccess);
+  ASSERT_EQ(numbers.size(), 2);
+  EXPECT_EQ(numbers[0], 2);
+  EXPECT_EQ(numbers[1], 5);
+  EXPECT_EQ(cgpt.GetPartitionNumbersByType(MakeGuid(0x1), &numbers),
+            kCgptSuccess);
+  EXPECT_TRUE(numbers.empty());
+
+  // Staged changes are indexed too, and go away with the transaction.
+  const char kEmoji[] = "\xf0\x9f\x98\x80";
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetLabel(3, "ROOT-B"), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetLabel(1, kEmoji), kCgptSuccess);
+  EXPECT_EQ(cgpt.SetPartitionUniqueId(3, MakeGuid(0x40)), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("ROOT-B", &number), kCgptSuccess);
+  EXPECT_EQ(number, 3);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel(kEmoji, &number), kCgptSuccess);
+  EXPECT_EQ(number, 1);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("ROOT-A", &number),
+            kCgptUnknownError);
+  EXPECT_EQ(cgpt.GetPartitionNumberByUniqueId(MakeGuid(0x40), &number),
+            kCgptSuccess);
+  EXPECT_EQ(number, 3);
+  ASSERT_EQ(cgpt.GetAllPartitions(&partitions), kCgptSuccess);
+  EXPECT_STREQ(partitions[0].label, kEmoji);
+
+  EXPECT_EQ(cgpt.AbortTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetPartitionNumberByLabel("ROOT-A", &number), kCgptSuccess);
+  EXPECT_EQ(number, 3);
+  EXPECT_EQ(cgpt.GetPartitionNumberByUniqueId(MakeGuid(0x40), &number),
+            kCgptUnknownError);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, WritesOnlyChangedSectors) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  WriteSparseImage(file, GptImage(entries));
+  blkcnt_t blocks = AllocatedBlocks(file);
+
+  CgptManager cgpt;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+
+  // Only the sector holding entry 2 in each copy and the headers change;
+  // rewriting any of the all zero entry sectors would fill in a hole.
+  ASSERT_EQ(cgpt.SetPriority(2, 5), kCgptSuccess);
+  entries[1] = MakeEntry(1, 5, 0, 1);
+  entries[1].type = kKernelType;
+  SetName(&entries[1], "KERN-A");
+
+  string image;
+  ASSERT_TRUE(ReadFileToString(file, &image));
+  EXPECT_TRUE(image == GptImage(entries));
+  EXPECT_EQ(AllocatedBlocks(file), blocks);
+
+  // A commit with nothing to change doesn't write at all.
+  struct stat before, after;
+  ASSERT_EQ(stat(file.c_str(), &before), 0);
+  usleep(50000);
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  ASSERT_EQ(cgpt.CommitTransaction(), kCgptSuccess);
+  ASSERT_EQ(stat(file.c_str(), &after), 0);
+  EXPECT_EQ(before.st_mtim.tv_sec, after.st_mtim.tv_sec);
+  EXPECT_EQ(before.st_mtim.tv_nsec, after.st_mtim.tv_nsec);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, WritesRepairDamagedCopy) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  string image = GptImage(entries);
+
+  // A damaged backup entry sector, and header, get written out whole.
+  string damaged = image;
+  damaged[(kImageSectors - 32) * 512 + 100] ^= 1;
+  damaged[(kImageSectors - 1) * 512 + 30] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+
+  CgptManager cgpt;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  ASSERT_EQ(cgpt.SetSuccessful(3, true), kCgptSuccess);
+  entries[2] = MakeEntry(2, 1, 5, 1);
+  SetName(&entries[2], "ROOT-A");
+  ASSERT_TRUE(ReadFileToString(file, &image));
+  EXPECT_TRUE(image == GptImage(entries));
+
+  // So does a damaged primary, laid out from the backup.
+  damaged = image;
+  damaged[512 + 30] ^= 1;
+  damaged[3 * 512 + 7] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+
+  ASSERT_EQ(cgpt.SetNumTriesLeft(5, 3), kCgptSuccess);
+  entries[4] = MakeEntry(4, 15, 3, 1);
+  entries[4].type = kKernelType;
+  SetName(&entries[4], "KERN-B");
+  ASSERT_TRUE(ReadFileToString(file, &image));
+  EXPECT_TRUE(image == GptImage(entries));
+
+  unlink(file.c_str());
+}
+
+// Makes every write to the backup table fail, as a crash there would
+// leave it, by capping the file size below where the backup starts.
+class FailBackupWrites {
+ public:
+  FailBackupWrites() {
+    old_handler_ = signal(SIGXFSZ, SIG_IGN);
+    getrlimit(RLIMIT_FSIZE, &old_limit_);
+    struct rlimit limit = old_limit_;
+    limit.rlim_cur = (kImageSectors - 33) * 512;
+    setrlimit(RLIMIT_FSIZE, &limit);
+  }
+
+  ~FailBackupWrites() {
+    setrlimit(RLIMIT_FSIZE, &old_limit_);
+    signal(SIGXFSZ, old_handler_);
+  }
+
+ private:
+  struct rlimit old_limit_;
+  sighandler_t old_handler_;
+};
+
+TEST(CgptManagerTest, WritesValidCopyLast) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  string image = GptImage(entries);
+  ASSERT_TRUE(WriteStringToFile(image, file));
+
+  CgptManager cgpt;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+
+  // With both copies valid the backup goes first; failing there leaves
+  // the primary untouched.
+  {
+    FailBackupWrites fail;
+    EXPECT_EQ(cgpt.SetPriority(2, 5), kCgptUnknownError);
+  }
+  string written;
+  ASSERT_TRUE(ReadFileToString(file, &written));
+  EXPECT_TRUE(written == image);
+
+  // With a damaged primary the backup is the only valid copy, so the
+  // primary is rebuilt in full before the backup is written.
+  string damaged = image;
+  damaged[512 + 30] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+  ASSERT_EQ(cgpt.Refresh(), kCgptSuccess);
+  {
+    FailBackupWrites fail;
+    EXPECT_EQ(cgpt.SetPriority(2, 5), kCgptUnknownError);
+  }
+
+  vector<GptEntry> updated = entries;
+  updated[1] = MakeEntry(1, 5, 0, 1);
+  updated[1].type = kKernelType;
+  SetName(&updated[1], "KERN-A");
+  string expected = GptImage(updated);
+  size_t backup_start = (kImageSectors - 33) * 512;
+  ASSERT_TRUE(ReadFileToString(file, &written));
+  EXPECT_TRUE(written.compare(0, backup_start, expected, 0, backup_start) ==
+              0);
+  EXPECT_TRUE(written.compare(backup_start, string::npos, image,
+                              backup_start, string::npos) == 0);
+
+  // Both copies are valid again, and the backup still holds the old table.
+  uint8_t priority;
+  ASSERT_EQ(cgpt.Refresh(), kCgptSuccess);
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 5);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, FlushReadsBackTable) {
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  WriteGptImage(file, entries);
+
+  CgptManager cgpt;
+  EXPECT_EQ(cgpt.Flush(), kCgptNotInitialized);
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  ASSERT_EQ(cgpt.SetPriority(3, 4), kCgptSuccess);
+  EXPECT_EQ(cgpt.Flush(), kCgptSuccess);
+
+  // Not while changes are only staged.
+  ASSERT_EQ(cgpt.BeginTransaction(), kCgptSuccess);
+  EXPECT_EQ(cgpt.Flush(), kCgptUnknownError);
+  ASSERT_EQ(cgpt.AbortTransaction(), kCgptSuccess);
+
+  // The device no longer has the table in the snapshot.
+  WriteGptImage(file, entries);
+  EXPECT_EQ(cgpt.Flush(), kCgptUnknownError);
+  EXPECT_EQ(cgpt.Refresh(), kCgptSuccess);
+  EXPECT_EQ(cgpt.Flush(), kCgptSuccess);
+
+  unlink(file.c_str());
+}
+
+TEST(CgptManagerTest, MarkGoodRoot) {
+  // Partition 2 of the image is its device name with a 2 on the end.
+  const string file = "/tmp/cgpt_image";
+  vector<GptEntry> entries = TestEntries();
+  entries[1] = MakeEntry(1, 1, 2, 0);
+  entries[1].type = kKernelType;
+  WriteGptImage(file, entries);
+
+  EXPECT_TRUE(MarkGoodRoot(file + "2"));
+
+  CgptManager cgpt;
+  ASSERT_EQ(cgpt.Initialize(file), kCgptSuccess);
+  bool successful;
+  EXPECT_EQ(cgpt.GetSuccessful(2, &successful), kCgptSuccess);
+  EXPECT_TRUE(successful);
+  int tries;
+  EXPECT_EQ(cgpt.GetNumTriesLeft(2, &tries), kCgptSuccess);
+  EXPECT_EQ(tries, 0);
+  uint8_t priority;
+  EXPECT_EQ(cgpt.GetPriority(2, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 2);
+  EXPECT_EQ(cgpt.GetPriority(5, &priority), kCgptSuccess);
+  EXPECT_EQ(priority, 1);
+
+  // Not a kernel, not a partition, no table.
+  EXPECT_FALSE(MarkGoodRoot(file + "3"));
+  EXPECT_FALSE(MarkGoodRoot(file));
+  EXPECT_FALSE(MarkGoodRoot("/tmp/no_such_image2"));
+
+  unlink(file.c_str());
+}
@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "inst_util.h"
@@ -13,6 +14,7 @@
 #include "CgptManager.h"
 
 using std::string;
+using std::vector;
 
 bool RunLegacyBootloaderInstall(const InstallConfig& install_config) {
   printf("Running LegacyPostInstall\n");
@@ -26,9 +28,6 @@ bool RunLegacyBootloaderInstall(const InstallConfig& install_config) {
   string menu_to = StringPrintf("%s/boot/grub/menu.lst",
                                     install_config.boot.mount().c_str());
 
-  if (!CopyFile(menu_from, menu_to))
-    return false;
-
   string kernel_from = StringPrintf("%s/boot/vmlinuz",
                                     install_config.root.mount().c_str());
 
@@ -36,9 +35,6 @@ bool RunLegacyBootloaderInstall(const InstallConfig& install_config) {
                                   install_config.boot.mount().c_str(),
                                   install_config.slot.c_str());
 
-  if (!CopyFile(kernel_from, kernel_to))
-    return false;
-
   // Copy the correct root.A/B.cfg for syslinux
   string root_cfg_from = StringPrintf("%s/boot/syslinux/root.%s.cfg",
                                       install_config.root.mount().c_str(),
@@ -48,10 +44,14 @@ bool RunLegacyBootloaderInstall(const InstallConfig& install_config) {
                                     install_config.boot.mount().c_str(),
                                     install_config.slot.c_str());
 
-  if (!CopyFile(root_cfg_from, root_cfg_to))
-    return false;
+  // Copy them all at once, and only replace any of them if all of them
+  // could be copied.
+  vector<std::pair<string, string> > copies;
+  copies.push_back(std::make_pair(menu_from, menu_to));
+  copies.push_back(std::make_pair(kernel_from, kernel_to));
+  copies.push_back(std::make_pair(root_cfg_from, root_cfg_to));
 
-  return true;
+  return CopyFiles(copies);
 }
 
 
@@ -66,6 +66,14 @@ bool RunCgptInstall(const InstallConfig& install_config) {
     return false;
   }
 
+  // Both changes go out in a single write of the partition table.
+  result = cgpt_manager.BeginTransaction();
+  if (result != kCgptSuccess) {
+    printf("Unable to read the partition table of %s\n",
+           install_config.root.base_device().c_str());
+    return false;
+  }
+
   result = cgpt_manager.SetHighestPriority(install_config.root.number());
   if (result != kCgptSuccess) {
     printf("Unable to set highest priority for root %d\n",
@@ -83,9 +91,41 @@ bool RunCgptInstall(const InstallConfig& install_config) {
     return false;
   }
 
+  result = cgpt_manager.CommitTransaction();
+  if (result != kCgptSuccess) {
+    printf("Unable to write the partition table of %s\n",
+           install_config.root.base_device().c_str());
+    return false;
+  }
+
+  // Don't report success until the new boot order is on the disk itself.
+  result = cgpt_manager.Flush();
+  if (result != kCgptSuccess) {
+    printf("Unable to flush the partition table of %s\n",
+           install_config.root.base_device().c_str());
+    return false;
+  }
+
   printf("Updated root %d with highest priority and NumTriesLeft = %d\n",
          install_config.root.number(), numTries);
 
+  // Show how all the slots of the root's type now stand, from the table
+  // the commit left in the snapshot.
+  Guid root_type;
+  vector<CgptPartition> partitions;
+  if (cgpt_manager.GetPartitionTypeId(install_config.root.number(),
+                                      &root_type) == kCgptSuccess &&
+      cgpt_manager.GetAllPartitions(&partitions) == kCgptSuccess) {
+    for (size_t i = 0; i < partitions.size(); i++) {
+      const CgptPartition& partition = partitions[i];
+      if (memcmp(&partition.type, &root_type, sizeof(root_type)))
+        continue;
+      printf("  Partition %d (%s): priority %d, tries %d, successful %d\n",
+             partition.number, partition.label, partition.priority,
+             partition.tries, partition.successful);
+    }
+  }
+
   return true;
 }
 
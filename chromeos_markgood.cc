@@ -0,0 +1,64 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chromeos_markgood.h"
+
+#include <stdio.h>
+
+#include "CgptManager.h"
+#include "chromeos_install_config.h"
+
+using std::string;
+
+bool MarkGoodRoot(const string& root_dev) {
+  Partition root(root_dev);
+
+  if (root.number() < 1) {
+    printf("%s is not a partition\n", root_dev.c_str());
+    return false;
+  }
+
+  CgptManager cgpt_manager;
+
+  int result = cgpt_manager.Initialize(root.base_device());
+  if (result != kCgptSuccess) {
+    printf("Unable to initialize CgptManager\n");
+    return false;
+  }
+
+  result = cgpt_manager.BeginTransaction();
+  if (result != kCgptSuccess) {
+    printf("Unable to read the partition table of %s\n",
+           root.base_device().c_str());
+    return false;
+  }
+
+  result = cgpt_manager.SetSuccessful(root.number(), true);
+  if (result != kCgptSuccess) {
+    printf("Unable to set Successful for root %d\n", root.number());
+    return false;
+  }
+
+  result = cgpt_manager.SetNumTriesLeft(root.number(), 0);
+  if (result != kCgptSuccess) {
+    printf("Unable to set NumTriesLeft for root %d\n", root.number());
+    return false;
+  }
+
+  result = cgpt_manager.SetHighestPriority(root.number());
+  if (result != kCgptSuccess) {
+    printf("Unable to set highest priority for root %d\n", root.number());
+    return false;
+  }
+
+  result = cgpt_manager.CommitTransaction();
+  if (result != kCgptSuccess) {
+    printf("Unable to write the partition table of %s\n",
+           root.base_device().c_str());
+    return false;
+  }
+
+  printf("Marked %s as successfully booted\n", root_dev.c_str());
+  return true;
+}
@@ -0,0 +1,15 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_MARKGOOD_H_
+#define CHROMEOS_MARKGOOD_H_
+
+#include <string>
+
+// Marks root_dev as having booted successfully: successful=1, tries=0 and
+// the highest priority among partitions of its type, in a single write of
+// its disk's partition table. Returns false on error.
+bool MarkGoodRoot(const std::string& root_dev);
+
+#endif  // CHROMEOS_MARKGOOD_H_
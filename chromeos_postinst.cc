@@ -16,6 +16,7 @@
 #include "inst_util.h"
 
 using std::string;
+using std::vector;
 
 bool ConfigureInstall(
     const std::string& install_dev,
@@ -70,11 +71,15 @@ bool FirmwareUpdate(const string &install_dir, bool is_update) {
     mode = "recovery";
   }
 
-  command += " --mode=";
-  command += mode;
+  vector<string> argv;
+  argv.push_back(command);
+  argv.push_back(string("--mode=") + mode);
 
-  printf("Starting firmware updater (%s)\n", command.c_str());
-  result = system(command.c_str());
+  // The updater's own exit code, not a wait status, so that booted from B
+  // (3) can be told apart.
+  printf("Starting firmware updater (%s %s)\n", command.c_str(),
+         argv[1].c_str());
+  result = RunArgv(argv);
 
   // Next step after postinst may take a lot of time (eg, disk wiping)
   // and people may confuse that as 'firmware update takes a long wait',
@@ -139,8 +144,13 @@ bool ChromeosChrootPostinst(const InstallConfig& install_config,
          network_driver_cache.c_str());
   unlink(network_driver_cache.c_str());
 
+  // Only what we wrote: the new root's filesystem, and its superblock,
+  // written directly to the device by SetImage.
   printf("Syncing filesystems before changing boot order...\n");
-  sync();
+  SyncSet written;
+  written.AddFilesystem(install_config.root.mount());
+  written.AddFile(install_config.root.device());
+  written.Sync();  // Ignore errors, as with sync(); they are logged
 
   if (make_dev_readonly) {
     printf("Making dev %s read-only\n", install_config.root.device().c_str());
@@ -225,25 +235,32 @@ bool RunPostInstall(const string& install_dir,
     return false;
   }
 
-  printf("Syncing filesystem at end of postinst...\n");
-  sync();
-
-  // Sync doesn't appear to sync out cgpt changes, so
-  // let them flush themselves. (chromium-os:35992)
-  sleep(10);
+  // Sync only the filesystems postinst wrote to, then flush the root
+  // partition and its disk: sync() doesn't wait for the disk's own write
+  // cache, which is where cgpt changes were getting lost
+  // (chromium-os:35992).
+  printf("Syncing filesystems at end of postinst...\n");
+  SyncSet written;
+  written.AddFilesystem(install_config.root.mount());
+  written.AddFilesystem("/media/state");
+  written.AddDevice(install_config.root.device());
+  written.AddDevice(install_config.root.base_device());
+  written.Sync();  // Ignore errors, as with sync(); they are logged
 
   install_config.boot.set_mount("/tmp/boot_mnt");
 
-  string cmd;
+  string boot_dev = install_config.boot.device();
+  string boot_mount = install_config.boot.mount();
 
-  cmd = StringPrintf("/bin/mkdir -p %s",
-                     install_config.boot.mount().c_str());
-  RUN_OR_RETURN_FALSE(cmd);
+  // Run without a shell, so nothing in the paths is ever reinterpreted.
+  const char* mkdir_argv[] = { "/bin/mkdir", "-p", boot_mount.c_str() };
+  if (RunArgv(vector<string>(mkdir_argv, mkdir_argv + 3)) != 0)
+    return false;
 
-  cmd = StringPrintf("/bin/mount %s %s",
-                     install_config.boot.device().c_str(),
-                     install_config.boot.mount().c_str());
-  RUN_OR_RETURN_FALSE(cmd);
+  const char* mount_argv[] = { "/bin/mount", boot_dev.c_str(),
+                               boot_mount.c_str() };
+  if (RunArgv(vector<string>(mount_argv, mount_argv + 3)) != 0)
+    return false;
 
   bool success = true;
 
@@ -252,10 +269,14 @@ bool RunPostInstall(const string& install_dir,
     success = false;
   }
 
-  cmd = StringPrintf("/bin/umount %s",
-                     install_config.boot.device().c_str());
-  if (RunCommand(cmd.c_str()) != 0) {
-    printf("Cmd: '%s' failed.\n", cmd.c_str());
+  // The boot files were synced as they were copied; don't leave anything
+  // else written to the boot partition to the unmount.
+  written.AddFilesystem(install_config.boot.mount());
+  written.Sync();
+
+  const char* umount_argv[] = { "/bin/umount", boot_dev.c_str() };
+  if (RunArgv(vector<string>(umount_argv, umount_argv + 2)) != 0) {
+    printf("Cmd: '/bin/umount %s' failed.\n", boot_dev.c_str());
     success = false;
   }
 
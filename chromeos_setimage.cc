@@ -55,6 +55,10 @@ bool SetImage(const InstallConfig& install_config) {
   // keep the updater from needing to manage them explicitly.
   // Instead, rootfs integrity will be validated on next boot through
   // the verified kernel configuration.
+  // When the payload ships its own tree, chromeos_verity_install_tree
+  // can put it in place instead. It checks the tree against the root
+  // hash without reading the filesystem; "cros_installer verify" can
+  // check the data later, off the update's critical path.
 
   bool enable_rootfs_verification = 0;
 
@@ -6,135 +6,2394 @@
 /* pread and pwrite want this */
 #define _GNU_SOURCE 1
 
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <verity/dm-bht.h>
 #include <verity/dm-bht-userspace.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "chromeos_verity.h"
+#include "verity_hash.h"
+#include "verity_sha256.h"
+
 #define IO_BUF_SIZE (unsigned long)(1 * 1024 * 1024)
 
-/* 512 bytes in a sector */
-#define SECTOR_SHIFT (9ULL)
+/* Largest read issued when the device is opened with O_DIRECT */
+#define DIRECT_IO_MAX_SIZE (unsigned long)(8 * 1024 * 1024)
+
+/* 512 bytes in a sector */
+#define SECTOR_SHIFT (9ULL)
+
+/* dm-bht hashes whole pages, whatever blocksize the caller reads with */
+#define BHT_PAGE_SIZE 4096
+
+/* Finished tree pages of one level collected into a single write */
+#define TREE_WRITE_PAGES 32
+
+/* Blocks spread over the filesystem that go into its cache fingerprint */
+#define CACHE_SAMPLES 64
+
+/* Longest line in the root hash cache */
+#define CACHE_LINE_SIZE 1024
+
+/* Bits of the ext2/3/4 superblock the cache fingerprint looks at */
+#define EXT_SUPERBLOCK_OFFSET 1024
+#define EXT_S_WTIME 0x30
+#define EXT_S_MAGIC 0x38
+#define EXT_S_UUID 0x68
+#define EXT_S_KBYTES_WRITTEN 0x178
+#define EXT_MAGIC 0xef53
+
+/* One io_size buffer passed back and forth between the reader and the */
+/* hashing workers, along with the digests of the blocks in it. */
+struct verity_chunk {
+  uint8_t *buffer;
+  uint8_t *digests;
+  uint64_t first_block;
+  size_t count;  /* bytes of data currently in buffer */
+  uint64_t seq;  /* position of this chunk in the job's read order */
+  int hole;      /* a hole in the file, nothing was read into buffer */
+  size_t zero_blocks;  /* all-zero blocks the worker didn't hash */
+};
+
+/* A fixed size fifo of chunks. Only used with verity_job.lock held. */
+struct verity_queue {
+  struct verity_chunk **slots;
+  unsigned size;
+  unsigned head;
+  unsigned used;
+};
+
+struct verity_job;
+
+/* Takes the digests of one hashed chunk. Called for one chunk at a time, */
+/* in read order, whatever order the workers finish hashing them in. */
+typedef int (*verity_consume_fn)(struct verity_job *job,
+                                 const struct verity_chunk *chunk);
+
+/* State shared by the reader and all of the hashing threads of one */
+/* chromeos_verity call. */
+struct verity_job {
+  int fd;
+  /* If set, the data is streamed in from image_fd instead of being read */
+  /* from fd, and written to fd by the workers on its way to being hashed. */
+  int write_data;
+  int image_fd;
+  unsigned blocksize;
+  unsigned digest_size;
+  const struct verity_extent *extents;  /* sorted runs of blocks to hash */
+  size_t extent_count;
+  size_t io_size;       /* bytes per read, a multiple of blocksize */
+  uint64_t bytes_read;  /* only touched by the reader */
+  uint64_t read_seq;    /* only touched by the reader */
+  /* compiled-in hasher for the algorithm, NULL to go through libdm-bht */
+  const struct verity_hasher *hasher;
+  /* All-zero blocks all have the same digest, computed just once. Only */
+  /* used when blocks are whole dm-bht pages. */
+  int skip_zero;
+  uint8_t zero_digest[DM_BHT_MAX_DIGEST_SIZE];
+  int seek_holes;        /* find holes with SEEK_DATA and SEEK_HOLE */
+  uint64_t hole_blocks;  /* only touched by the reader */
+  uint64_t zero_blocks;  /* all-zero blocks consumed, including holes */
+  verity_consume_fn consume;
+  void *consume_ctx;
+  /* Token bucket limiting reads to max_bytes_per_sec, if that is set. */
+  /* Only touched by the reader. */
+  uint64_t max_bytes_per_sec;
+  double tokens;
+  struct timespec refill;
+  volatile sig_atomic_t *cancel;  /* stop reading once this is set */
+
+  pthread_mutex_t lock;
+  pthread_cond_t filled_cond;  /* a chunk was read, or reading stopped */
+  pthread_cond_t free_cond;    /* a chunk was consumed and can be reused */
+  struct verity_queue free_chunks;
+  struct verity_queue filled_chunks;
+  /* hashed chunks waiting for the ones before them, by seq % queue size */
+  struct verity_chunk **hashed;
+  uint64_t consume_seq;  /* seq of the next chunk to consume */
+  int consuming;         /* a worker is busy consuming chunks */
+  int done_reading;
+  int error;  /* first error seen by any thread, 0 if none */
+};
+
+/* Each worker has a one page dm_bht of its own, just for its hash context. */
+/* The digests go into the chunk and are put in the tree by consume. */
+struct verity_worker {
+  pthread_t thread;
+  struct verity_job *job;
+  struct dm_bht bht;
+  uint8_t *page;
+};
+
+static void verity_queue_push(struct verity_queue *queue,
+                              struct verity_chunk *chunk)
+{
+  queue->slots[(queue->head + queue->used) % queue->size] = chunk;
+  queue->used++;
+}
+
+static struct verity_chunk *verity_queue_pop(struct verity_queue *queue)
+{
+  struct verity_chunk *chunk = queue->slots[queue->head];
+
+  queue->head = (queue->head + 1) % queue->size;
+  queue->used--;
+  return chunk;
+}
+
+static void verity_job_fail(struct verity_job *job, int error)
+{
+  pthread_mutex_lock(&job->lock);
+  if (!job->error)
+    job->error = error;
+  /* wake everybody up so they notice */
+  pthread_cond_broadcast(&job->filled_cond);
+  pthread_cond_broadcast(&job->free_cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Finds out whether block is in a hole of a sparse image file, and */
+/* moves *end_block in to where that hole, or the data, stops. Partly */
+/* allocated blocks count as data. Turns hole finding off for good if */
+/* the filesystem can't do it. */
+static int verity_find_hole(struct verity_job *job, uint64_t block,
+                            uint64_t *end_block)
+{
+  off_t offset = block * job->blocksize;
+  off_t data, hole;
+  uint64_t end;
+
+  data = lseek(job->fd, offset, SEEK_DATA);
+  if (data < 0) {
+    /* no data at all from here to the end of the file */
+    if (errno == ENXIO)
+      return 1;
+    job->seek_holes = 0;
+    return 0;
+  }
+
+  end = data / job->blocksize;
+  if (end > block) {
+    if (end < *end_block)
+      *end_block = end;
+    return 1;
+  }
+
+  hole = lseek(job->fd, offset, SEEK_HOLE);
+  if (hole < 0) {
+    job->seek_holes = 0;
+    return 0;
+  }
+
+  end = (hole + job->blocksize - 1) / job->blocksize;
+  if (end > block && end < *end_block)
+    *end_block = end;
+  return 0;
+}
+
+/* Reads count bytes from a pipe or file at its current offset. Only */
+/* returns less at the end of the input, or -1 on errors. */
+static ssize_t verity_read_stream(int fd, uint8_t *buf, size_t count)
+{
+  size_t done = 0;
+
+  while (done < count) {
+    ssize_t readb = read(fd, buf + done, count - done);
+
+    if (readb < 0 && errno == EINTR)
+      continue;
+    if (readb < 0)
+      return -1;
+    if (readb == 0)
+      break;
+    done += readb;
+  }
+
+  return done;
+}
+
+/* Waits until count more bytes may be read without going over the job's */
+/* rate. The bucket holds up to a second's worth of reads, or one read */
+/* if that is more, so the rate is kept on average without stalling. */
+static void verity_throttle(struct verity_job *job, size_t count)
+{
+  double rate = job->max_bytes_per_sec;
+  double burst = rate > job->io_size ? rate : job->io_size;
+  struct timespec now, wait;
+  double seconds;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  job->tokens += rate * ((now.tv_sec - job->refill.tv_sec) +
+                         (now.tv_nsec - job->refill.tv_nsec) / 1e9);
+  if (job->tokens > burst)
+    job->tokens = burst;
+  job->refill = now;
+
+  job->tokens -= count;
+  if (job->tokens >= 0)
+    return;
+
+  /* the deficit is paid back by the refill after the sleep */
+  seconds = -job->tokens / rate;
+  wait.tv_sec = (time_t)seconds;
+  wait.tv_nsec = (long)((seconds - wait.tv_sec) * 1e9);
+  while (nanosleep(&wait, &wait) && errno == EINTR &&
+         !(job->cancel && *job->cancel))
+    ;
+}
+
+/* Reads the job's extents front to back into whichever chunks are free, */
+/* keeping up to queue depth reads ahead of the hashing workers. A chunk */
+/* never spans two extents. Holes in image files aren't read at all. */
+static void verity_read_chunks(struct verity_job *job)
+{
+  size_t i;
+
+  for (i = 0; i < job->extent_count; i++) {
+    uint64_t cur_block = job->extents[i].first_block;
+    uint64_t end_block = cur_block + job->extents[i].count;
+
+    while (cur_block < end_block) {
+      struct verity_chunk *chunk;
+      ssize_t readb = 0;
+      uint64_t run_end = end_block;
+      int hole = job->seek_holes &&
+                 verity_find_hole(job, cur_block, &run_end);
+      size_t count = (run_end - cur_block) * job->blocksize;
+
+      if (count > job->io_size)
+        count = job->io_size;
+
+      if (job->cancel && *job->cancel) {
+        printf("%s: stopping at block %" PRIu64 "\n", __func__, cur_block);
+        verity_job_fail(job, -EINTR);
+        goto done;
+      }
+      if (job->max_bytes_per_sec && !hole)
+        verity_throttle(job, count);
+
+      pthread_mutex_lock(&job->lock);
+      while (!job->error && !job->free_chunks.used)
+        pthread_cond_wait(&job->free_cond, &job->lock);
+      if (job->error) {
+        pthread_mutex_unlock(&job->lock);
+        goto done;
+      }
+      chunk = verity_queue_pop(&job->free_chunks);
+      pthread_mutex_unlock(&job->lock);
+
+      if (hole)
+        job->hole_blocks += count / job->blocksize;
+      else if (job->write_data)
+        readb = verity_read_stream(job->image_fd, chunk->buffer, count);
+      else
+        readb = pread(job->fd, chunk->buffer, count,
+                      cur_block * job->blocksize);
+      if (readb < 0) {
+        int error = errno;
+        printf("%s: read returned error %s\n", __func__, strerror(error));
+        verity_job_fail(job, error);
+        goto done;
+      }
+      if (job->write_data && (size_t)readb != count) {
+        printf("%s: image ended after %" PRIu64 " of %" PRIu64 " bytes\n",
+               __func__, job->bytes_read + readb,
+               (job->extents[i].first_block + job->extents[i].count) *
+               job->blocksize);
+        verity_job_fail(job, -EIO);
+        goto done;
+      }
+
+      chunk->first_block = cur_block;
+      chunk->count = count;
+      chunk->seq = job->read_seq++;
+      chunk->hole = hole;
+      cur_block += count / job->blocksize;
+      job->bytes_read += readb;
+
+      pthread_mutex_lock(&job->lock);
+      verity_queue_push(&job->filled_chunks, chunk);
+      pthread_cond_signal(&job->filled_cond);
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+done:
+  pthread_mutex_lock(&job->lock);
+  job->done_reading = 1;
+  pthread_cond_broadcast(&job->filled_cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Algorithms only verity_hasher implements, by their kernel names, and */
+/* one libdm-bht knows with the same digest size. Where the digests go in */
+/* a tree depends on nothing but their size, so libdm-bht lays out these */
+/* trees as if for the stand-in and every block and page is hashed by the */
+/* hasher, which always exists for them. */
+static const struct {
+  const char *alg;
+  const char *layout_alg;
+} verity_hasher_algs[] = {
+  { "blake2b-256", "sha256" },
+  { "blake2b-512", "sha512" },
+  { "blake2s-256", "sha256" },
+};
+
+/* dm_bht_create, with any algorithm verity_hasher or libdm-bht knows. */
+static int verity_bht_create(struct dm_bht *bht, unsigned int block_count,
+                             const char *alg)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(verity_hasher_algs) / sizeof(verity_hasher_algs[0]);
+       i++) {
+    if (!strcmp(alg, verity_hasher_algs[i].alg)) {
+      alg = verity_hasher_algs[i].layout_alg;
+      break;
+    }
+  }
+  return dm_bht_create(bht, block_count, alg);
+}
+
+/* Hashes one 4k page with the salt, the way dm-bht hashes blocks and */
+/* tree pages. Uses hasher if there is one, otherwise stores the page as */
+/* block 0 of a single page scratch tree. */
+static int verity_hash_page(const struct verity_hasher *hasher,
+                            struct dm_bht *scratch, uint8_t *page,
+                            uint8_t *digest)
+{
+  int ret;
+
+  if (hasher)
+    return verity_hasher_blocks(hasher, page, 1, digest);
+
+  ret = dm_bht_store_block(scratch, 0, page);
+
+  if (ret) {
+    printf("%s: dm_bht_store_block returned error %d\n", __func__, ret);
+    return ret;
+  }
+  memcpy(digest, scratch->levels[0].entries[0].nodes, scratch->digest_size);
+  return 0;
+}
+
+/* Whether size bytes at buf are all zero. buf is 16 byte aligned and */
+/* size a multiple of 64, like any block. */
+static int verity_is_zero(const uint8_t *buf, size_t size)
+{
+#ifdef __SSE2__
+  const __m128i *p = (const __m128i *)buf;
+  const __m128i *end = p + size / sizeof(*p);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; p < end; p += 4) {
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_load_si128(p),
+                                          _mm_load_si128(p + 1)),
+                             _mm_or_si128(_mm_load_si128(p + 2),
+                                          _mm_load_si128(p + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+      return 0;
+  }
+#else
+  const uint64_t *p = (const uint64_t *)buf;
+  const uint64_t *end = p + size / sizeof(*p);
+
+  for (; p < end; p += 8) {
+    if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+      return 0;
+  }
+#endif
+  return 1;
+}
+
+/* Hashes count blocks at data into digests. */
+static int verity_hash_blocks(struct verity_worker *worker, uint8_t *data,
+                              size_t count, uint8_t *digests)
+{
+  struct verity_job *job = worker->job;
+  struct dm_bht *bht = &worker->bht;
+  size_t i;
+  int ret;
+
+  /* Same digests as dm_bht_store_block, but several blocks at a time. */
+  if (job->hasher && job->blocksize == BHT_PAGE_SIZE) {
+    ret = verity_hasher_blocks(job->hasher, data, count, digests);
+    if (ret)
+      printf("%s: verity_hasher_blocks returned error %d\n", __func__, ret);
+    return ret;
+  }
+
+  for (i = 0; i < count; i++) {
+    if ((ret = verity_hash_page(job->hasher, bht, data + i * job->blocksize,
+                                digests + i * job->digest_size)))
+      return ret;
+  }
+
+  return 0;
+}
+
+/* Fills in the digests of all of the blocks in chunk. Runs of zero */
+/* blocks get the precomputed zero digest instead of being hashed. */
+static int verity_hash_chunk(struct verity_worker *worker,
+                             struct verity_chunk *chunk)
+{
+  struct verity_job *job = worker->job;
+  size_t count = chunk->count / job->blocksize;
+  size_t i = 0;
+  int ret;
+
+  chunk->zero_blocks = 0;
+  if (!job->skip_zero)
+    return verity_hash_blocks(worker, chunk->buffer, count, chunk->digests);
+
+  while (i < count) {
+    size_t run = 0;
+
+    while (i < count &&
+           (chunk->hole || verity_is_zero(chunk->buffer + i * job->blocksize,
+                                          job->blocksize))) {
+      memcpy(chunk->digests + i * job->digest_size, job->zero_digest,
+             job->digest_size);
+      chunk->zero_blocks++;
+      i++;
+    }
+
+    while (i + run < count &&
+           !verity_is_zero(chunk->buffer + (i + run) * job->blocksize,
+                           job->blocksize))
+      run++;
+
+    if (run && (ret = verity_hash_blocks(worker,
+                                         chunk->buffer + i * job->blocksize,
+                                         run, chunk->digests +
+                                              i * job->digest_size)))
+      return ret;
+    i += run;
+  }
+
+  return 0;
+}
+
+/* Queues a hashed chunk for consume. Whichever worker finds the next chunk */
+/* in read order ready consumes it, and any after it that are ready too, */
+/* then gives them back to the reader. */
+static void verity_finish_chunk(struct verity_job *job,
+                                struct verity_chunk *chunk)
+{
+  unsigned size = job->free_chunks.size;
+  int ret;
+
+  pthread_mutex_lock(&job->lock);
+  job->hashed[chunk->seq % size] = chunk;
+  if (job->consuming) {
+    pthread_mutex_unlock(&job->lock);
+    return;
+  }
+
+  job->consuming = 1;
+  while (!job->error && (chunk = job->hashed[job->consume_seq % size])) {
+    job->hashed[job->consume_seq % size] = NULL;
+    pthread_mutex_unlock(&job->lock);
+
+    ret = job->consume(job, chunk);
+
+    pthread_mutex_lock(&job->lock);
+    job->zero_blocks += chunk->zero_blocks;
+    if (ret && !job->error) {
+      job->error = ret;
+      pthread_cond_broadcast(&job->filled_cond);
+      pthread_cond_broadcast(&job->free_cond);
+    }
+    job->consume_seq++;
+    verity_queue_push(&job->free_chunks, chunk);
+    pthread_cond_signal(&job->free_cond);
+  }
+  job->consuming = 0;
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Writes the data of a streamed chunk to where it belongs on the device. */
+static int verity_write_chunk(struct verity_job *job,
+                              const struct verity_chunk *chunk)
+{
+  ssize_t written = pwrite(job->fd, chunk->buffer, chunk->count,
+                           chunk->first_block * job->blocksize);
+
+  if (written != (ssize_t)chunk->count) {
+    printf("%s: writing block %" PRIu64 " failed %s\n", __func__,
+           chunk->first_block, written < 0 ? strerror(errno) : "short write");
+    return written < 0 ? errno : -EIO;
+  }
+  return 0;
+}
+
+static void *verity_worker_main(void *arg)
+{
+  struct verity_worker *worker = arg;
+  struct verity_job *job = worker->job;
+
+  while (1) {
+    struct verity_chunk *chunk;
+    int ret;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->error && !job->filled_chunks.used && !job->done_reading)
+      pthread_cond_wait(&job->filled_cond, &job->lock);
+    if (job->error || !job->filled_chunks.used) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    chunk = verity_queue_pop(&job->filled_chunks);
+    pthread_mutex_unlock(&job->lock);
+
+    if ((job->write_data && (ret = verity_write_chunk(job, chunk))) ||
+        (ret = verity_hash_chunk(worker, chunk))) {
+      verity_job_fail(job, ret);
+      break;
+    }
+    verity_finish_chunk(job, chunk);
+  }
+
+  return NULL;
+}
+
+static unsigned verity_thread_count(const struct verity_options *opts,
+                                    uint64_t blocks, unsigned blocksize,
+                                    size_t io_size)
+{
+  uint64_t chunks = (blocks * blocksize + io_size - 1) / io_size;
+  long threads = opts ? (long)opts->threads : 0;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  if (threads > VERITY_MAX_THREADS)
+    threads = VERITY_MAX_THREADS;
+  /* no point in threads that would never get a chunk */
+  if ((uint64_t)threads > chunks)
+    threads = chunks ? (long)chunks : 1;
+
+  return (unsigned)threads;
+}
+
+static unsigned verity_queue_depth(const struct verity_options *opts,
+                                   unsigned threads)
+{
+  unsigned depth = opts ? opts->queue_depth : 0;
+
+  /* by default keep every worker busy with one more read in flight */
+  if (!depth)
+    depth = threads + 1;
+  if (depth < 2)
+    depth = 2;
+  if (depth > VERITY_MAX_QUEUE_DEPTH)
+    depth = VERITY_MAX_QUEUE_DEPTH;
+
+  return depth;
+}
+
+/* Copies the options that apply to the reader into job. */
+static void verity_job_options(struct verity_job *job,
+                               const struct verity_options *opts)
+{
+  if (!opts)
+    return;
+  job->max_bytes_per_sec = opts->max_bytes_per_sec;
+  job->cancel = opts->cancel;
+}
+
+/* Picks the read size for fd. Buffered reads use IO_BUF_SIZE and let the */
+/* kernel readahead do the rest. O_DIRECT reads get no readahead, so they */
+/* are sized to the largest request the device queue accepts, rounded to */
+/* its optimal io size. Fails if the device can't do direct io in */
+/* blocksize units. */
+static int verity_io_size(int fd, unsigned blocksize, int direct,
+                          size_t *io_size)
+{
+  struct stat st;
+  unsigned short max_sectors = 0;
+  unsigned int io_opt = 0;
+  int logical_size = 0;
+  size_t size = IO_BUF_SIZE;
+
+  *io_size = size;
+  if (!direct)
+    return 0;
+
+  if (fstat(fd, &st)) {
+    printf("%s: fstat failed %s\n", __func__, strerror(errno));
+    return errno;
+  }
+
+  if (!S_ISBLK(st.st_mode)) {
+    if (st.st_blksize && blocksize % st.st_blksize) {
+      printf("%s: blocksize %u is not aligned to %lu\n", __func__, blocksize,
+             (unsigned long)st.st_blksize);
+      return -EINVAL;
+    }
+    return 0;
+  }
+
+  if (ioctl(fd, BLKSSZGET, &logical_size) == 0 && logical_size > 0 &&
+      blocksize % logical_size) {
+    printf("%s: blocksize %u is not aligned to the %d byte sectors\n",
+           __func__, blocksize, logical_size);
+    return -EINVAL;
+  }
+
+  if (ioctl(fd, BLKSECTGET, &max_sectors) == 0 &&
+      ((size_t)max_sectors << SECTOR_SHIFT) > size)
+    size = (size_t)max_sectors << SECTOR_SHIFT;
+
+  if (ioctl(fd, BLKIOOPT, &io_opt) == 0 && io_opt && size % io_opt)
+    size += io_opt - size % io_opt;
+
+  if (size > DIRECT_IO_MAX_SIZE)
+    size = DIRECT_IO_MAX_SIZE;
+  size -= size % blocksize;
+
+  *io_size = size;
+  return 0;
+}
+
+/* Hashes the data blocks in the job's extents and hands their digests to */
+/* job->consume. The calling thread reads the data ahead into a ring of */
+/* queue_depth buffers while a pool of worker threads hashes the ones */
+/* already read, so reading and hashing overlap. The caller fills in the */
+/* device parameters and consumer of job. */
+static int verity_hash_leaves(struct verity_job *job, const char *alg,
+                              const char *salt, unsigned threads,
+                              unsigned queue_depth)
+{
+  struct verity_worker *workers;
+  struct verity_chunk *chunks;
+  size_t digests_size = job->io_size / job->blocksize * job->digest_size;
+  unsigned started = 0;
+  unsigned i;
+  int ret = 0;
+
+  job->free_chunks.size = queue_depth;
+  job->filled_chunks.size = queue_depth;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->filled_cond, NULL);
+  pthread_cond_init(&job->free_cond, NULL);
+
+  workers = calloc(threads, sizeof(*workers));
+  chunks = calloc(queue_depth, sizeof(*chunks));
+  job->free_chunks.slots = calloc(queue_depth, sizeof(struct verity_chunk *));
+  job->filled_chunks.slots = calloc(queue_depth,
+                                    sizeof(struct verity_chunk *));
+  job->hashed = calloc(queue_depth, sizeof(struct verity_chunk *));
+  if (!workers || !chunks || !job->free_chunks.slots ||
+      !job->filled_chunks.slots || !job->hashed) {
+    printf("%s: calloc failed\n", __func__);
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  for (i = 0; i < queue_depth; i++) {
+    if ((ret = posix_memalign((void**)&chunks[i].buffer, job->blocksize,
+                              job->io_size))) {
+      printf("%s: posix_memalign io_buffer failed %d\n", __func__, ret);
+      goto out;
+    }
+    if (!(chunks[i].digests = malloc(digests_size))) {
+      printf("%s: malloc digests failed\n", __func__);
+      ret = -ENOMEM;
+      goto out;
+    }
+    verity_queue_push(&job->free_chunks, &chunks[i]);
+  }
+
+  for (i = 0; i < threads; i++) {
+    struct verity_worker *worker = &workers[i];
+
+    worker->job = job;
+    /* like the main tree, these are never destroyed (see below); */
+    /* two blocks make a tree that is a single leaf page */
+    if ((ret = verity_bht_create(&worker->bht, 2, alg))) {
+      printf("%s: dm_bht_create failed %d\n", __func__, ret);
+      goto out;
+    }
+    dm_bht_set_read_cb(&worker->bht, dm_bht_zeroread_callback);
+    dm_bht_set_salt(&worker->bht, salt);
+    if (!(worker->page = malloc(dm_bht_sectors(&worker->bht) <<
+                                SECTOR_SHIFT))) {
+      printf("%s: malloc failed\n", __func__);
+      ret = -ENOMEM;
+      goto out;
+    }
+    dm_bht_set_buffer(&worker->bht, worker->page);
+  }
+
+  /* blocks smaller than a page are hashed together with their neighbours */
+  job->skip_zero = job->blocksize == BHT_PAGE_SIZE;
+  if (job->skip_zero) {
+    struct stat st;
+
+    memset(chunks[0].buffer, 0, BHT_PAGE_SIZE);
+    if ((ret = verity_hash_page(job->hasher, &workers[0].bht,
+                                chunks[0].buffer, job->zero_digest)))
+      goto out;
+    /* a streamed image has to be written out in full, holes and all */
+    job->seek_holes = !job->write_data && !fstat(job->fd, &st) &&
+                      S_ISREG(st.st_mode);
+  }
+
+  job->tokens = job->io_size;
+  clock_gettime(CLOCK_MONOTONIC, &job->refill);
+
+  for (started = 0; started < threads; started++) {
+    if ((ret = pthread_create(&workers[started].thread, NULL,
+                              verity_worker_main, &workers[started]))) {
+      printf("%s: pthread_create failed %d\n", __func__, ret);
+      verity_job_fail(job, ret);
+      break;
+    }
+  }
+
+  verity_read_chunks(job);
+
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  ret = job->error;
+
+out:
+  if (chunks) {
+    for (i = 0; i < queue_depth; i++) {
+      free(chunks[i].buffer);
+      free(chunks[i].digests);
+    }
+  }
+  if (workers) {
+    for (i = 0; i < threads; i++)
+      free(workers[i].page);
+  }
+  free(chunks);
+  free(job->hashed);
+  free(job->free_chunks.slots);
+  free(job->filled_chunks.slots);
+  free(workers);
+  pthread_cond_destroy(&job->free_cond);
+  pthread_cond_destroy(&job->filled_cond);
+  pthread_mutex_destroy(&job->lock);
+  return ret;
+}
+
+/* Opens device with flags, adding O_DIRECT if *direct is set. Clears */
+/* *direct if the device can't do it. */
+static int verity_open(const char *device, int flags, int *direct)
+{
+  int fd = open(device, flags | (*direct ? O_DIRECT : 0));
+
+  if (fd < 0 && *direct && errno == EINVAL) {
+    printf("%s: %s does not support O_DIRECT, using buffered io\n", __func__,
+           device);
+    *direct = 0;
+    fd = open(device, flags);
+  }
+  if (fd < 0) {
+    int error = errno;
+    printf("%s error opening %s: %s\n", __func__, device, strerror(error));
+    errno = error;
+  }
+  return fd;
+}
+
+/* The compiled-in hasher for the tree's algorithm and salt, or NULL if */
+/* there isn't one and pages have to be hashed through libdm-bht. */
+static struct verity_hasher *verity_tree_hasher(const char *alg,
+                                                const struct dm_bht *bht)
+{
+  struct verity_hasher *hasher =
+      verity_hasher_create(alg, bht->salt,
+                           bht->have_salt ? sizeof(bht->salt) : 0,
+                           BHT_PAGE_SIZE);
+
+  /* it had better agree with libdm-bht about what alg is */
+  if (hasher && verity_hasher_digest_size(hasher) != bht->digest_size) {
+    verity_hasher_free(hasher);
+    hasher = NULL;
+  }
+  return hasher;
+}
+
+/* Compares a hex root digest with the expected one, if asked to. */
+static int verity_check_root(const uint8_t *digest, const char *expected,
+                             unsigned digest_size, int warn)
+{
+  if (warn && memcmp(digest, expected, digest_size)) {
+    printf("Filesystem hash verification failed\n");
+    printf("Expected %s != %s\n",digest, expected);
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes the hex form of a size byte digest and a nul into hex. */
+static void verity_hexdigest(const uint8_t *digest, unsigned size,
+                             uint8_t *hex)
+{
+  unsigned i;
+
+  for (i = 0; i < size; i++)
+    sprintf((char *)hex + 2 * i, "%02hhx", digest[i]);
+}
+
+/* Peak resident set size of this process so far, in KiB. */
+static uint64_t verity_peak_rss_kb(void)
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return usage.ru_maxrss;
+}
+
+/* The pages of one tree level that haven't been written out yet: the */
+/* finished ones, followed by the page being filled. Once max_pages are */
+/* finished they are written out together. */
+struct verity_builder_level {
+  uint8_t *pages;
+  unsigned max_pages;
+  unsigned full_pages;   /* finished pages waiting to be written */
+  unsigned fill;         /* digests so far in the page being filled */
+  unsigned first_entry;  /* entry number of pages[0] within the level */
+};
+
+/* Builds the tree level by level from the leaf digests in block order. */
+/* Each finished page is hashed into its parent right away and written */
+/* out with the other finished pages of its level, while the data is */
+/* still being hashed. Memory use depends on the tree depth, not the */
+/* size of the filesystem. The top page is kept back until the root hash */
+/* has been checked, and whatever top page an earlier build left is */
+/* zeroed before any lower level is written, so a build that fails part */
+/* way, or on the root hash, leaves a tree that validates against no root */
+/* rather than new levels under an old top page. */
+struct verity_builder {
+  const struct dm_bht *bht;  /* only used for the geometry */
+  const struct verity_hasher *hasher;  /* hashes finished pages, */
+  struct dm_bht *scratch;              /* or if it is NULL this does */
+  int fd;
+  off_t tree_offset;
+  struct verity_builder_level *levels;
+  uint8_t root[DM_BHT_MAX_DIGEST_SIZE];
+  uint64_t bytes_written;
+  int top_invalidated;
+};
+
+static int verity_builder_init(struct verity_builder *builder,
+                               const struct dm_bht *bht,
+                               const struct verity_hasher *hasher,
+                               struct dm_bht *scratch, int fd,
+                               off_t tree_offset)
+{
+  int depth;
+
+  memset(builder, 0, sizeof(*builder));
+  builder->bht = bht;
+  builder->hasher = hasher;
+  builder->scratch = scratch;
+  builder->fd = fd;
+  builder->tree_offset = tree_offset;
+  builder->levels = calloc(bht->depth, sizeof(*builder->levels));
+  if (!builder->levels)
+    return -ENOMEM;
+
+  for (depth = 0; depth < bht->depth; depth++) {
+    struct verity_builder_level *level = &builder->levels[depth];
+    size_t size;
+
+    level->max_pages = TREE_WRITE_PAGES;
+    if (level->max_pages > bht->levels[depth].count)
+      level->max_pages = bht->levels[depth].count;
+    size = level->max_pages * BHT_PAGE_SIZE;
+    if (posix_memalign((void**)&level->pages, BHT_PAGE_SIZE, size)) {
+      level->pages = NULL;
+      return -ENOMEM;
+    }
+    memset(level->pages, 0, size);
+  }
+
+  return 0;
+}
+
+static void verity_builder_free(struct verity_builder *builder)
+{
+  int depth;
+
+  if (!builder->levels)
+    return;
+  for (depth = 0; depth < builder->bht->depth; depth++)
+    free(builder->levels[depth].pages);
+  free(builder->levels);
+  builder->levels = NULL;
+}
+
+/* Zeroes the top page on the device and makes that durable. It isn't */
+/* counted in bytes_written, which is the size of the tree itself. */
+static int verity_builder_invalidate_top(struct verity_builder *builder)
+{
+  static uint8_t zero_page[BHT_PAGE_SIZE]
+      __attribute__((aligned(BHT_PAGE_SIZE)));
+  off_t offset = builder->tree_offset +
+                 (builder->bht->levels[0].sector << SECTOR_SHIFT);
+  ssize_t written = pwrite(builder->fd, zero_page, sizeof(zero_page), offset);
+
+  if (written != (ssize_t)sizeof(zero_page)) {
+    printf("%s: clearing the old top page failed %s\n", __func__,
+           written < 0 ? strerror(errno) : "short write");
+    return written < 0 ? errno : -EIO;
+  }
+  if (fdatasync(builder->fd)) {
+    printf("%s: fdatasync failed %s\n", __func__, strerror(errno));
+    return errno;
+  }
+
+  builder->top_invalidated = 1;
+  return 0;
+}
+
+/* Writes out the finished pages of a level, in one request. */
+static int verity_builder_flush(struct verity_builder *builder, int depth)
+{
+  struct verity_builder_level *level = &builder->levels[depth];
+  size_t len = level->full_pages * BHT_PAGE_SIZE;
+  off_t offset = builder->tree_offset +
+                 (builder->bht->levels[depth].sector << SECTOR_SHIFT) +
+                 (off_t)level->first_entry * BHT_PAGE_SIZE;
+  ssize_t written;
+  int ret;
+
+  if (!len)
+    return 0;
+
+  if (depth > 0 && !builder->top_invalidated &&
+      (ret = verity_builder_invalidate_top(builder)))
+    return ret;
+
+  written = pwrite(builder->fd, level->pages, len, offset);
+  if (written != (ssize_t)len) {
+    printf("%s: writing hash level %d failed %s\n", __func__, depth,
+           written < 0 ? strerror(errno) : "short write");
+    return written < 0 ? errno : -EIO;
+  }
+
+  builder->bytes_written += len;
+  level->first_entry += level->full_pages;
+  /* nothing is ever left in the page being filled when this is called */
+  memset(level->pages, 0, level->max_pages * BHT_PAGE_SIZE);
+  level->full_pages = 0;
+  return 0;
+}
+
+static int verity_builder_finish_page(struct verity_builder *builder,
+                                      int depth);
+
+/* Adds the digest of the next block or page to the given level. */
+static int verity_builder_push(struct verity_builder *builder, int depth,
+                               const uint8_t *digest)
+{
+  struct verity_builder_level *level = &builder->levels[depth];
+  unsigned digest_size = builder->bht->digest_size;
+  uint8_t *page = level->pages + level->full_pages * BHT_PAGE_SIZE;
+
+  memcpy(page + level->fill * digest_size, digest, digest_size);
+  /* the top page is only ever finished by verity_builder_finish */
+  if (++level->fill < builder->bht->node_count || depth == 0)
+    return 0;
+  return verity_builder_finish_page(builder, depth);
+}
+
+/* Hashes the page being filled into its parent and starts the next one. */
+static int verity_builder_finish_page(struct verity_builder *builder,
+                                      int depth)
+{
+  struct verity_builder_level *level = &builder->levels[depth];
+  uint8_t *page = level->pages + level->full_pages * BHT_PAGE_SIZE;
+  uint8_t digest[DM_BHT_MAX_DIGEST_SIZE];
+  int ret;
+
+  if ((ret = verity_hash_page(builder->hasher, builder->scratch, page,
+                              digest)))
+    return ret;
+
+  if (depth == 0) {
+    memcpy(builder->root, digest, builder->bht->digest_size);
+    return 0;
+  }
+
+  level->fill = 0;
+  level->full_pages++;
+  if (level->full_pages == level->max_pages &&
+      (ret = verity_builder_flush(builder, depth)))
+    return ret;
+
+  return verity_builder_push(builder, depth - 1, digest);
+}
+
+/* Finishes the partial page at the end of each level, zero padded like */
+/* dm_bht_compute leaves them, writes out everything but the top page and */
+/* computes the root digest. */
+static int verity_builder_finish(struct verity_builder *builder)
+{
+  int depth;
+  int ret;
+
+  for (depth = builder->bht->depth - 1; depth > 0; depth--) {
+    if (builder->levels[depth].fill &&
+        (ret = verity_builder_finish_page(builder, depth)))
+      return ret;
+    if ((ret = verity_builder_flush(builder, depth)))
+      return ret;
+  }
+
+  return verity_builder_finish_page(builder, 0);
+}
+
+/* Writes the top page, the one the root digest covers. */
+static int verity_builder_write_top(struct verity_builder *builder)
+{
+  builder->levels[0].full_pages = 1;
+  return verity_builder_flush(builder, 0);
+}
+
+/* consume for chromeos_verity: feeds the leaf digests to the builder */
+static int verity_build_chunk(struct verity_job *job,
+                              const struct verity_chunk *chunk)
+{
+  struct verity_builder *builder = job->consume_ctx;
+  int leaves = builder->bht->depth - 1;
+  size_t count = chunk->count / job->blocksize;
+  size_t i;
+  int ret;
+
+  for (i = 0; i < count; i++) {
+    if ((ret = verity_builder_push(builder, leaves,
+                                   chunk->digests + i * job->digest_size)))
+      return ret;
+  }
+
+  return 0;
+}
+
+/* The root hash cache is a text file with one line per device: */
+/* */
+/*   <device> <fs uuid> <blocks> <blocksize> <alg> <salt> <wtime> */
+/*       <kbytes written> <sampled digest> <root hash> */
+/* */
+/* Everything up to the root hash is the key. The write time and write */
+/* counter of an ext superblock change whenever the filesystem is written */
+/* through a mount, and the sampled digest covers CACHE_SAMPLES blocks */
+/* spread over the device, so a different image written in place almost */
+/* always changes the key too. It is a fingerprint, not a proof: */
+/* chromeos_verity_verify is what checks every block. */
+
+static uint32_t verity_le32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Builds the cache key of the filesystem on fd into key. */
+static int verity_cache_key(int fd, const char *device, const char *alg,
+                            unsigned blocksize, uint64_t fs_blocks,
+                            const char *salt, char *key, size_t key_size)
+{
+  uint8_t *samples = NULL;
+  uint8_t digests[CACHE_SAMPLES * VERITY_SHA256_DIGEST_SIZE];
+  uint8_t fingerprint[VERITY_SHA256_DIGEST_SIZE];
+  uint8_t uuid_hex[16 * 2 + 1], fingerprint_hex[sizeof(fingerprint) * 2 + 1];
+  uint32_t wtime = 0;
+  uint64_t kbytes_written = 0;
+  unsigned i;
+  int ret = 0;
+
+  /* aligned, the device may be open with O_DIRECT */
+  if (posix_memalign((void**)&samples, BHT_PAGE_SIZE, blocksize)) {
+    printf("%s: posix_memalign failed\n", __func__);
+    return -ENOMEM;
+  }
+
+  strcpy((char *)uuid_hex, "-");
+  for (i = 0; i < CACHE_SAMPLES; i++) {
+    uint64_t block = fs_blocks * i / CACHE_SAMPLES;
+    ssize_t readb = pread(fd, samples, blocksize, block * blocksize);
+
+    if (readb != (ssize_t)blocksize) {
+      printf("%s: reading block %" PRIu64 " failed %s\n", __func__, block,
+             readb < 0 ? strerror(errno) : "short read");
+      ret = readb < 0 ? errno : -EIO;
+      goto out;
+    }
+    if ((ret = verity_sha256_blocks(samples, blocksize, 1, NULL, 0,
+                                    digests + i * sizeof(fingerprint))))
+      goto out;
+
+    /* the first sample is block 0, which holds the superblock */
+    if (i == 0 && blocksize >= EXT_SUPERBLOCK_OFFSET * 2) {
+      const uint8_t *sb = samples + EXT_SUPERBLOCK_OFFSET;
+
+      if ((sb[EXT_S_MAGIC] | sb[EXT_S_MAGIC + 1] << 8) == EXT_MAGIC) {
+        verity_hexdigest(sb + EXT_S_UUID, 16, uuid_hex);
+        wtime = verity_le32(sb + EXT_S_WTIME);
+        kbytes_written = verity_le32(sb + EXT_S_KBYTES_WRITTEN) |
+                         (uint64_t)verity_le32(sb + EXT_S_KBYTES_WRITTEN + 4)
+                         << 32;
+      }
+    }
+  }
+
+  if ((ret = verity_sha256_blocks(digests, sizeof(digests), 1, NULL, 0,
+                                  fingerprint)))
+    goto out;
+  verity_hexdigest(fingerprint, sizeof(fingerprint), fingerprint_hex);
+
+  if (snprintf(key, key_size, "%s %s %" PRIu64 " %u %s %s %" PRIu32 " %"
+               PRIu64 " %s", device, (char *)uuid_hex, fs_blocks, blocksize, alg,
+               *salt ? salt : "-", wtime, kbytes_written,
+               (char *)fingerprint_hex) >= (int)key_size) {
+    printf("%s: cache key for %s is too long\n", __func__, device);
+    ret = -EINVAL;
+  }
+
+out:
+  free(samples);
+  return ret;
+}
+
+/* Looks up key in the cache file and copies its root hash into root. */
+/* Returns 0 if it is there. */
+static int verity_cache_lookup(const char *path, const char *key,
+                               char *root, size_t root_size)
+{
+  char line[CACHE_LINE_SIZE];
+  size_t key_len = strlen(key);
+  FILE *file = fopen(path, "r");
+  int ret = -1;
+
+  if (!file)
+    return -1;
+
+  while (fgets(line, sizeof(line), file)) {
+    char *end = line + strcspn(line, "\n");
+
+    *end = '\0';
+    if (!strncmp(line, key, key_len) && line[key_len] == ' ' &&
+        (size_t)(end - (line + key_len + 1)) < root_size) {
+      strcpy(root, line + key_len + 1);
+      ret = 0;
+      break;
+    }
+  }
+
+  fclose(file);
+  return ret;
+}
+
+/* Replaces whatever the cache file says about device with key and root. */
+/* The new file is written next to the old one and renamed over it, so a */
+/* crash leaves one or the other. */
+static int verity_cache_store(const char *path, const char *device,
+                              const char *key, const char *root)
+{
+  char line[CACHE_LINE_SIZE];
+  char *tmp_path;
+  size_t device_len = strlen(device);
+  FILE *in, *out;
+  int ret = 0;
+
+  if (!(tmp_path = malloc(strlen(path) + sizeof(".tmp")))) {
+    printf("%s: malloc failed\n", __func__);
+    return -ENOMEM;
+  }
+  sprintf(tmp_path, "%s.tmp", path);
+
+  if (!(out = fopen(tmp_path, "w"))) {
+    printf("%s: error creating %s: %s\n", __func__, tmp_path,
+           strerror(errno));
+    free(tmp_path);
+    return -1;
+  }
+
+  /* keep the entries of other devices */
+  if ((in = fopen(path, "r"))) {
+    while (fgets(line, sizeof(line), in)) {
+      if (!strncmp(line, device, device_len) && line[device_len] == ' ')
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %s\n", key, root);
+
+  if (fflush(out) || fsync(fileno(out)))
+    ret = -1;
+  if (fclose(out) || ret || rename(tmp_path, path)) {
+    printf("%s: error writing %s: %s\n", __func__, path, strerror(errno));
+    unlink(tmp_path);
+    ret = -1;
+  }
+
+  free(tmp_path);
+  return ret;
+}
+
+/* Whether the cache says the tree on fd is already right for the */
+/* filesystem. The root hash from the cache has to be the one expected, if */
+/* there is one, and has to match the top page of the tree on the device. */
+static int verity_cache_hit(int fd, const char *path, const char *key,
+                            const struct dm_bht *bht,
+                            const struct verity_hasher *hasher,
+                            struct dm_bht *scratch, off_t tree_offset,
+                            const char *expected, int warn)
+{
+  char root[DM_BHT_MAX_DIGEST_SIZE * 2 + 1];
+  uint8_t digest[DM_BHT_MAX_DIGEST_SIZE];
+  uint8_t hexdigest[DM_BHT_MAX_DIGEST_SIZE * 2 + 1];
+  uint8_t *page;
+  ssize_t readb;
+  int hit = 0;
+
+  if (verity_cache_lookup(path, key, root, sizeof(root)))
+    return 0;
+  if (warn && strcasecmp(root, expected))
+    return 0;
+
+  if (posix_memalign((void**)&page, BHT_PAGE_SIZE, BHT_PAGE_SIZE))
+    return 0;
+  readb = pread(fd, page, BHT_PAGE_SIZE,
+                tree_offset + (bht->levels[0].sector << SECTOR_SHIFT));
+  if (readb == BHT_PAGE_SIZE &&
+      !verity_hash_page(hasher, scratch, page, digest)) {
+    verity_hexdigest(digest, bht->digest_size, hexdigest);
+    hit = !strcasecmp((char *)hexdigest, root);
+  }
+
+  free(page);
+  return hit;
+}
+
+/* Builds the tree for chromeos_verity and chromeos_verity_write. The data */
+/* is read from the device, or streamed from image_fd and written to the */
+/* device on the way if image_fd isn't -1. Messages name the caller. */
+static int verity_build(const char *caller, const char *alg,
+                        const char *device, int image_fd, unsigned blocksize,
+                        uint64_t fs_blocks, const char *salt,
+                        const char *expected, int warn,
+                        const struct verity_options *opts)
+{
+  struct dm_bht bht, scratch;
+  struct verity_job job;
+  struct verity_builder builder;
+  struct verity_extent everything;
+  struct verity_hasher *hasher = NULL;
+  const char *cache_path = opts ? opts->cache_path : NULL;
+  char cache_key[CACHE_LINE_SIZE];
+  int ret, fd = -1;
+  int direct = opts && opts->direct_io;
+  uint8_t *scratch_page = NULL;
+  uint8_t digest[DM_BHT_MAX_DIGEST_SIZE * 2 + 1];
+  unsigned threads, queue_depth;
+
+  /* blocksize better be a power of two and fit into 1 MB*/
+  if (IO_BUF_SIZE % blocksize != 0) {
+    printf("%s: blocksize %% %lu != 0\n", caller,
+           IO_BUF_SIZE);
+    return -EINVAL;
+  }
+
+  /* bht only describes the shape of the tree, the pages are built by */
+  /* verity_builder. Neither tree is ever dm_bht_destroy'd, that would */
+  /* trigger a bogus assert since we supply our own buffers. */
+  if ((ret = verity_bht_create(&bht, fs_blocks, alg)) ||
+      (ret = verity_bht_create(&scratch, 2, alg))) {
+    printf("%s: dm_bht_create failed %d\n", caller, ret);
+    return ret;
+  }
+  if (bht.depth < 1) {
+    printf("%s: %" PRIu64 " blocks is too small for a tree\n", caller,
+           fs_blocks);
+    return -EINVAL;
+  }
+
+  /* we aren't going to do any automatic reading */
+  dm_bht_set_read_cb(&bht, dm_bht_zeroread_callback);
+  dm_bht_set_read_cb(&scratch, dm_bht_zeroread_callback);
+  dm_bht_set_salt(&bht, salt);
+  dm_bht_set_salt(&scratch, salt);
+
+  if (!(scratch_page = malloc(dm_bht_sectors(&scratch) << SECTOR_SHIFT))) {
+    printf("%s: malloc failed\n", caller);
+    return -ENOMEM;
+  }
+  dm_bht_set_buffer(&scratch, scratch_page);
+
+  /* In direct mode both the data reads and the tree writes bypass the */
+  /* page cache, so whatever else the host has cached stays there. */
+  fd = verity_open(device, O_RDWR, &direct);
+  if (fd < 0) {
+    ret = errno;
+    free(scratch_page);
+    return ret;
+  }
+
+  hasher = verity_tree_hasher(alg, &bht);
+  if ((ret = verity_builder_init(&builder, &bht, hasher, &scratch, fd,
+                                 fs_blocks * blocksize))) {
+    printf("%s: allocating the tree builder failed\n", caller);
+    goto out;
+  }
+
+  everything.first_block = 0;
+  everything.count = fs_blocks;
+
+  memset(&job, 0, sizeof(job));
+  job.fd = fd;
+  job.write_data = image_fd >= 0;
+  job.image_fd = image_fd;
+  job.blocksize = blocksize;
+  job.digest_size = bht.digest_size;
+  job.extents = &everything;
+  job.extent_count = 1;
+  job.consume = verity_build_chunk;
+  job.consume_ctx = &builder;
+  job.hasher = hasher;
+  verity_job_options(&job, opts);
+  if ((ret = verity_io_size(fd, blocksize, direct, &job.io_size)))
+    goto out;
+
+  /* Nothing to do if an earlier run left the right tree behind for the */
+  /* same filesystem, e.g. when postinst is retried. */
+  if (cache_path && !job.write_data) {
+    if ((ret = verity_cache_key(fd, device, alg, blocksize, fs_blocks, salt,
+                                cache_key, sizeof(cache_key))))
+      goto out;
+    if (verity_cache_hit(fd, cache_path, cache_key, &bht, hasher, &scratch,
+                         fs_blocks * blocksize, expected, warn)) {
+      printf("%s: %s is unchanged since its tree was built, nothing to do\n",
+             caller, device);
+      if (opts->stats) {
+        memset(opts->stats, 0, sizeof(*opts->stats));
+        opts->stats->cached = 1;
+      }
+      goto out;
+    }
+  }
+
+  threads = verity_thread_count(opts, fs_blocks, blocksize, job.io_size);
+  queue_depth = verity_queue_depth(opts, threads);
+  printf("%s: %s %" PRIu64 " blocks with %u threads, %u reads ahead "
+         "of %zu bytes%s\n", caller,
+         job.write_data ? "writing and hashing" : "hashing", fs_blocks,
+         threads, queue_depth, job.io_size, direct ? " (O_DIRECT)" : "");
+  if (hasher)
+    printf("%s: using %s %s\n", caller, verity_hasher_impl(hasher), alg);
+
+  if ((ret = verity_hash_leaves(&job, alg, salt, threads, queue_depth)))
+    goto out;
+
+  if ((ret = verity_builder_finish(&builder)))
+    goto out;
+
+  /* Everything below the top page is on the device already, under a */
+  /* zeroed top page, so it doesn't validate against any root until the */
+  /* right top page is written. */
+  verity_hexdigest(builder.root, bht.digest_size, digest);
+  if (verity_check_root(digest, expected, bht.digest_size, warn)) {
+    ret = -1;
+    goto out;
+  }
+
+  if ((ret = verity_builder_write_top(&builder)))
+    goto out;
+
+  /* A streamed image is only on the device to fingerprint now. Not */
+  /* being able to remember the tree just costs a rehash next time. */
+  if (cache_path &&
+      ((job.write_data &&
+        verity_cache_key(fd, device, alg, blocksize, fs_blocks, salt,
+                         cache_key, sizeof(cache_key))) ||
+       verity_cache_store(cache_path, device, cache_key, (char *)digest)))
+    printf("%s: could not update the cache in %s\n", caller, cache_path);
+
+  if (direct)
+    printf("%s: kept %" PRIu64 " bytes out of the page cache\n", caller,
+           job.bytes_read + builder.bytes_written);
+  if (job.zero_blocks)
+    printf("%s: skipped hashing %" PRIu64 " zero blocks, %" PRIu64 " of them "
+           "in holes\n", caller, job.zero_blocks, job.hole_blocks);
+  printf("%s: wrote %" PRIu64 " bytes of tree, peak rss %" PRIu64 " KiB\n",
+         caller, builder.bytes_written, verity_peak_rss_kb());
+
+  if (opts && opts->stats) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+    opts->stats->bytes_read = job.bytes_read;
+    opts->stats->bytes_written = builder.bytes_written;
+    opts->stats->data_bytes_written = job.write_data ? job.bytes_read : 0;
+    opts->stats->uncached_bytes =
+        direct ? job.bytes_read + builder.bytes_written : 0;
+    opts->stats->peak_rss_kb = verity_peak_rss_kb();
+    opts->stats->zero_blocks = job.zero_blocks;
+    opts->stats->hole_blocks = job.hole_blocks;
+  }
+
+out:
+  verity_builder_free(&builder);
+  verity_hasher_free(hasher);
+  free(scratch_page);
+  close(fd);
+  return ret;
+}
 
 int chromeos_verity(const char *alg, const char *device, unsigned blocksize,
                     uint64_t fs_blocks, const char *salt, const char *expected,
-                    int warn)
+                    int warn, const struct verity_options *opts)
 {
-  struct dm_bht bht;
-  int ret, fd;
-  uint8_t *io_buffer;
-  uint8_t *hash_buffer;
-  size_t hash_size;
+  return verity_build(__func__, alg, device, -1, blocksize, fs_blocks, salt,
+                      expected, warn, opts);
+}
+
+int chromeos_verity_write(const char *alg, int image_fd, const char *device,
+                          unsigned blocksize, uint64_t fs_blocks,
+                          const char *salt, const char *expected, int warn,
+                          const struct verity_options *opts)
+{
+  if (image_fd < 0)
+    return -EBADF;
+  return verity_build(__func__, alg, device, image_fd, blocksize, fs_blocks,
+                      salt, expected, warn, opts);
+}
+
+static int verity_extent_compare(const void *a, const void *b)
+{
+  const struct verity_extent *x = a, *y = b;
+
+  if (x->first_block != y->first_block)
+    return x->first_block < y->first_block ? -1 : 1;
+  return 0;
+}
+
+/* Sorts extents and merges the ones that overlap or touch, dropping empty */
+/* ones. Returns the new number of extents, or -1 if one runs past */
+/* fs_blocks. */
+static ssize_t verity_merge_extents(struct verity_extent *extents,
+                                    size_t count, uint64_t fs_blocks)
+{
+  size_t i, merged = 0;
+
+  for (i = 0; i < count; i++) {
+    if (extents[i].first_block > fs_blocks ||
+        extents[i].count > fs_blocks - extents[i].first_block) {
+      printf("%s: blocks %" PRIu64 "+%" PRIu64 " are past the end of the "
+             "filesystem\n", __func__, extents[i].first_block,
+             extents[i].count);
+      return -1;
+    }
+  }
+
+  qsort(extents, count, sizeof(*extents), verity_extent_compare);
+
+  for (i = 0; i < count; i++) {
+    struct verity_extent *last = merged ? &extents[merged - 1] : NULL;
+
+    if (!extents[i].count)
+      continue;
+    if (last && extents[i].first_block <= last->first_block + last->count) {
+      uint64_t end = extents[i].first_block + extents[i].count;
+      if (end > last->first_block + last->count)
+        last->count = end - last->first_block;
+      continue;
+    }
+    extents[merged++] = extents[i];
+  }
+
+  return merged;
+}
+
+/* The tree entries (pages) one level of an incremental update touches, */
+/* sorted and without duplicates. */
+struct verity_dirty_level {
+  unsigned int *entries;
+  size_t count;
+};
+
+/* Fills in the leaf entries covering extents, then the parents of each */
+/* level's entries up to the top. Returns the total number of pages. */
+static ssize_t verity_dirty_entries(const struct dm_bht *bht,
+                                    const struct verity_extent *extents,
+                                    size_t extent_count,
+                                    struct verity_dirty_level *dirty)
+{
+  struct verity_dirty_level *leaves = &dirty[bht->depth - 1];
+  unsigned int shift = bht->node_count_shift;
+  size_t i, pages;
+  int depth;
+
+  leaves->count = 0;
+  for (i = 0; i < extent_count; i++) {
+    unsigned int first = extents[i].first_block >> shift;
+    unsigned int last = (extents[i].first_block + extents[i].count - 1) >>
+                        shift;
+    leaves->count += last - first + 1;
+  }
+
+  leaves->entries = calloc(leaves->count ? leaves->count : 1,
+                           sizeof(unsigned int));
+  if (!leaves->entries)
+    return -1;
+
+  /* extents are merged, but two of them can still share a leaf page */
+  leaves->count = 0;
+  for (i = 0; i < extent_count; i++) {
+    unsigned int entry = extents[i].first_block >> shift;
+    unsigned int last = (extents[i].first_block + extents[i].count - 1) >>
+                        shift;
+    for (; entry <= last; entry++) {
+      if (!leaves->count || leaves->entries[leaves->count - 1] != entry)
+        leaves->entries[leaves->count++] = entry;
+    }
+  }
+  pages = leaves->count;
+
+  for (depth = bht->depth - 2; depth >= 0; depth--) {
+    struct verity_dirty_level *level = &dirty[depth];
+    const struct verity_dirty_level *children = &dirty[depth + 1];
+
+    level->entries = calloc(children->count ? children->count : 1,
+                            sizeof(unsigned int));
+    if (!level->entries)
+      return -1;
+    level->count = 0;
+    for (i = 0; i < children->count; i++) {
+      unsigned int entry = children->entries[i] >> shift;
+      if (!level->count || level->entries[level->count - 1] != entry)
+        level->entries[level->count++] = entry;
+    }
+    pages += level->count;
+  }
+
+  return pages;
+}
+
+/* Reads or writes the dirty pages of one level of the on-disk tree, one */
+/* request per run of consecutive pages. */
+static int verity_dirty_io(int fd, const struct dm_bht *bht, int depth,
+                           const struct verity_dirty_level *dirty,
+                           off_t tree_offset, int write, uint64_t *bytes)
+{
+  const struct dm_bht_level *level = &bht->levels[depth];
+  size_t i = 0;
+
+  while (i < dirty->count) {
+    size_t run = 1;
+    size_t len;
+    off_t offset;
+    ssize_t done;
+    uint8_t *pages = level->entries[dirty->entries[i]].nodes;
+
+    /* consecutive dirty entries were given consecutive pages */
+    while (i + run < dirty->count &&
+           dirty->entries[i + run] == dirty->entries[i] + run)
+      run++;
+
+    len = run * BHT_PAGE_SIZE;
+    offset = tree_offset + (level->sector << SECTOR_SHIFT) +
+             (off_t)dirty->entries[i] * BHT_PAGE_SIZE;
+    if (write)
+      done = pwrite(fd, pages, len, offset);
+    else
+      done = pread(fd, pages, len, offset);
+    if (done != (ssize_t)len) {
+      printf("%s: %s of hash level %d failed %s\n", __func__,
+             write ? "write" : "read", depth,
+             done < 0 ? strerror(errno) : "short transfer");
+      return done < 0 ? errno : -EIO;
+    }
+
+    *bytes += len;
+    i += run;
+  }
+
+  return 0;
+}
+
+/* consume for chromeos_verity_update: copies the leaf digests into the */
+/* tree pages read back from the disk */
+static int verity_update_chunk(struct verity_job *job,
+                               const struct verity_chunk *chunk)
+{
+  const struct dm_bht *bht = job->consume_ctx;
+  const struct dm_bht_level *leaves = &bht->levels[bht->depth - 1];
+  uint64_t block = chunk->first_block;
+  size_t left = chunk->count / job->blocksize;
+  const uint8_t *digests = chunk->digests;
+
+  /* digests are only contiguous within one leaf page */
+  while (left) {
+    unsigned index = block & (bht->node_count - 1);
+    size_t count = bht->node_count - index;
+
+    if (count > left)
+      count = left;
+    memcpy(leaves->entries[block >> bht->node_count_shift].nodes +
+           index * bht->digest_size, digests, count * bht->digest_size);
+
+    block += count;
+    digests += count * bht->digest_size;
+    left -= count;
+  }
+
+  return 0;
+}
+
+int chromeos_verity_update(const char *alg, const char *device,
+                           unsigned blocksize, uint64_t fs_blocks,
+                           const char *salt, const char *expected, int warn,
+                           const struct verity_extent *changed,
+                           size_t changed_count,
+                           const struct verity_options *opts)
+{
+  struct dm_bht bht, scratch;
+  struct verity_job job;
+  struct verity_extent *extents = NULL;
+  struct verity_dirty_level *dirty = NULL;
+  uint8_t *tree_pages = NULL, *scratch_page = NULL;
+  uint8_t root[DM_BHT_MAX_DIGEST_SIZE * 2 + 1];
   uint8_t digest[DM_BHT_MAX_DIGEST_SIZE];
-  uint64_t cur_block = 0;
+  uint64_t changed_blocks = 0, tree_bytes_read = 0, bytes_written = 0;
+  off_t tree_offset = fs_blocks * blocksize;
+  struct verity_hasher *hasher = NULL;
+  int direct = opts && opts->direct_io;
+  unsigned threads, queue_depth;
+  ssize_t extent_count, pages;
+  int ret, fd = -1, depth;
+  size_t i, j;
 
-  /* blocksize better be a power of two and fit into 1 MB*/
   if (IO_BUF_SIZE % blocksize != 0) {
-    printf("%s: blocksize %% %lu != 0\n", __func__,
-           IO_BUF_SIZE);
+    printf("%s: blocksize %% %lu != 0\n", __func__, IO_BUF_SIZE);
     return -EINVAL;
   }
 
-  /* we don't need to call dm_bht_destroy after this because we're */
-  /* supplying our own buffer -- in fact calling it will trigger a bogus */
-  /* assert */
-  if ((ret = dm_bht_create(&bht, fs_blocks, alg))) {
+  /* like chromeos_verity, neither tree is ever dm_bht_destroy'd */
+  if ((ret = verity_bht_create(&bht, fs_blocks, alg))) {
     printf("%s: dm_bht_create failed %d\n", __func__, ret);
     return ret;
   }
-
-  if ((ret = posix_memalign((void**)&io_buffer, blocksize, IO_BUF_SIZE))) {
-    printf("%s: posix_memalign io_buffer failed %d\n", __func__, ret);
-    return ret;
+  if (bht.depth < 1) {
+    printf("%s: %" PRIu64 " blocks is too small for a tree\n", __func__,
+           fs_blocks);
+    return -EINVAL;
   }
-
-  /* we aren't going to do any automatic reading */
   dm_bht_set_read_cb(&bht, dm_bht_zeroread_callback);
   dm_bht_set_salt(&bht, salt);
-  hash_size = dm_bht_sectors(&bht) << SECTOR_SHIFT;
 
-  if ((ret = posix_memalign((void**)&hash_buffer, blocksize, hash_size))) {
-    printf("%s: posix_memalign hash_buffer failed %d\n", __func__, ret);
-    free(io_buffer);
+  /* two blocks make a tree that is a single leaf page */
+  if ((ret = verity_bht_create(&scratch, 2, alg))) {
+    printf("%s: dm_bht_create failed %d\n", __func__, ret);
     return ret;
   }
-  memset(hash_buffer, 0, hash_size);
-  dm_bht_set_buffer(&bht, hash_buffer);
+  dm_bht_set_read_cb(&scratch, dm_bht_zeroread_callback);
+  dm_bht_set_salt(&scratch, salt);
+
+  extents = malloc((changed_count ? changed_count : 1) * sizeof(*extents));
+  dirty = calloc(bht.depth, sizeof(*dirty));
+  scratch_page = malloc(dm_bht_sectors(&scratch) << SECTOR_SHIFT);
+  if (!extents || !dirty || !scratch_page) {
+    printf("%s: malloc failed\n", __func__);
+    ret = -ENOMEM;
+    goto out;
+  }
+  dm_bht_set_buffer(&scratch, scratch_page);
+  hasher = verity_tree_hasher(alg, &bht);
+
+  if (changed_count)
+    memcpy(extents, changed, changed_count * sizeof(*extents));
+  extent_count = verity_merge_extents(extents, changed_count, fs_blocks);
+  if (extent_count < 0) {
+    ret = -EINVAL;
+    goto out;
+  }
+  for (i = 0; i < (size_t)extent_count; i++)
+    changed_blocks += extents[i].count;
+
+  if (!extent_count) {
+    printf("%s: no blocks changed, nothing to do\n", __func__);
+    ret = 0;
+    goto out;
+  }
+
+  pages = verity_dirty_entries(&bht, extents, extent_count, dirty);
+  if (pages < 0) {
+    printf("%s: calloc failed\n", __func__);
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  /* Only the pages being updated get memory. The rest of the entries */
+  /* keep NULL nodes and are never looked at. */
+  if ((ret = posix_memalign((void**)&tree_pages, blocksize,
+                            pages * BHT_PAGE_SIZE))) {
+    printf("%s: posix_memalign tree pages failed %d\n", __func__, ret);
+    tree_pages = NULL;
+    goto out;
+  }
+  for (depth = 0, j = 0; depth < bht.depth; depth++) {
+    for (i = 0; i < dirty[depth].count; i++, j++)
+      bht.levels[depth].entries[dirty[depth].entries[i]].nodes =
+          tree_pages + j * BHT_PAGE_SIZE;
+  }
 
-  fd = open(device, O_RDWR );
+  fd = verity_open(device, O_RDWR, &direct);
   if (fd < 0) {
-    printf("%s error opening %s: %s\n", __func__, device, strerror(errno));
-    free(io_buffer);
-    free(hash_buffer);
-    return errno;
+    ret = errno;
+    goto out;
+  }
+
+  /* the unchanged digests in each page come from the tree on disk */
+  for (depth = 0; depth < bht.depth; depth++) {
+    if ((ret = verity_dirty_io(fd, &bht, depth, &dirty[depth], tree_offset,
+                               0, &tree_bytes_read)))
+      goto out;
   }
 
-  while (cur_block < fs_blocks) {
-    unsigned int i;
-    ssize_t readb;
-    size_t count = (fs_blocks - cur_block) * blocksize;
+  memset(&job, 0, sizeof(job));
+  job.fd = fd;
+  job.blocksize = blocksize;
+  job.digest_size = bht.digest_size;
+  job.extents = extents;
+  job.extent_count = extent_count;
+  job.consume = verity_update_chunk;
+  job.consume_ctx = &bht;
+  job.hasher = hasher;
+  verity_job_options(&job, opts);
+  if ((ret = verity_io_size(fd, blocksize, direct, &job.io_size)))
+    goto out;
+
+  threads = verity_thread_count(opts, changed_blocks, blocksize, job.io_size);
+  queue_depth = verity_queue_depth(opts, threads);
+  printf("%s: rehashing %" PRIu64 " of %" PRIu64 " blocks in %zd extents, "
+         "updating %zd hash pages\n", __func__, changed_blocks, fs_blocks,
+         extent_count, pages);
+
+  if ((ret = verity_hash_leaves(&job, alg, salt, threads, queue_depth)))
+    goto out;
+
+  /* Walk up the tree, rehashing each changed page into its parent. */
+  for (depth = bht.depth - 2; depth >= 0; depth--) {
+    const struct verity_dirty_level *children = &dirty[depth + 1];
 
-    if (count > IO_BUF_SIZE)
-      count = IO_BUF_SIZE;
+    for (i = 0; i < children->count; i++) {
+      unsigned int child = children->entries[i];
+      uint8_t *parent =
+          bht.levels[depth].entries[child >> bht.node_count_shift].nodes;
 
-    readb = pread(fd, io_buffer, count, cur_block * blocksize);
-    if (readb < 0) {
-      printf("%s: read returned error %s\n", __func__, strerror(errno));
-      close(fd);
-      free(io_buffer);
-      free(hash_buffer);
-      return errno;
+      if ((ret = verity_hash_page(hasher, &scratch,
+                                  bht.levels[depth + 1].entries[child].nodes,
+                                  parent + (child & (bht.node_count - 1)) *
+                                           bht.digest_size)))
+        goto out;
     }
+  }
+
+  if ((ret = verity_hash_page(hasher, &scratch,
+                              bht.levels[0].entries[0].nodes, digest)))
+    goto out;
+  verity_hexdigest(digest, bht.digest_size, root);
+
+  if (verity_check_root(root, expected, bht.digest_size, warn)) {
+    ret = -1;
+    goto out;
+  }
+
+  /* leaves first, so the top of the tree is the last thing to change */
+  for (depth = bht.depth - 1; depth >= 0; depth--) {
+    if ((ret = verity_dirty_io(fd, &bht, depth, &dirty[depth], tree_offset,
+                               1, &bytes_written)))
+      goto out;
+  }
+
+  if (opts && opts->stats) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+    opts->stats->bytes_read = job.bytes_read;
+    opts->stats->bytes_written = bytes_written;
+    opts->stats->tree_bytes_read = tree_bytes_read;
+    opts->stats->uncached_bytes =
+        direct ? job.bytes_read + tree_bytes_read + bytes_written : 0;
+    opts->stats->peak_rss_kb = verity_peak_rss_kb();
+    opts->stats->zero_blocks = job.zero_blocks;
+    opts->stats->hole_blocks = job.hole_blocks;
+  }
 
-    for (i = 0 ; i < (count / blocksize) ; i++) {
-      ret = dm_bht_store_block(&bht, cur_block, io_buffer + (i * blocksize));
-      if (ret) {
-        printf("%s: dm_bht_store_block returned error %d\n", __func__, ret);
-        close(fd);
-        free(io_buffer);
-        free(hash_buffer);
+out:
+  if (fd >= 0)
+    close(fd);
+  if (dirty) {
+    for (depth = 0; depth < bht.depth; depth++)
+      free(dirty[depth].entries);
+  }
+  free(dirty);
+  free(tree_pages);
+  free(scratch_page);
+  free(extents);
+  verity_hasher_free(hasher);
+  return ret;
+}
+
+/* Checks the on-disk tree from the top down: the first page against the */
+/* root hash, then every page against the digest its parent holds for it. */
+/* Only the tree is read, so a damaged tree is caught before any data. */
+static int verity_check_tree(struct dm_bht *tree,
+                             const struct verity_hasher *hasher,
+                             struct dm_bht *scratch, const char *expected)
+{
+  uint8_t digest[DM_BHT_MAX_DIGEST_SIZE];
+  uint8_t hexdigest[DM_BHT_MAX_DIGEST_SIZE * 2 + 1];
+  unsigned int i;
+  int depth, ret;
+
+  if ((ret = verity_hash_page(hasher, scratch,
+                              tree->levels[0].entries[0].nodes, digest)))
+    return ret;
+  verity_hexdigest(digest, tree->digest_size, hexdigest);
+  if (strlen(expected) != 2 * tree->digest_size ||
+      strncasecmp((char *)hexdigest, expected, 2 * tree->digest_size)) {
+    printf("Filesystem hash verification failed\n");
+    printf("Expected %s != %s\n", hexdigest, expected);
+    return -1;
+  }
+
+  for (depth = 1; depth < tree->depth; depth++) {
+    const struct dm_bht_level *level = &tree->levels[depth];
+    const struct dm_bht_level *parents = &tree->levels[depth - 1];
+
+    for (i = 0; i < level->count; i++) {
+      const uint8_t *parent =
+          parents->entries[i >> tree->node_count_shift].nodes;
+
+      if ((ret = verity_hash_page(hasher, scratch, level->entries[i].nodes,
+                                  digest)))
         return ret;
+      if (memcmp(digest, parent + (i & (tree->node_count - 1)) *
+                         tree->digest_size, tree->digest_size)) {
+        printf("%s: hash level %d page %u does not match its parent\n",
+               __func__, depth, i);
+        return -1;
       }
-      cur_block++;
     }
   }
-  free(io_buffer);
 
-  ret = dm_bht_compute(&bht);
+  return 0;
+}
+
+/* Where a scrub has got to: the first block it hasn't checked yet. The */
+/* file holds a single line, "<key> <next block>", where the key names the */
+/* device, the filesystem geometry and the root hash, so a checkpoint is */
+/* never used for a different tree. */
+
+/* Reads the block to carry on from, or 0 to start over. */
+static uint64_t verity_checkpoint_load(const char *path, const char *key,
+                                       uint64_t fs_blocks)
+{
+  char line[CACHE_LINE_SIZE];
+  size_t key_len = strlen(key);
+  uint64_t next_block = 0;
+  FILE *file = fopen(path, "r");
+
+  if (!file)
+    return 0;
+  if (fgets(line, sizeof(line), file) && !strncmp(line, key, key_len) &&
+      line[key_len] == ' ')
+    next_block = strtoull(line + key_len + 1, NULL, 10);
+  fclose(file);
+
+  return next_block < fs_blocks ? next_block : 0;
+}
+
+/* Records next_block, by writing a new file and renaming it over the old */
+/* one, so that it survives a crash or a reboot. */
+static int verity_checkpoint_save(const char *path, const char *key,
+                                  uint64_t next_block)
+{
+  char *tmp_path;
+  FILE *file;
+  int ret = 0;
+
+  if (!(tmp_path = malloc(strlen(path) + sizeof(".tmp"))))
+    return -ENOMEM;
+  sprintf(tmp_path, "%s.tmp", path);
+
+  if (!(file = fopen(tmp_path, "w"))) {
+    ret = -1;
+  } else {
+    fprintf(file, "%s %" PRIu64 "\n", key, next_block);
+    if (fflush(file) || fsync(fileno(file)))
+      ret = -1;
+    if (fclose(file) || ret || rename(tmp_path, path))
+      ret = -1;
+  }
+
   if (ret) {
-    printf("%s: dm_bht_compute returned error %d\n", __func__, ret);
+    printf("%s: error writing %s: %s\n", __func__, path, strerror(errno));
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  return ret;
+}
+
+/* Seconds between checkpoints of a scrub */
+#define CHECKPOINT_INTERVAL 30
+
+/* consume_ctx of verity_check_chunk */
+struct verity_check {
+  const struct dm_bht *disk;  /* the tree read from the disk */
+  const char *checkpoint;     /* checkpoint file, NULL for none */
+  const char *key;
+  uint64_t next_block;        /* first block not checked yet */
+  time_t saved;               /* when the checkpoint was last written */
+};
+
+/* consume for chromeos_verity_verify: compares the leaf digests with the */
+/* ones in the tree read from the disk. Chunks come in order, so the first */
+/* mismatch found is the first one on the device. */
+static int verity_check_chunk(struct verity_job *job,
+                              const struct verity_chunk *chunk)
+{
+  struct verity_check *check = job->consume_ctx;
+  const struct dm_bht *disk = check->disk;
+  const struct dm_bht_level *leaves = &disk->levels[disk->depth - 1];
+  uint64_t block = chunk->first_block;
+  uint64_t end = block + chunk->count / job->blocksize;
+  const uint8_t *digest = chunk->digests;
+  time_t now;
+
+  for (; block < end; block++, digest += disk->digest_size) {
+    unsigned index = block & (disk->node_count - 1);
+
+    if (memcmp(leaves->entries[block >> disk->node_count_shift].nodes +
+               index * disk->digest_size, digest, disk->digest_size)) {
+      printf("%s: block %" PRIu64 " does not match the hash tree\n",
+             __func__, block);
+      return -1;
+    }
+  }
+
+  check->next_block = end;
+  if (check->checkpoint &&
+      (now = time(NULL)) - check->saved >= CHECKPOINT_INTERVAL) {
+    /* losing a checkpoint only costs some rechecking */
+    verity_checkpoint_save(check->checkpoint, check->key, end);
+    check->saved = now;
+  }
+
+  return 0;
+}
+
+/* Linux io priorities, for ioprio_set */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Moves the calling thread, and so the threads it starts, to the idle io */
+/* class and the lowest cpu priority, saving what they were. */
+static void verity_background(int *ioprio, int *nice_value)
+{
+  pid_t tid = syscall(SYS_gettid);
+
+  *ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+  errno = 0;
+  *nice_value = getpriority(PRIO_PROCESS, tid);
+  if (errno)
+    *nice_value = 0;
+
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+              IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+    printf("%s: ioprio_set failed %s\n", __func__, strerror(errno));
+  setpriority(PRIO_PROCESS, tid, 19);
+}
+
+/* Undoes verity_background, as far as we are allowed to. */
+static void verity_foreground(int ioprio, int nice_value)
+{
+  pid_t tid = syscall(SYS_gettid);
+
+  if (ioprio >= 0)
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio);
+  setpriority(PRIO_PROCESS, tid, nice_value);
+}
+
+/* Checks the tree on the device against the root hash, then the data */
+/* against the tree, for chromeos_verity_verify and chromeos_verity_scrub. */
+/* A scrub runs in the background and carries on from its checkpoint. */
+static int verity_check(const char *caller, const char *alg,
+                        const char *device, unsigned blocksize,
+                        uint64_t fs_blocks, const char *salt,
+                        const char *expected, const char *checkpoint,
+                        int background, const struct verity_options *opts)
+{
+  struct dm_bht disk, scratch;
+  struct verity_job job;
+  struct verity_check check;
+  struct verity_extent rest;
+  struct verity_hasher *hasher = NULL;
+  uint8_t *disk_buffer = NULL, *scratch_page = NULL;
+  char key[CACHE_LINE_SIZE];
+  size_t hash_size;
+  ssize_t readb;
+  int direct = opts && opts->direct_io;
+  unsigned threads, queue_depth;
+  int ioprio = -1, nice_value = 0;
+  int ret, fd = -1;
+
+  if (IO_BUF_SIZE % blocksize != 0) {
+    printf("%s: blocksize %% %lu != 0\n", caller, IO_BUF_SIZE);
+    return -EINVAL;
+  }
+
+  /* The tree read from the disk and a one page tree for hashing pages. */
+  /* As elsewhere neither is destroyed. */
+  if ((ret = verity_bht_create(&disk, fs_blocks, alg)) ||
+      (ret = verity_bht_create(&scratch, 2, alg))) {
+    printf("%s: dm_bht_create failed %d\n", caller, ret);
+    return ret;
+  }
+  if (disk.depth < 1) {
+    printf("%s: %" PRIu64 " blocks is too small for a tree\n", caller,
+           fs_blocks);
+    return -EINVAL;
+  }
+  dm_bht_set_read_cb(&disk, dm_bht_zeroread_callback);
+  dm_bht_set_read_cb(&scratch, dm_bht_zeroread_callback);
+  dm_bht_set_salt(&disk, salt);
+  dm_bht_set_salt(&scratch, salt);
+  hash_size = dm_bht_sectors(&disk) << SECTOR_SHIFT;
+
+  if (posix_memalign((void**)&disk_buffer, blocksize, hash_size) ||
+      !(scratch_page = malloc(dm_bht_sectors(&scratch) << SECTOR_SHIFT))) {
+    printf("%s: allocating hash buffers failed\n", caller);
+    ret = -ENOMEM;
+    goto out;
+  }
+  dm_bht_set_buffer(&disk, disk_buffer);
+  dm_bht_set_buffer(&scratch, scratch_page);
+  hasher = verity_tree_hasher(alg, &disk);
+
+  memset(&check, 0, sizeof(check));
+  check.disk = &disk;
+  check.checkpoint = checkpoint;
+  check.key = key;
+  check.saved = time(NULL);
+  if (checkpoint) {
+    snprintf(key, sizeof(key), "%s %s %u %" PRIu64 " %s %s", device, alg,
+             blocksize, fs_blocks, *salt ? salt : "-", expected);
+    check.next_block = verity_checkpoint_load(checkpoint, key, fs_blocks);
+  }
+
+  if (background)
+    verity_background(&ioprio, &nice_value);
+
+  /* nothing is ever written, so read-only devices are fine */
+  fd = verity_open(device, O_RDONLY, &direct);
+  if (fd < 0) {
+    ret = errno;
+    goto out;
+  }
+
+  readb = pread(fd, disk_buffer, hash_size, fs_blocks * blocksize);
+  if (readb != (ssize_t)hash_size) {
+    printf("%s: reading the hash tree failed %s\n", caller,
+           readb < 0 ? strerror(errno) : "short read");
+    ret = readb < 0 ? errno : -EIO;
+    goto out;
+  }
+
+  /* The tree is small, it is checked in full every time. */
+  if ((ret = verity_check_tree(&disk, hasher, &scratch, expected)))
+    goto out;
+
+  rest.first_block = check.next_block;
+  rest.count = fs_blocks - check.next_block;
+
+  memset(&job, 0, sizeof(job));
+  job.fd = fd;
+  job.blocksize = blocksize;
+  job.digest_size = disk.digest_size;
+  job.extents = &rest;
+  job.extent_count = 1;
+  job.consume = verity_check_chunk;
+  job.consume_ctx = &check;
+  job.hasher = hasher;
+  verity_job_options(&job, opts);
+  if ((ret = verity_io_size(fd, blocksize, direct, &job.io_size)))
+    goto out;
+
+  threads = verity_thread_count(opts, rest.count, blocksize, job.io_size);
+  queue_depth = verity_queue_depth(opts, threads);
+  if (rest.first_block)
+    printf("%s: carrying on from block %" PRIu64 "\n", caller,
+           rest.first_block);
+  printf("%s: checking %" PRIu64 " blocks with %u threads%s\n", caller,
+         rest.count, threads, direct ? " (O_DIRECT)" : "");
+
+  /* The upper levels were checked above, so leaves that match the disk */
+  /* mean the whole tree rebuilt from the data would match it. */
+  if ((ret = verity_hash_leaves(&job, alg, salt, threads, queue_depth)))
+    goto out;
+
+  printf("%s: %s matches its hash tree\n", caller, device);
+
+  if (opts && opts->stats) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+    opts->stats->bytes_read = job.bytes_read;
+    opts->stats->tree_bytes_read = hash_size;
+    opts->stats->uncached_bytes = direct ? job.bytes_read + hash_size : 0;
+    opts->stats->peak_rss_kb = verity_peak_rss_kb();
+    opts->stats->zero_blocks = job.zero_blocks;
+    opts->stats->hole_blocks = job.hole_blocks;
+  }
+
+out:
+  if (checkpoint) {
+    /* Finished, one way or the other, or to be carried on with later. */
+    if (ret == 0 || ret == -1) {
+      unlink(checkpoint);
+    } else if (check.next_block) {
+      printf("%s: checked up to block %" PRIu64 ", run again to carry on\n",
+             caller, check.next_block);
+      verity_checkpoint_save(checkpoint, key, check.next_block);
+    }
+  }
+  if (background)
+    verity_foreground(ioprio, nice_value);
+  if (fd >= 0)
     close(fd);
-    free(hash_buffer);
+  free(scratch_page);
+  free(disk_buffer);
+  verity_hasher_free(hasher);
+  return ret;
+}
+
+int chromeos_verity_verify(const char *alg, const char *device,
+                           unsigned blocksize, uint64_t fs_blocks,
+                           const char *salt, const char *expected,
+                           const struct verity_options *opts)
+{
+  return verity_check(__func__, alg, device, blocksize, fs_blocks, salt,
+                      expected, NULL, 0, opts);
+}
+
+int chromeos_verity_scrub(const char *alg, const char *device,
+                          unsigned blocksize, uint64_t fs_blocks,
+                          const char *salt, const char *expected,
+                          const char *checkpoint,
+                          const struct verity_options *opts)
+{
+  return verity_check(__func__, alg, device, blocksize, fs_blocks, salt,
+                      expected, checkpoint, 1, opts);
+}
+
+/* Writes len bytes of tree pages at offset. */
+static int verity_write_tree(int fd, const uint8_t *pages, size_t len,
+                             off_t offset)
+{
+  ssize_t written = len ? pwrite(fd, pages, len, offset) : 0;
+
+  if (written != (ssize_t)len) {
+    printf("%s: writing the hash tree failed %s\n", __func__,
+           written < 0 ? strerror(errno) : "short write");
+    return written < 0 ? errno : -EIO;
+  }
+  return 0;
+}
+
+int chromeos_verity_install_tree(const char *alg, const char *tree,
+                                 const char *device, unsigned blocksize,
+                                 uint64_t fs_blocks, const char *salt,
+                                 const char *expected,
+                                 const struct verity_options *opts)
+{
+  struct dm_bht bht, scratch;
+  struct verity_hasher *hasher = NULL;
+  uint8_t *tree_buffer = NULL, *scratch_page = NULL;
+  off_t tree_offset = fs_blocks * blocksize;
+  int direct = opts && opts->direct_io;
+  size_t hash_size;
+  ssize_t readb;
+  int ret, fd = -1, tree_fd = -1;
+
+  if (IO_BUF_SIZE % blocksize != 0) {
+    printf("%s: blocksize %% %lu != 0\n", __func__, IO_BUF_SIZE);
+    return -EINVAL;
+  }
+  if (!expected || !*expected) {
+    printf("%s: a root hash is needed to check the tree\n", __func__);
+    return -EINVAL;
+  }
+
+  /* As elsewhere neither tree is destroyed. */
+  if ((ret = verity_bht_create(&bht, fs_blocks, alg)) ||
+      (ret = verity_bht_create(&scratch, 2, alg))) {
+    printf("%s: dm_bht_create failed %d\n", __func__, ret);
     return ret;
   }
+  if (bht.depth < 1) {
+    printf("%s: %" PRIu64 " blocks is too small for a tree\n", __func__,
+           fs_blocks);
+    return -EINVAL;
+  }
+  dm_bht_set_read_cb(&bht, dm_bht_zeroread_callback);
+  dm_bht_set_read_cb(&scratch, dm_bht_zeroread_callback);
+  dm_bht_set_salt(&bht, salt);
+  dm_bht_set_salt(&scratch, salt);
+  hash_size = dm_bht_sectors(&bht) << SECTOR_SHIFT;
 
-  dm_bht_root_hexdigest(&bht, digest, DM_BHT_MAX_DIGEST_SIZE);
+  if (posix_memalign((void**)&tree_buffer, BHT_PAGE_SIZE, hash_size) ||
+      !(scratch_page = malloc(dm_bht_sectors(&scratch) << SECTOR_SHIFT))) {
+    printf("%s: allocating hash buffers failed\n", __func__);
+    ret = -ENOMEM;
+    goto out;
+  }
+  dm_bht_set_buffer(&bht, tree_buffer);
+  dm_bht_set_buffer(&scratch, scratch_page);
+  hasher = verity_tree_hasher(alg, &bht);
 
-  if (warn && memcmp(digest, expected, bht.digest_size)) {
-    printf("Filesystem hash verification failed\n");
-    printf("Expected %s != %s\n",digest, expected);
-    free(hash_buffer);
+  tree_fd = open(tree, O_RDONLY);
+  if (tree_fd < 0) {
+    ret = errno;
+    printf("%s error opening %s: %s\n", __func__, tree, strerror(ret));
+    goto out;
+  }
+  readb = verity_read_stream(tree_fd, tree_buffer, hash_size);
+  if (readb != (ssize_t)hash_size) {
+    printf("%s: reading the hash tree failed %s\n", __func__,
+           readb < 0 ? strerror(errno) : "short read");
+    ret = readb < 0 ? errno : -EIO;
+    goto out;
+  }
+
+  /* Every page down to the leaves has to hash to what its parent says. */
+  /* The leaves themselves are only checked against the data by a later */
+  /* chromeos_verity_verify, off the critical path. */
+  if ((ret = verity_check_tree(&bht, hasher, &scratch, expected)))
+    goto out;
+
+  fd = verity_open(device, O_RDWR, &direct);
+  if (fd < 0) {
+    ret = errno;
+    goto out;
+  }
+
+  /* Like chromeos_verity, the top page goes last so that a tree cut short */
+  /* doesn't validate against any root. */
+  if ((ret = verity_write_tree(fd, tree_buffer + BHT_PAGE_SIZE,
+                               hash_size - BHT_PAGE_SIZE,
+                               tree_offset + BHT_PAGE_SIZE)) ||
+      (ret = verity_write_tree(fd, tree_buffer, BHT_PAGE_SIZE, tree_offset)))
+    goto out;
+
+  printf("%s: installed a %zu byte hash tree on %s, data not rehashed\n",
+         __func__, hash_size, device);
+
+  if (opts && opts->stats) {
+    memset(opts->stats, 0, sizeof(*opts->stats));
+    opts->stats->bytes_written = hash_size;
+    opts->stats->tree_bytes_read = hash_size;
+    opts->stats->uncached_bytes = direct ? hash_size : 0;
+    opts->stats->peak_rss_kb = verity_peak_rss_kb();
+  }
+
+out:
+  if (fd >= 0)
     close(fd);
+  if (tree_fd >= 0)
+    close(tree_fd);
+  free(scratch_page);
+  free(tree_buffer);
+  verity_hasher_free(hasher);
+  return ret;
+}
+
+int verity_read_extents(const char *path, struct verity_extent **extents,
+                        size_t *count)
+{
+  FILE *file;
+  char line[256];
+  size_t size = 0;
+  unsigned lineno = 0;
+
+  *extents = NULL;
+  *count = 0;
+
+  file = fopen(path, "r");
+  if (!file) {
+    printf("%s: error opening %s: %s\n", __func__, path, strerror(errno));
     return -1;
   }
 
-  if (pwrite(fd, hash_buffer, hash_size, cur_block * blocksize) !=
-             (ssize_t)hash_size) {
-    printf("%s: writing out hash failed %s\n", __func__, strerror(errno));
-    free(hash_buffer);
-    close(fd);
-    return errno;
+  while (fgets(line, sizeof(line), file)) {
+    struct verity_extent extent;
+    char *p = line;
+    char *end;
+
+    lineno++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+
+    extent.first_block = strtoull(p, &end, 0);
+    if (end == p)
+      goto bad_line;
+    p = end;
+    extent.count = strtoull(p, &end, 0);
+    if (end == p)
+      goto bad_line;
+    while (*end == ' ' || *end == '\t' || *end == '\n')
+      end++;
+    if (*end)
+      goto bad_line;
+
+    if (*count == size) {
+      struct verity_extent *grown;
+      size = size ? size * 2 : 64;
+      grown = realloc(*extents, size * sizeof(**extents));
+      if (!grown) {
+        printf("%s: realloc failed\n", __func__);
+        goto fail;
+      }
+      *extents = grown;
+    }
+    (*extents)[(*count)++] = extent;
   }
-  free(hash_buffer);
-  close(fd);
 
+  fclose(file);
   return 0;
-}
 
+bad_line:
+  printf("%s: %s:%u: expected \"<first block> <block count>\"\n", __func__,
+         path, lineno);
+fail:
+  fclose(file);
+  free(*extents);
+  *extents = NULL;
+  *count = 0;
+  return -1;
+}
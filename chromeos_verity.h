@@ -10,19 +10,71 @@
 extern "C" {
 #endif
 
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Upper bound on the number of hashing threads chromeos_verity will start. */
+#define VERITY_MAX_THREADS 64
+
+/* Upper bound on the number of read buffers kept in flight. */
+#define VERITY_MAX_QUEUE_DEPTH 64
+
+/* Counters filled in by a successful chromeos_verity call. */
+struct verity_stats {
+  uint64_t bytes_read;      /* filesystem data read */
+  uint64_t bytes_written;   /* hash tree written */
+  uint64_t tree_bytes_read; /* existing hash tree read back */
+  uint64_t uncached_bytes;  /* bytes moved with O_DIRECT, past the page cache */
+  uint64_t peak_rss_kb;     /* peak resident set size of the process, in KiB */
+  uint64_t zero_blocks;     /* all-zero blocks given the zero digest unhashed */
+  uint64_t hole_blocks;     /* zero blocks in file holes, not even read */
+  uint64_t data_bytes_written; /* image written by chromeos_verity_write */
+  uint64_t cached;          /* 1 if the cache showed there was nothing to do */
+};
+
+/* Tunables for chromeos_verity. A NULL options pointer uses the defaults. */
+struct verity_options {
+  /* Number of threads hashing data blocks in parallel. 0 starts one per */
+  /* online cpu. The resulting tree does not depend on this value. */
+  unsigned threads;
+  /* Number of read buffers cycling between the reader and the hashing */
+  /* threads, so the next reads are already queued while earlier data is */
+  /* hashed. 0 picks one more than the number of threads. */
+  unsigned queue_depth;
+  /* Read the filesystem and write the tree with O_DIRECT so a verity run */
+  /* doesn't evict the host's page cache. Falls back to buffered io if the */
+  /* device doesn't support it. */
+  int direct_io;
+  /* If set, receives the counters of the run. */
+  struct verity_stats *stats;
+  /* If set, a file remembering the root hash of filesystems chromeos_verity */
+  /* has built trees for, by device and a cheap fingerprint of the */
+  /* filesystem. A rerun over an unchanged filesystem whose tree is still */
+  /* in place returns right away. Kept on a partition that survives */
+  /* updates, such as the stateful partition. */
+  const char *cache_path;
+  /* Cap on the data read per second, 0 for none. Short bursts of up to a */
+  /* second's worth are allowed, the average stays under the cap. */
+  uint64_t max_bytes_per_sec;
+  /* If set, the run stops as soon as this becomes non-zero, e.g. from a */
+  /* signal handler, and returns -EINTR. */
+  volatile sig_atomic_t *cancel;
+};
+
 /* chromeos_verity
  * This calculated the verity hash-trie for a filesystem and places it
  * immdiately after the FS on the device, and checks that the expected
  * root hash is generated.
  *
- * @alg - algorithm to use. md5, sha1, or sha256
+ * @alg - algorithm to use. md5, sha1, sha256, blake2b-256, blake2b-512
+ *        or blake2s-256
  * @device - block device which contains the fs and will contain hash trie
  * @blocksize - size of block to hash on.  Usually page size - 4k on x86.
  * @salt - ascii string with a salt value to add before calculating each hash
  * @expected - ascii string with the exptected final root hash value
  * @warn - bool indicating whether we should complain if expected doesn't match
+ * @opts - optional tunables, may be NULL
  * return - 0 for success, non-zero indicates failure
  *
  */
@@ -32,7 +84,138 @@ int chromeos_verity(const char *alg,
                     uint64_t fs_blocks,
                     const char *salt,
                     const char *expected,
-                    int warn);
+                    int warn,
+                    const struct verity_options *opts);
+
+/* chromeos_verity_write
+ * Writes a filesystem image to the device and builds its hash-trie in the
+ * same pass: each buffer read from the image is written to the device and
+ * hashed, then the tree is placed after the filesystem as chromeos_verity
+ * does. The device is never read back, so the whole job takes one pass
+ * over it instead of two.
+ *
+ * Takes the same arguments as chromeos_verity, plus:
+ * @image_fd - the image is read from here, front to back with read(), so it
+ *             may be a pipe; it must hold at least fs_blocks blocks
+ * return - 0 for success, non-zero indicates failure
+ */
+int chromeos_verity_write(const char *alg,
+                          int image_fd,
+                          const char *device,
+                          unsigned blocksize,
+                          uint64_t fs_blocks,
+                          const char *salt,
+                          const char *expected,
+                          int warn,
+                          const struct verity_options *opts);
+
+/* A run of count filesystem blocks starting at first_block. */
+struct verity_extent {
+  uint64_t first_block;
+  uint64_t count;
+};
+
+/* chromeos_verity_update
+ * Brings the hash-trie chromeos_verity left on the device up to date after
+ * only some of the filesystem blocks changed, e.g. by a delta update. Only
+ * the changed blocks are read and hashed, only the tree pages above them
+ * are read back, rehashed and rewritten, so the time taken grows with the
+ * size of the change rather than the size of the filesystem. Everything
+ * else in the tree is trusted to be current.
+ *
+ * Takes the same arguments as chromeos_verity, plus:
+ * @changed - the changed blocks, in any order, may overlap
+ * @changed_count - number of extents in changed
+ * return - 0 for success, non-zero indicates failure
+ */
+int chromeos_verity_update(const char *alg,
+                           const char *device,
+                           unsigned blocksize,
+                           uint64_t fs_blocks,
+                           const char *salt,
+                           const char *expected,
+                           int warn,
+                           const struct verity_extent *changed,
+                           size_t changed_count,
+                           const struct verity_options *opts);
+
+/* chromeos_verity_verify
+ * Checks a filesystem and the hash-trie after it without writing anything.
+ * The tree on the device is checked from the root hash down, then the data
+ * is streamed and each block's digest compared with the leaves. Stops at
+ * the first mismatch.
+ *
+ * Takes the same arguments as chromeos_verity; the root hash is required.
+ * return - 0 if everything matches, -1 on a mismatch, other non-zero
+ *          values for errors
+ */
+int chromeos_verity_verify(const char *alg,
+                           const char *device,
+                           unsigned blocksize,
+                           uint64_t fs_blocks,
+                           const char *salt,
+                           const char *expected,
+                           const struct verity_options *opts);
+
+/* chromeos_verity_scrub
+ * chromeos_verity_verify as a long running background job, e.g. over the
+ * inactive slot, so that corruption is found before that slot is booted.
+ * The calling thread and the hashing threads run in the idle io class at
+ * the lowest cpu priority; opts->max_bytes_per_sec and opts->cancel can
+ * limit and stop it. Progress is saved to a checkpoint file now and then,
+ * and when the scrub is stopped, and a later scrub of the same tree
+ * carries on from there. The checkpoint is removed once the scrub finishes.
+ *
+ * Takes the same arguments as chromeos_verity_verify, plus:
+ * @checkpoint - checkpoint file, on a partition that survives reboots;
+ *               may be NULL to always start from the beginning
+ * return - 0 if everything matches, -1 on a mismatch, -EINTR if cancelled,
+ *          other non-zero values for errors
+ */
+int chromeos_verity_scrub(const char *alg,
+                          const char *device,
+                          unsigned blocksize,
+                          uint64_t fs_blocks,
+                          const char *salt,
+                          const char *expected,
+                          const char *checkpoint,
+                          const struct verity_options *opts);
+
+/* chromeos_verity_install_tree
+ * Puts a hash-trie that came with the update payload after the filesystem,
+ * instead of building one from the data. Every page of the tree is
+ * checked from the root hash down to the leaf pages first, which only
+ * reads the tree itself; nothing is written unless that passes. Whether
+ * the leaves match the data is left to chromeos_verity_verify, which can
+ * run later in the background.
+ *
+ * Takes the same arguments as chromeos_verity, plus:
+ * @tree - file holding the whole tree, as chromeos_verity lays it out
+ * @expected - the root hash, required
+ * return - 0 for success, -1 if the tree doesn't match the root hash,
+ *          other non-zero values for errors
+ */
+int chromeos_verity_install_tree(const char *alg,
+                                 const char *tree,
+                                 const char *device,
+                                 unsigned blocksize,
+                                 uint64_t fs_blocks,
+                                 const char *salt,
+                                 const char *expected,
+                                 const struct verity_options *opts);
+
+/* verity_read_extents
+ * Reads a changed block list for chromeos_verity_update: one
+ * "<first block> <block count>" pair per line, '#' starts a comment line.
+ *
+ * @path - file to read
+ * @extents - receives a malloc()ed array the caller has to free()
+ * @count - receives the number of extents
+ * return - 0 for success, non-zero if the file can't be read or parsed
+ */
+int verity_read_extents(const char *path,
+                        struct verity_extent **extents,
+                        size_t *count);
 
 #ifdef __cplusplus
 }
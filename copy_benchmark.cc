@@ -0,0 +1,132 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures CopyFile with each copy method it has, next to the 512 byte
+// read and write loop it used to be: the throughput and the number of
+// copying system calls each takes to copy one file within a directory.
+// A method the filesystem can't do shows the one CopyFile fell back on.
+//
+//   copy_benchmark [megabytes] [directory]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "inst_util.h"
+
+using std::string;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+const char* MethodName(CopyMethod method) {
+  switch (method) {
+    case kCopyReflink:
+      return "reflink";
+    case kCopyFileRange:
+      return "copy_file_range";
+    case kCopySendfile:
+      return "sendfile";
+    case kCopyBuffer:
+      return "buffer";
+  }
+  return "unknown";
+}
+
+void Report(const char* name, const char* used, size_t bytes,
+            double seconds, size_t calls) {
+  printf("%-16s %-16s %9.1f MiB/s %9zu calls\n", name, used,
+         bytes / seconds / (1 << 20), calls);
+}
+
+// The copy loop CopyFile had before it had methods.
+bool OldCopyFile(const string& from_path, const string& to_path,
+                 size_t* calls) {
+  int fd_from = open(from_path.c_str(), O_RDONLY);
+  int fd_to = open(to_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool success = fd_from != -1 && fd_to != -1;
+  ssize_t buff_in = 1;
+  char buff[512];
+
+  while (success && buff_in > 0) {
+    (*calls)++;
+    buff_in = read(fd_from, buff, sizeof(buff));
+    success = buff_in >= 0;
+    if (success && buff_in > 0) {
+      (*calls)++;
+      success = write(fd_to, buff, buff_in) == buff_in;
+    }
+  }
+
+  close(fd_from);
+  close(fd_to);
+  return success;
+}
+
+bool SameSize(const string& from_path, const string& to_path) {
+  struct stat from, to;
+  return stat(from_path.c_str(), &from) == 0 &&
+         stat(to_path.c_str(), &to) == 0 && from.st_size == to.st_size;
+}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 64;
+  string dir = argc > 2 ? argv[2] : "/tmp";
+
+  if (megabytes == 0) {
+    fprintf(stderr, "usage: %s [megabytes] [directory]\n", argv[0]);
+    return 1;
+  }
+
+  string from_path = dir + "/copy_benchmark.from";
+  string to_path = dir + "/copy_benchmark.to";
+  string data(megabytes << 20, '\0');
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 2654435761u >> 24;
+  if (!WriteStringToFile(data, from_path)) {
+    fprintf(stderr, "can't write %s\n", from_path.c_str());
+    return 1;
+  }
+
+  printf("copying %zu MiB in %s\n", megabytes, dir.c_str());
+
+  size_t calls = 0;
+  double start = Now();
+  if (!OldCopyFile(from_path, to_path, &calls) ||
+      !SameSize(from_path, to_path)) {
+    fprintf(stderr, "512 byte copy failed\n");
+    return 1;
+  }
+  Report("read/write 512", "read/write 512", data.size(), Now() - start,
+         calls);
+
+  const CopyMethod methods[] = {
+    kCopyReflink, kCopyFileRange, kCopySendfile, kCopyBuffer
+  };
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    CopyFileStats stats;
+
+    unlink(to_path.c_str());
+    start = Now();
+    if (!CopyFile(from_path, to_path, methods[i], &stats) ||
+        !SameSize(from_path, to_path)) {
+      fprintf(stderr, "%s copy failed\n", MethodName(methods[i]));
+      return 1;
+    }
+    Report(MethodName(methods[i]), MethodName(stats.method), data.size(),
+           Now() - start, stats.calls);
+  }
+
+  unlink(from_path.c_str());
+  unlink(to_path.c_str());
+  return 0;
+}
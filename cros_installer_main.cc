@@ -5,11 +5,19 @@
 #include "inst_util.h"
 #include "chromeos_install_config.h"
 #include "chromeos_legacy.h"
+#include "chromeos_markgood.h"
 #include "chromeos_postinst.h"
+#include "chromeos_verity.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <string>
 
 using std::string;
@@ -17,20 +25,75 @@ using std::string;
 const char* usage = (
     "cros_installer:\n"
     "   --help\n"
-    "   cros_installer postinst <mount_point> <rood_dev>\n");
+    "   cros_installer postinst <mount_point> <rood_dev>\n"
+    "   cros_installer mark-good [<root_dev>]\n"
+    "   cros_installer verity <device> --alg=<alg> --salt=<hex>\n"
+    "                  --blocks=<fs_blocks> [--blocksize=<bytes>]\n"
+    "                  [--root-hash=<hex>] [--threads=<n>]\n"
+    "                  [--queue-depth=<n>] [--direct]\n"
+    "                  [--changed=<extent list>] [--cache=<file>]\n"
+    "   cros_installer verify <device> --alg=<alg> --salt=<hex>\n"
+    "                  --blocks=<fs_blocks> --root-hash=<hex>\n"
+    "                  [--blocksize=<bytes>] [--threads=<n>]\n"
+    "                  [--queue-depth=<n>] [--direct]\n"
+    "   cros_installer write <image|-> <device> --alg=<alg> --salt=<hex>\n"
+    "                  [--blocks=<fs_blocks>] [--blocksize=<bytes>]\n"
+    "                  [--root-hash=<hex>] [--threads=<n>]\n"
+    "                  [--queue-depth=<n>] [--direct] [--cache=<file>]\n"
+    "   cros_installer install-tree <tree> <device> --alg=<alg>\n"
+    "                  --salt=<hex> --blocks=<fs_blocks> --root-hash=<hex>\n"
+    "                  [--blocksize=<bytes>] [--direct]\n"
+    "   cros_installer scrub <device> [--kernel=<kernel device>]\n"
+    "                  [--alg=<alg>] [--salt=<hex>] [--blocks=<fs_blocks>]\n"
+    "                  [--root-hash=<hex>] [--blocksize=<bytes>]\n"
+    "                  [--checkpoint=<file>] [--rate=<MiB/s>]\n"
+    "                  [--threads=<n>] [--direct]\n");
 
 int showHelp() {
   printf("%s", usage);
   return 1;
 }
 
+// Set by a signal to stop a scrub; it saves its checkpoint and returns.
+volatile sig_atomic_t stop_requested = 0;
+
+void RequestStop(int signum) {
+  stop_requested = 1;
+}
+
 int main(int argc, char** argv) {
 
   struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
+    {"alg", required_argument, NULL, 'a'},
+    {"salt", required_argument, NULL, 's'},
+    {"blocks", required_argument, NULL, 'b'},
+    {"blocksize", required_argument, NULL, 'B'},
+    {"root-hash", required_argument, NULL, 'r'},
+    {"threads", required_argument, NULL, 't'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"direct", no_argument, NULL, 'd'},
+    {"changed", required_argument, NULL, 'c'},
+    {"cache", required_argument, NULL, 'C'},
+    {"checkpoint", required_argument, NULL, 'p'},
+    {"rate", required_argument, NULL, 'm'},
+    {"kernel", required_argument, NULL, 'k'},
     {NULL, 0, NULL, 0},
   };
 
+  // Verity parameters, only used by the verity, verify, write, install-tree
+  // and scrub commands.
+  string alg;
+  string salt;
+  string root_hash;
+  string changed;
+  string cache;
+  string checkpoint;
+  string kernel;
+  uint64_t fs_blocks = 0;
+  unsigned blocksize = 4096;
+  struct verity_options verity_opts = {};
+
   while (true) {
     int option_index;
     int c = getopt_long(argc, argv, "h", long_options, &option_index);
@@ -48,6 +111,58 @@ int main(int argc, char** argv) {
         // --help
         return showHelp();
 
+      case 'a':
+        alg = optarg;
+        break;
+
+      case 's':
+        salt = optarg;
+        break;
+
+      case 'b':
+        fs_blocks = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'B':
+        blocksize = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'r':
+        root_hash = optarg;
+        break;
+
+      case 't':
+        verity_opts.threads = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'q':
+        verity_opts.queue_depth = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'd':
+        verity_opts.direct_io = 1;
+        break;
+
+      case 'c':
+        changed = optarg;
+        break;
+
+      case 'C':
+        cache = optarg;
+        break;
+
+      case 'p':
+        checkpoint = optarg;
+        break;
+
+      case 'm':
+        verity_opts.max_bytes_per_sec = strtoull(optarg, NULL, 0) << 20;
+        break;
+
+      case 'k':
+        kernel = optarg;
+        break;
+
       default:
         printf("Unknown argument %d - switch and struct out of sync\n\n", c);
         return showHelp();
@@ -61,6 +176,9 @@ int main(int argc, char** argv) {
 
   string command = argv[optind++];
 
+  if (!cache.empty())
+    verity_opts.cache_path = cache.c_str();
+
   // Run postinstall behavior
   if (command == "postinst") {
     if (argc - optind != 2)
@@ -73,6 +191,184 @@ int main(int argc, char** argv) {
     return !RunPostInstall(install_dev, install_dir);
   }
 
+  // Mark the running root (or the one given) as booted successfully
+  if (command == "mark-good") {
+    if (argc - optind > 1)
+      return showHelp();
+
+    string root_dev = argc - optind == 1 ? argv[optind++] : GetRootDevice();
+    if (root_dev.empty()) {
+      printf("Unable to find the root device\n");
+      return 1;
+    }
+
+    return !MarkGoodRoot(root_dev);
+  }
+
+  // Build the verity hash tree for a filesystem and append it to the device
+  if (command == "verity") {
+    if (argc - optind != 1 || alg.empty() || fs_blocks == 0 ||
+        blocksize == 0)
+      return showHelp();
+
+    string device = argv[optind++];
+
+    // Only rehash the blocks a delta update touched
+    if (!changed.empty()) {
+      struct verity_extent* extents;
+      size_t extent_count;
+
+      if (verity_read_extents(changed.c_str(), &extents, &extent_count))
+        return 1;
+
+      int result = chromeos_verity_update(alg.c_str(),
+                                          device.c_str(),
+                                          blocksize,
+                                          fs_blocks,
+                                          salt.c_str(),
+                                          root_hash.c_str(),
+                                          !root_hash.empty(),
+                                          extents,
+                                          extent_count,
+                                          &verity_opts);
+      free(extents);
+      return result != 0;
+    }
+
+    return chromeos_verity(alg.c_str(),
+                           device.c_str(),
+                           blocksize,
+                           fs_blocks,
+                           salt.c_str(),
+                           root_hash.c_str(),
+                           !root_hash.empty(),
+                           &verity_opts) != 0;
+  }
+
+  // Check a filesystem against its verity hash tree, without writing
+  if (command == "verify") {
+    if (argc - optind != 1 || alg.empty() || fs_blocks == 0 ||
+        blocksize == 0 || root_hash.empty())
+      return showHelp();
+
+    string device = argv[optind++];
+
+    return chromeos_verity_verify(alg.c_str(),
+                                  device.c_str(),
+                                  blocksize,
+                                  fs_blocks,
+                                  salt.c_str(),
+                                  root_hash.c_str(),
+                                  &verity_opts) != 0;
+  }
+
+  // Write a filesystem image to the device and hash it on the way, in place
+  // of a copy followed by the verity command
+  if (command == "write") {
+    if (argc - optind != 2 || alg.empty() || blocksize == 0)
+      return showHelp();
+
+    string image = argv[optind++];
+    string device = argv[optind++];
+    int image_fd = STDIN_FILENO;
+
+    if (image != "-") {
+      image_fd = open(image.c_str(), O_RDONLY);
+      if (image_fd < 0) {
+        printf("Error opening %s: %s\n", image.c_str(), strerror(errno));
+        return 1;
+      }
+    }
+
+    // The size of an image file tells us how big the filesystem is, a pipe
+    // has to be told.
+    struct stat st;
+    if (fs_blocks == 0 && fstat(image_fd, &st) == 0 && S_ISREG(st.st_mode))
+      fs_blocks = st.st_size / blocksize;
+    if (fs_blocks == 0) {
+      printf("--blocks is needed to write %s\n", image.c_str());
+      return showHelp();
+    }
+
+    int result = chromeos_verity_write(alg.c_str(),
+                                       image_fd,
+                                       device.c_str(),
+                                       blocksize,
+                                       fs_blocks,
+                                       salt.c_str(),
+                                       root_hash.c_str(),
+                                       !root_hash.empty(),
+                                       &verity_opts);
+    if (image_fd != STDIN_FILENO)
+      close(image_fd);
+    return result != 0;
+  }
+
+  // Install a hash tree that came with the payload, checking the tree but
+  // not rehashing the data; "verify" can check the data later
+  if (command == "install-tree") {
+    if (argc - optind != 2 || alg.empty() || fs_blocks == 0 ||
+        blocksize == 0 || root_hash.empty())
+      return showHelp();
+
+    string tree = argv[optind++];
+    string device = argv[optind++];
+
+    return chromeos_verity_install_tree(alg.c_str(),
+                                        tree.c_str(),
+                                        device.c_str(),
+                                        blocksize,
+                                        fs_blocks,
+                                        salt.c_str(),
+                                        root_hash.c_str(),
+                                        &verity_opts) != 0;
+  }
+
+  // Recheck a filesystem against its hash tree in the background, carrying
+  // on from where an earlier scrub was stopped
+  if (command == "scrub") {
+    if (argc - optind != 1)
+      return showHelp();
+
+    string device = argv[optind++];
+
+    // The kernel of a slot knows how its root filesystem was hashed
+    if (!kernel.empty()) {
+      string dm_config = ExtractKernelArg(DumpKernelConfig(kernel), "dm");
+
+      if (alg.empty())
+        alg = ExtractKernelArg(dm_config, "alg");
+      if (salt.empty())
+        salt = ExtractKernelArg(dm_config, "salt");
+      if (root_hash.empty())
+        root_hash = ExtractKernelArg(dm_config, "root_hexdigest");
+      if (fs_blocks == 0 && blocksize != 0)
+        fs_blocks = strtoull(ExtractKernelArg(dm_config, "hashstart").c_str(),
+                             NULL, 0) * 512 / blocksize;
+    }
+
+    if (alg.empty() || fs_blocks == 0 || blocksize == 0 || root_hash.empty())
+      return showHelp();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = RequestStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    verity_opts.cancel = &stop_requested;
+
+    return chromeos_verity_scrub(alg.c_str(),
+                                 device.c_str(),
+                                 blocksize,
+                                 fs_blocks,
+                                 salt.c_str(),
+                                 root_hash.c_str(),
+                                 checkpoint.empty() ? NULL :
+                                                      checkpoint.c_str(),
+                                 &verity_opts) != 0;
+  }
+
   printf("Unknown command: '%s'\n\n", command.c_str());
   return showHelp();
 }
@@ -0,0 +1,154 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures how fast verity leaves are hashed: for each algorithm the
+// compiled-in verity_hasher next to the one block at a time
+// dm_bht_store_block path, and each sha256 and blake2 implementation on
+// its own. libdm-bht can't hash blake2, so those have no dm-bht line.
+//
+//   hash_benchmark [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+
+extern "C" {
+#include <verity/dm-bht.h>
+#include <verity/dm-bht-userspace.h>
+}
+
+#include "verity_blake2.h"
+#include "verity_hash.h"
+#include "verity_sha256.h"
+
+using std::string;
+
+const unsigned kBlockSize = 4096;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void Report(const char* alg, const char* name, size_t bytes,
+            double seconds) {
+  printf("%-11s %-10s %8.1f MiB/s\n", alg, name,
+         bytes / seconds / (1 << 20));
+}
+
+// Hashes every block through libdm-bht, the way chromeos_verity used to.
+bool RunDmBht(const char* alg, const string& data, size_t blocks) {
+  struct dm_bht bht;
+  string hash_buffer;
+
+  if (dm_bht_create(&bht, blocks, alg)) {
+    fprintf(stderr, "dm_bht_create failed\n");
+    return false;
+  }
+  hash_buffer.resize(dm_bht_sectors(&bht) << 9);
+  dm_bht_set_buffer(&bht, &hash_buffer[0]);
+  dm_bht_set_salt(&bht, "000102030405060708090a0b0c0d0e0f"
+                        "101112131415161718191a1b1c1d1e1f");
+
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(const_cast<char*>(data.data()));
+  double start = Now();
+  for (size_t i = 0; i < blocks; i++) {
+    if (dm_bht_store_block(&bht, i, bytes + i * kBlockSize)) {
+      fprintf(stderr, "dm_bht_store_block failed\n");
+      return false;
+    }
+  }
+  Report(alg, "dm-bht", data.size(), Now() - start);
+
+  dm_bht_destroy(&bht);
+  return true;
+}
+
+// Hashes every block with the verity_hasher for alg.
+bool RunHasher(const char* alg, const char* name, const string& data,
+               size_t blocks, const uint8_t* salt, size_t salt_size) {
+  struct verity_hasher* hasher = verity_hasher_create(alg, salt, salt_size,
+                                                      kBlockSize);
+  if (!hasher) {
+    fprintf(stderr, "no hasher for %s\n", alg);
+    return false;
+  }
+
+  string digests(blocks * verity_hasher_digest_size(hasher), '\0');
+  double start = Now();
+  int ret = verity_hasher_blocks(
+      hasher, reinterpret_cast<const uint8_t*>(data.data()), blocks,
+      reinterpret_cast<uint8_t*>(&digests[0]));
+  double seconds = Now() - start;
+
+  if (ret)
+    fprintf(stderr, "%s failed\n", name ? name : alg);
+  else
+    Report(alg, name ? name : verity_hasher_impl(hasher), data.size(),
+           seconds);
+  verity_hasher_free(hasher);
+  return ret == 0;
+}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 256;
+  size_t blocks = megabytes * (1 << 20) / kBlockSize;
+  uint8_t salt[DM_BHT_SALT_SIZE];
+
+  if (blocks < 2) {
+    fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+    return 1;
+  }
+
+  string data(blocks * kBlockSize, '\0');
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i * 2654435761u >> 24;
+  for (size_t i = 0; i < sizeof(salt); i++)
+    salt[i] = i;
+
+  printf("hashing %zu blocks of %u bytes\n", blocks, kBlockSize);
+
+  const char* algs[] = { "md5", "sha1", "sha256" };
+  for (size_t i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+    if (!RunDmBht(algs[i], data, blocks) ||
+        !RunHasher(algs[i], NULL, data, blocks, salt, sizeof(salt)))
+      return 1;
+  }
+
+  const char* blake2_algs[] = { "blake2b-256", "blake2b-512", "blake2s-256" };
+  for (size_t i = 0; i < sizeof(blake2_algs) / sizeof(blake2_algs[0]); i++) {
+    if (!RunHasher(blake2_algs[i], NULL, data, blocks, salt, sizeof(salt)))
+      return 1;
+  }
+
+  const char* impls[] = { "scalar", "avx2", "sha-ni" };
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (verity_sha256_use_impl(impls[i]) != 0) {
+      printf("%-11s %-10s unsupported on this cpu\n", "sha256", impls[i]);
+      continue;
+    }
+    if (!RunHasher("sha256", impls[i], data, blocks, salt, sizeof(salt)))
+      return 1;
+  }
+
+  const char* blake2_impls[] = { "scalar", "avx2" };
+  for (size_t i = 0; i < sizeof(blake2_impls) / sizeof(blake2_impls[0]); i++) {
+    if (verity_blake2_use_impl(blake2_impls[i]) != 0) {
+      printf("%-11s %-10s unsupported on this cpu\n", "blake2",
+             blake2_impls[i]);
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(blake2_algs) / sizeof(blake2_algs[0]); j++) {
+      if (!RunHasher(blake2_algs[j], blake2_impls[i], data, blocks, salt,
+                     sizeof(salt)))
+        return 1;
+    }
+  }
+
+  return 0;
+}
@@ -6,15 +6,27 @@
 
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <set>
+
+#include "subprocess.h"
+
 extern "C" {
 #include "vboot_host.h"
 }
@@ -99,6 +111,30 @@ int RunCommand(const string& command) {
   return result;
 }
 
+int RunArgv(const std::vector<string>& argv) {
+  string command;
+  for (size_t i = 0; i < argv.size(); i++) {
+    if (i)
+      command += " ";
+    command += argv[i];
+  }
+  printf("Command: %s\n", command.c_str());
+
+  Subprocess child;
+  if (!child.Start(argv)) {
+    printf("Failed Command: %s - %s\n", command.c_str(), strerror(errno));
+    return -1;
+  }
+
+  child.Wait(-1);
+  int result = child.status();
+
+  if (result != 0)
+    printf("Failed Command: %s - %d\n", command.c_str(), result);
+
+  return result;
+}
+
 // Open a file and read it's contents into a string.
 // return "" on error.
 bool ReadFileToString(const string& path, string* contents) {
@@ -150,7 +186,106 @@ bool WriteStringToFile(const string& contents, const string& path) {
   return success;
 }
 
+// The buffer kCopyBuffer copies through, aligned for any device.
+const size_t kCopyBufferSize = 4 << 20;
+const size_t kCopyBufferAlignment = 4096;
+
+// The most copy_file_range and sendfile are asked for at once; they
+// return early at 2 GiB anyway.
+const size_t kCopyChunkSize = 1 << 30;
+
+// Errors that mean a method can't copy these files, rather than that the
+// copy failed.
+bool CopyMethodUnsupported(int error) {
+  return error == ENOSYS || error == EINVAL || error == EXDEV ||
+         error == EOPNOTSUPP || error == ENOTTY;
+}
+
+// Copies from fd_from's offset to its end with method. Returns 1 when it
+// is all copied, 0 if method can't do it (some may have been copied) and
+// -1 on error.
+int CopyWith(CopyMethod method, int fd_from, int fd_to, size_t* calls) {
+  switch (method) {
+    case kCopyReflink:
+#ifdef FICLONE
+      (*calls)++;
+      if (ioctl(fd_to, FICLONE, fd_from) == 0)
+        return 1;
+      return CopyMethodUnsupported(errno) ? 0 : -1;
+#else
+      return 0;
+#endif
+
+    case kCopyFileRange:
+#ifdef __NR_copy_file_range
+      while (true) {
+        (*calls)++;
+        ssize_t copied = syscall(__NR_copy_file_range, fd_from, NULL, fd_to,
+                                 NULL, kCopyChunkSize, 0);
+        if (copied == 0)
+          return 1;
+        if (copied < 0)
+          return CopyMethodUnsupported(errno) ? 0 : -1;
+      }
+#else
+      return 0;
+#endif
+
+    case kCopySendfile:
+      while (true) {
+        (*calls)++;
+        ssize_t copied = sendfile(fd_to, fd_from, NULL, kCopyChunkSize);
+        if (copied == 0)
+          return 1;
+        if (copied < 0)
+          return CopyMethodUnsupported(errno) ? 0 : -1;
+      }
+
+    case kCopyBuffer: {
+      void* buffer;
+      if (posix_memalign(&buffer, kCopyBufferAlignment, kCopyBufferSize))
+        return -1;
+
+      char* bytes = static_cast<char*>(buffer);
+      int result = 1;
+      while (true) {
+        (*calls)++;
+        ssize_t buff_in = read(fd_from, bytes, kCopyBufferSize);
+        if (buff_in <= 0) {
+          result = buff_in == 0 ? 1 : -1;
+          break;
+        }
+
+        ssize_t buff_out = 0;
+        while (buff_out < buff_in) {
+          (*calls)++;
+          ssize_t written = write(fd_to, bytes + buff_out, buff_in - buff_out);
+          if (written <= 0)
+            break;
+          buff_out += written;
+        }
+        if (buff_out != buff_in) {
+          result = -1;
+          break;
+        }
+      }
+
+      free(buffer);
+      return result;
+    }
+  }
+
+  return -1;
+}
+
 bool CopyFile(const string& from_path, const string& to_path) {
+  return CopyFile(from_path, to_path, kCopyReflink, NULL);
+}
+
+bool CopyFile(const string& from_path,
+              const string& to_path,
+              CopyMethod first,
+              CopyFileStats* stats) {
   int fd_from = open(from_path.c_str(), O_RDONLY);
 
   if (fd_from == -1) {
@@ -169,28 +304,152 @@ bool CopyFile(const string& from_path, const string& to_path) {
     success = false;
   }
 
-  ssize_t buff_in = 1;
-  char buff[512];
-
-  while (success && (buff_in > 0)) {
-    buff_in = read(fd_from, buff, sizeof(buff));
-    success = (buff_in >= 0);
+  // Only regular files can be copied in the kernel; anything else (or a
+  // directory, which fails) is read.
+  struct stat st;
+  if (success && (fstat(fd_from, &st) != 0 || !S_ISREG(st.st_mode)))
+    first = kCopyBuffer;
+
+  CopyMethod method = first;
+  size_t calls = 0;
+  int result = 0;
+
+  while (success && result == 0) {
+    result = CopyWith(method, fd_from, fd_to, &calls);
+    if (result == 0 && method == kCopyBuffer)
+      result = -1;
+    else if (result == 0)
+      method = static_cast<CopyMethod>(method + 1);
+  }
+  if (result < 0)
+    success = false;
 
-    if (success) {
-      ssize_t buff_out = write(fd_to, buff, buff_in);
-      success = (buff_out == buff_in);
-    }
+  if (stats) {
+    stats->method = method;
+    stats->calls = calls;
   }
 
   if (close(fd_from) != 0)
     success = false;
 
-  if (close(fd_to) != 0)
+  if (fd_to != -1 && close(fd_to) != 0)
     success = false;
 
   return success;
 }
 
+// CopyFiles runs this many copies at once at most; there are only ever a
+// few files, and they share a disk.
+const size_t kMaxCopyThreads = 4;
+
+// What the CopyFiles threads share: the copies, the next one to take and
+// whether they all worked so far.
+struct CopyFilesJob {
+  const std::vector<std::pair<string, string> >* copies;
+  const std::vector<string>* temp_paths;
+  size_t next;
+  bool success;
+  pthread_mutex_t lock;
+};
+
+// Opens path and runs flush on it. A directory can be opened, a file
+// might not be writable, so it is opened read only either way.
+bool SyncPath(const string& path, int (*flush)(int)) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  bool result = flush(fd) == 0;
+
+  if (close(fd) != 0)
+    result = false;
+
+  return result;
+}
+
+void* CopyFilesThread(void* arg) {
+  CopyFilesJob* job = static_cast<CopyFilesJob*>(arg);
+
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    size_t i = job->next++;
+    bool keep_going = job->success && i < job->copies->size();
+    pthread_mutex_unlock(&job->lock);
+    if (!keep_going)
+      break;
+
+    // The data has to be down before the rename makes it the real file.
+    const string& temp_path = (*job->temp_paths)[i];
+    bool success = CopyFile((*job->copies)[i].first, temp_path) &&
+                   SyncPath(temp_path, fsync);
+
+    if (!success) {
+      pthread_mutex_lock(&job->lock);
+      job->success = false;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  return NULL;
+}
+
+bool CopyFiles(const std::vector<std::pair<string, string> >& copies) {
+  std::vector<string> temp_paths;
+  for (size_t i = 0; i < copies.size(); i++)
+    temp_paths.push_back(copies[i].second + ".new");
+
+  CopyFilesJob job;
+  job.copies = &copies;
+  job.temp_paths = &temp_paths;
+  job.next = 0;
+  job.success = true;
+  pthread_mutex_init(&job.lock, NULL);
+
+  std::vector<pthread_t> threads(std::min(copies.size(), kMaxCopyThreads));
+  size_t started = 0;
+  for (; started < threads.size(); started++) {
+    if (pthread_create(&threads[started], NULL, CopyFilesThread, &job))
+      break;
+  }
+
+  // With no threads at all, do the copies here.
+  if (started == 0)
+    CopyFilesThread(&job);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  if (!job.success) {
+    for (size_t i = 0; i < temp_paths.size(); i++)
+      unlink(temp_paths[i].c_str());
+    return false;
+  }
+
+  std::set<string> dirs;
+  for (size_t i = 0; i < copies.size(); i++) {
+    if (rename(temp_paths[i].c_str(), copies[i].second.c_str()) != 0) {
+      printf("CopyFiles failed to rename %s\n", temp_paths[i].c_str());
+      // Those already renamed stay; don't leave the rest lying around.
+      for (; i < temp_paths.size(); i++)
+        unlink(temp_paths[i].c_str());
+      return false;
+    }
+    string dir = Dirname(copies[i].second);
+    if (dir.empty())
+      dir = copies[i].second[0] == '/' ? "/" : ".";
+    dirs.insert(dir);
+  }
+
+  for (std::set<string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+    if (!SyncPath(*it, fsync)) {
+      printf("CopyFiles failed to sync %s\n", it->c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
 // Look up a keyed value from a /etc/lsb-release formatted file.
 // TODO(dgarrett): If we ever call this more than once, cache
 // file contents to avoid reparsing.
@@ -303,6 +562,62 @@ string MakePartitionDev(const string& block_dev, int partition) {
   return StringPrintf("%s%d", block_dev.c_str(), partition);
 }
 
+string MountInfoSource(const string& mountinfo, const string& mount_point) {
+  std::vector<string> lines;
+  string source;
+
+  SplitString(mountinfo, '\n', &lines);
+  for (size_t i = 0; i < lines.size(); i++) {
+    // id parent major:minor root mount_point options [optional...] -
+    // fstype source super_options
+    std::vector<string> fields;
+    SplitString(lines[i], ' ', &fields);
+    if (fields.size() < 10 || fields[4] != mount_point)
+      continue;
+
+    for (size_t j = 6; j + 2 < fields.size(); j++) {
+      if (fields[j] == "-") {
+        source = fields[j + 2];
+        break;
+      }
+    }
+  }
+
+  return source;
+}
+
+string GetRootDevice() {
+  string mountinfo;
+  struct stat st;
+
+  // Usually the mount source is the device...
+  if (ReadFileToString("/proc/self/mountinfo", &mountinfo)) {
+    string source = MountInfoSource(mountinfo, "/");
+    if (stat(source.c_str(), &st) == 0 && S_ISBLK(st.st_mode))
+      return source;
+  }
+
+  // ...but it can be something like /dev/root that doesn't exist, so ask
+  // sysfs for the name of the device / is on.
+  if (stat("/", &st) != 0)
+    return "";
+
+  string uevent;
+  string path = StringPrintf("/sys/dev/block/%u:%u/uevent",
+                             major(st.st_dev), minor(st.st_dev));
+  if (!ReadFileToString(path, &uevent))
+    return "";
+
+  std::vector<string> lines;
+  SplitString(uevent, '\n', &lines);
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (lines[i].compare(0, 8, "DEVNAME=") == 0)
+      return "/dev/" + lines[i].substr(8);
+  }
+
+  return "";
+}
+
 // Convert /blah/file to /blah
 string Dirname(const string& filename) {
   size_t last_slash = filename.rfind('/');
@@ -462,6 +777,75 @@ bool MakeDeviceReadOnly(const string& dev_name) {
   return result;
 }
 
+bool FlushBlockDevice(const string& dev_name) {
+  int fd = open(dev_name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  // On a block device fsync also sends the device a cache flush.
+  bool result = fsync(fd) == 0;
+
+  // Files have no buffers of their own to drop.
+  if (result && ioctl(fd, BLKFLSBUF, 0) != 0 && errno != ENOTTY)
+    result = false;
+
+  close(fd);
+
+  return result;
+}
+
+void SyncSet::AddFile(const string& path) {
+  files_.push_back(path);
+}
+
+void SyncSet::AddFilesystem(const string& path) {
+  filesystems_.push_back(path);
+}
+
+void SyncSet::AddDevice(const string& dev_name) {
+  devices_.push_back(dev_name);
+}
+
+double MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool SyncSet::Sync() {
+  bool success = true;
+
+  for (int kind = 0; kind < 3; kind++) {
+    const std::vector<string>& paths =
+        kind == 0 ? files_ : kind == 1 ? filesystems_ : devices_;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+      double start = MonotonicSeconds();
+      bool result;
+
+      if (kind == 0)
+        result = SyncPath(paths[i], fdatasync);
+      else if (kind == 1)
+        result = SyncPath(paths[i], syncfs);
+      else
+        result = FlushBlockDevice(paths[i]);
+
+      if (result) {
+        printf("Synced %s in %.1f ms\n", paths[i].c_str(),
+               (MonotonicSeconds() - start) * 1000);
+      } else {
+        printf("Syncing %s failed\n", paths[i].c_str());
+        success = false;
+      }
+    }
+  }
+
+  files_.clear();
+  filesystems_.clear();
+  devices_.clear();
+  return success;
+}
+
 extern "C" {
 
 // The external dumpkernelconfig.a library depends on this symbol
@@ -587,6 +971,25 @@ bool SetKernelArg(const string& key,
   return true;
 }
 
+bool SetVerityKernelArgs(const string& alg,
+                         const string& root_hexdigest,
+                         const string& salt,
+                         string* kernel_config) {
+  string dm_config = ExtractKernelArg(*kernel_config, "dm");
+
+  if (dm_config.empty())
+    return false;
+
+  if (!SetKernelArg("alg", alg, &dm_config) ||
+      !SetKernelArg("root_hexdigest", root_hexdigest, &dm_config))
+    return false;
+
+  if (!salt.empty() && !SetKernelArg("salt", salt, &dm_config))
+    dm_config += " salt=" + salt;
+
+  return SetKernelArg("dm", dm_config, kernel_config);
+}
+
 // For the purposes of ChromeOS, devices that start with
 // "/dev/dm" are to be treated as read-only.
 bool IsReadonly(const string& device) {
@@ -6,13 +6,9 @@
 #define INST_UTIL_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
-#define RUN_OR_RETURN_FALSE(_x)                                 \
-  do {                                                          \
-    if (RunCommand(_x) != 0) return false;                      \
-  } while (0)
-
 __attribute__((format(printf, 1, 2)))
 std::string StringPrintf(const char* format, ...);
 
@@ -20,17 +16,57 @@ void SplitString(const std::string& str,
                  char split,
                  std::vector<std::string>* output);
 
-// This is a place holder to invoke the backing scripts. Once all scripts have
-// been rewritten as library calls this command should be deleted.
+// Runs command through the shell with system() and returns its raw result,
+// a wait status. The installer itself runs commands with RunArgv instead;
+// this is left for shell command lines, such as cleanup in tests.
 int RunCommand(const std::string& command);
 
+// Runs argv[0], a path, with the arguments in argv directly rather than
+// through a shell, and waits for it. Returns its exit code (128 plus the
+// signal if it was killed), or -1 if it couldn't be run at all.
+int RunArgv(const std::vector<std::string>& argv);
+
 bool ReadFileToString(const std::string& path, std::string* contents);
 
 bool WriteStringToFile(const std::string& contents, const std::string& path);
 
+// The ways CopyFile can copy a file, fastest first.
+enum CopyMethod {
+  kCopyReflink,      // FICLONE, sharing the blocks on the same filesystem
+  kCopyFileRange,    // copy_file_range, copied inside the kernel
+  kCopySendfile,     // sendfile, also inside the kernel
+  kCopyBuffer,       // read and write through a multi-MiB buffer
+};
+
+// How a CopyFile went: the method that did the copy and the number of
+// copying system calls it took, counting any that failed over to it.
+struct CopyFileStats {
+  CopyMethod method;
+  size_t calls;
+};
+
 // Copies a single file.
 bool CopyFile(const std::string& from_path, const std::string& to_path);
 
+// Copies a single file with the first method, starting at first, that
+// these files support; later methods pick up where an earlier one stopped.
+// stats, which may be NULL, says how it went.
+bool CopyFile(const std::string& from_path,
+              const std::string& to_path,
+              CopyMethod first,
+              CopyFileStats* stats);
+
+// Copies each (from, to) pair in copies, several at a time. Each copy is
+// written to a temporary file next to its destination and flushed; only
+// when all of them are done are they renamed into place, one at a time,
+// followed by one fsync of each destination directory. Nothing is
+// replaced unless every copy succeeded, but a rename that fails, or a
+// crash while they are renamed, can leave only some destinations
+// replaced. Temporary files are removed on failure. Returns true on
+// success.
+bool CopyFiles(
+    const std::vector<std::pair<std::string, std::string> >& copies);
+
 bool LsbReleaseValue(const std::string& file,
                      const std::string& key,
                      std::string* result);
@@ -45,6 +81,16 @@ int GetPartitionFromPartitionDev(const std::string& partition_dev);
 std::string MakePartitionDev(const std::string& partition_dev,
                              int partition);
 
+// Finds the source of the last mount on mount_point in the contents of a
+// /proc/<pid>/mountinfo file (so an overmount wins), or "" if there is none.
+std::string MountInfoSource(const std::string& mountinfo,
+                            const std::string& mount_point);
+
+// Finds the block device mounted on /, without running findmnt: from
+// /proc/self/mountinfo, or else from the device number of / and sysfs.
+// Returns "" on error.
+std::string GetRootDevice();
+
 // Convert /blah/file to /blah
 std::string Dirname(const std::string& filename);
 
@@ -73,6 +119,36 @@ bool MakeFileSystemRw(const std::string& dev_name, bool rw);
 // hdparm -r 1 /device
 bool MakeDeviceReadOnly(const std::string& dev_name);
 
+// Writes out what is buffered for the block device and flushes the
+// device's write cache, so it survives a power cut, then drops the
+// buffers so later reads come from the device. Also works on plain files.
+bool FlushBlockDevice(const std::string& dev_name);
+
+// The files, filesystems and block devices the installer wrote, so that
+// exactly those can be made durable instead of everything sync() would
+// flush.
+class SyncSet {
+ public:
+  // A file to fdatasync.
+  void AddFile(const std::string& path);
+
+  // The filesystem path is on, to syncfs.
+  void AddFilesystem(const std::string& path);
+
+  // A block device to flush with FlushBlockDevice.
+  void AddDevice(const std::string& dev_name);
+
+  // Flushes everything added (files, then filesystems, then devices, so
+  // that the device cache flushes come last), logging how long each one
+  // took, and forgets it all. Returns false if any of them failed.
+  bool Sync();
+
+ private:
+  std::vector<std::string> files_;
+  std::vector<std::string> filesystems_;
+  std::vector<std::string> devices_;
+};
+
 // Conveniently invoke the external dump_kernel_config library
 std::string DumpKernelConfig(const std::string& kernel_dev);
 
@@ -87,6 +163,17 @@ bool SetKernelArg(const std::string& tag,
                   const std::string& value,
                   std::string* kernel_config);
 
+// Point the verity table in the dm="..." argument at a rebuilt hash tree,
+// e.g. one hashed with blake2b-256, by setting its alg, root_hexdigest and
+// salt. A salt the table doesn't have yet is added to the end of it, an
+// empty one leaves the table's salt alone.
+// Returns false if there is no dm argument or it has no alg or
+// root_hexdigest.
+bool SetVerityKernelArgs(const std::string& alg,
+                         const std::string& root_hexdigest,
+                         const std::string& salt,
+                         std::string* kernel_config);
+
 // IsReadonly determines if the name devices should be treated as
 // read-only. This is based on the device name being prefixed with
 // "/dev/dm". This catches both cases where verity may be /dev/dm-0
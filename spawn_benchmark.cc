@@ -0,0 +1,124 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures what it costs to run a trivial command: through system(),
+// which forks and starts a shell to start it, against Subprocess, which
+// spawns it directly, alone, with its output captured, and several at a
+// time collected with WaitAny.
+//
+//   spawn_benchmark [runs] [command]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include "subprocess.h"
+
+using std::string;
+using std::vector;
+
+// How many children the concurrent run keeps going at once.
+const size_t kConcurrent = 8;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void Report(const char* name, int runs, double seconds) {
+  printf("%-20s %9.1f us/run %9.0f runs/s\n", name, seconds / runs * 1e6,
+         runs / seconds);
+}
+
+bool RunSpawned(const vector<string>& argv, bool capture) {
+  Subprocess child;
+  child.set_capture(capture);
+  return child.Start(argv) && child.Wait(-1) && child.status() == 0;
+}
+
+bool RunConcurrent(const vector<string>& argv, int runs) {
+  vector<Subprocess*> children;
+  int started = 0;
+  bool success = true;
+
+  while (success && (started < runs || !children.empty())) {
+    while (started < runs && children.size() < kConcurrent) {
+      Subprocess* child = new Subprocess;
+      if (!child->Start(argv)) {
+        delete child;
+        success = false;
+        break;
+      }
+      children.push_back(child);
+      started++;
+    }
+
+    int done = WaitAny(children, -1);
+    if (done == -1)
+      break;
+    success = children[done]->status() == 0 && success;
+    delete children[done];
+    children.erase(children.begin() + done);
+  }
+
+  for (size_t i = 0; i < children.size(); i++)
+    delete children[i];
+
+  return success;
+}
+
+int main(int argc, char** argv) {
+  int runs = argc > 1 ? atoi(argv[1]) : 1000;
+  string command = argc > 2 ? argv[2] : "/bin/true";
+
+  if (runs <= 0) {
+    fprintf(stderr, "usage: %s [runs] [command]\n", argv[0]);
+    return 1;
+  }
+
+  vector<string> command_argv(1, command);
+  printf("%d runs of %s\n", runs, command.c_str());
+
+  double start = Now();
+  for (int i = 0; i < runs; i++) {
+    if (system(command.c_str()) != 0) {
+      fprintf(stderr, "system(%s) failed\n", command.c_str());
+      return 1;
+    }
+  }
+  Report("system", runs, Now() - start);
+
+  start = Now();
+  for (int i = 0; i < runs; i++) {
+    if (!RunSpawned(command_argv, false)) {
+      fprintf(stderr, "spawning %s failed\n", command.c_str());
+      return 1;
+    }
+  }
+  Report("spawn", runs, Now() - start);
+
+  start = Now();
+  for (int i = 0; i < runs; i++) {
+    if (!RunSpawned(command_argv, true)) {
+      fprintf(stderr, "spawning %s failed\n", command.c_str());
+      return 1;
+    }
+  }
+  Report("spawn, captured", runs, Now() - start);
+
+  start = Now();
+  if (!RunConcurrent(command_argv, runs)) {
+    fprintf(stderr, "spawning %s failed\n", command.c_str());
+    return 1;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "spawn, %zu at once", kConcurrent);
+  Report(name, runs, Now() - start);
+
+  return 0;
+}
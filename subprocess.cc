@@ -0,0 +1,268 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "subprocess.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Without a pidfd there's nothing to poll for a child's exit, so it is
+// checked for this often instead.
+const int kReapIntervalMs = 10;
+
+double NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void CloseFd(int* fd) {
+  if (*fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+// Appends what the pipe has ready to contents, closing it at EOF.
+void ReadReady(int* fd, string* contents) {
+  char buff[16384];
+
+  while (*fd != -1) {
+    ssize_t size = read(*fd, buff, sizeof(buff));
+    if (size > 0) {
+      contents->append(buff, size);
+    } else if (size == -1 && errno == EINTR) {
+      continue;
+    } else {
+      if (size == 0 || errno != EAGAIN)
+        CloseFd(fd);
+      break;
+    }
+  }
+}
+
+int OpenPidFd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+int ShellStatus(int wstatus) {
+  if (WIFEXITED(wstatus))
+    return WEXITSTATUS(wstatus);
+  if (WIFSIGNALED(wstatus))
+    return 128 + WTERMSIG(wstatus);
+  return -1;
+}
+
+}  // namespace
+
+Subprocess::Subprocess()
+    : capture_(false),
+      pid_(-1),
+      pidfd_(-1),
+      out_fd_(-1),
+      err_fd_(-1),
+      exited_(false),
+      status_(-1) {
+}
+
+Subprocess::~Subprocess() {
+  if (running())
+    Kill();
+
+  CloseFd(&pidfd_);
+  CloseFd(&out_fd_);
+  CloseFd(&err_fd_);
+}
+
+bool Subprocess::Start(const vector<string>& argv) {
+  if (argv.empty() || pid_ != -1) {
+    errno = EINVAL;
+    return false;
+  }
+
+  vector<char*> args;
+  for (size_t i = 0; i < argv.size(); i++)
+    args.push_back(const_cast<char*>(argv[i].c_str()));
+  args.push_back(NULL);
+
+  int out_pipe[2] = { -1, -1 };
+  int err_pipe[2] = { -1, -1 };
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  if (capture_) {
+    if (pipe2(out_pipe, O_CLOEXEC) != 0 || pipe2(err_pipe, O_CLOEXEC) != 0) {
+      int saved_errno = errno;
+      posix_spawn_file_actions_destroy(&actions);
+      CloseFd(&out_pipe[0]);
+      CloseFd(&out_pipe[1]);
+      errno = saved_errno;
+      return false;
+    }
+
+    // dup2 drops close-on-exec from the child's copies only.
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+  }
+
+  // Don't let anything we've buffered come out after the child's output.
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid;
+  int result = posix_spawn(&pid, args[0], &actions, NULL, &args[0], environ);
+  posix_spawn_file_actions_destroy(&actions);
+
+  CloseFd(&out_pipe[1]);
+  CloseFd(&err_pipe[1]);
+
+  if (result != 0) {
+    CloseFd(&out_pipe[0]);
+    CloseFd(&err_pipe[0]);
+    errno = result;
+    return false;
+  }
+
+  pid_ = pid;
+  pidfd_ = OpenPidFd(pid);
+  out_fd_ = out_pipe[0];
+  err_fd_ = err_pipe[0];
+
+  if (out_fd_ != -1)
+    fcntl(out_fd_, F_SETFL, fcntl(out_fd_, F_GETFL) | O_NONBLOCK);
+  if (err_fd_ != -1)
+    fcntl(err_fd_, F_SETFL, fcntl(err_fd_, F_GETFL) | O_NONBLOCK);
+
+  return true;
+}
+
+bool Subprocess::Wait(int timeout_ms) {
+  if (!running())
+    return exited_;
+
+  vector<Subprocess*> children(1, this);
+  if (WaitAny(children, timeout_ms) == 0)
+    return true;
+
+  Kill();
+  return false;
+}
+
+void Subprocess::ReadPipes() {
+  ReadReady(&out_fd_, &output_);
+  ReadReady(&err_fd_, &error_);
+}
+
+bool Subprocess::Reap() {
+  int wstatus;
+  pid_t result = waitpid(pid_, &wstatus, WNOHANG);
+
+  if (result == 0 || (result == -1 && errno == EINTR))
+    return false;
+
+  exited_ = true;
+  status_ = result == pid_ ? ShellStatus(wstatus) : -1;
+
+  // Whatever is still in the pipes; anything a grandchild writes later
+  // is not waited for.
+  ReadPipes();
+  CloseFd(&out_fd_);
+  CloseFd(&err_fd_);
+  CloseFd(&pidfd_);
+  return true;
+}
+
+void Subprocess::Kill() {
+  kill(pid_, SIGKILL);
+
+  int wstatus;
+  pid_t result;
+  do {
+    result = waitpid(pid_, &wstatus, 0);
+  } while (result == -1 && errno == EINTR);
+
+  exited_ = true;
+  status_ = result == pid_ ? ShellStatus(wstatus) : -1;
+
+  ReadPipes();
+  CloseFd(&out_fd_);
+  CloseFd(&err_fd_);
+  CloseFd(&pidfd_);
+}
+
+int WaitAny(const vector<Subprocess*>& children, int timeout_ms) {
+  double deadline = NowMs() + timeout_ms;
+
+  while (true) {
+    vector<struct pollfd> fds;
+    bool any_running = false;
+    bool any_without_pidfd = false;
+
+    for (size_t i = 0; i < children.size(); i++) {
+      Subprocess* child = children[i];
+      if (!child->running())
+        continue;
+
+      if (child->Reap())
+        return i;
+
+      any_running = true;
+
+      int child_fds[] = { child->out_fd_, child->err_fd_, child->pidfd_ };
+      for (size_t j = 0; j < sizeof(child_fds) / sizeof(child_fds[0]); j++) {
+        if (child_fds[j] == -1)
+          continue;
+        struct pollfd fd = { child_fds[j], POLLIN, 0 };
+        fds.push_back(fd);
+      }
+
+      if (child->pidfd_ == -1)
+        any_without_pidfd = true;
+    }
+
+    if (!any_running)
+      return -1;
+
+    int wait_ms = -1;
+    if (timeout_ms >= 0) {
+      double remaining = deadline - NowMs();
+      if (remaining <= 0)
+        return -1;
+      wait_ms = static_cast<int>(remaining) + 1;
+    }
+
+    if (any_without_pidfd && (wait_ms < 0 || wait_ms > kReapIntervalMs))
+      wait_ms = kReapIntervalMs;
+
+    if (poll(fds.empty() ? NULL : &fds[0], fds.size(), wait_ms) == -1 &&
+        errno != EINTR) {
+      perror("poll");
+      return -1;
+    }
+
+    for (size_t i = 0; i < children.size(); i++) {
+      if (children[i]->running())
+        children[i]->ReadPipes();
+    }
+  }
+}
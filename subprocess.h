@@ -0,0 +1,86 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SUBPROCESS_H_
+#define SUBPROCESS_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// A child process started straight from an argv with posix_spawn, with no
+// shell in between, so arguments are never split or expanded.
+//
+//   Subprocess child;
+//   child.set_capture(true);
+//   if (child.Start(argv) && child.Wait(5000) && child.status() == 0)
+//     printf("%s", child.output().c_str());
+//
+// A child still running when its Subprocess goes away is killed.
+class Subprocess {
+ public:
+  Subprocess();
+  ~Subprocess();
+
+  // Collect the child's stdout and stderr into output() and error()
+  // instead of letting it share ours. Must be set before Start.
+  void set_capture(bool capture) { capture_ = capture; }
+
+  // Starts argv[0], which must be a path; PATH is not searched. Returns
+  // false, with errno set, if it could not be started.
+  bool Start(const std::vector<std::string>& argv);
+
+  // Waits up to timeout_ms (forever if negative) for the child to exit.
+  // If it doesn't, it is killed, and false is returned.
+  bool Wait(int timeout_ms);
+
+  // Started and not yet seen to exit.
+  bool running() const { return pid_ != -1 && !exited_; }
+
+  pid_t pid() const { return pid_; }
+
+  // The exit code, or 128 plus the signal that killed it, as a shell
+  // reports it. -1 until the child has exited.
+  int status() const { return status_; }
+
+  const std::string& output() const { return output_; }
+  const std::string& error() const { return error_; }
+
+ private:
+  friend int WaitAny(const std::vector<Subprocess*>& children,
+                     int timeout_ms);
+
+  // Reads whatever the pipes have ready, without blocking.
+  void ReadPipes();
+
+  // Reaps the child if it has exited, then reads the rest of its output.
+  // Returns true if it has exited.
+  bool Reap();
+
+  void Kill();
+
+  bool capture_;
+  pid_t pid_;
+  // Becomes readable when the child exits; -1 if the kernel can't do it.
+  int pidfd_;
+  int out_fd_;
+  int err_fd_;
+  bool exited_;
+  int status_;
+  std::string output_;
+  std::string error_;
+
+  // Not copyable; it owns the child and its pipes.
+  Subprocess(const Subprocess&);
+  void operator=(const Subprocess&);
+};
+
+// Waits up to timeout_ms (forever if negative) for any of the running
+// children to exit, collecting the output of all of them meanwhile.
+// Returns the index of the one that exited, or -1 if none did in time or
+// none of them was running. Children that time out are left running.
+int WaitAny(const std::vector<Subprocess*>& children, int timeout_ms);
+
+#endif  // SUBPROCESS_H_
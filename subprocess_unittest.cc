@@ -0,0 +1,117 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "subprocess.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+vector<string> Shell(const string& script) {
+  vector<string> argv;
+  argv.push_back("/bin/sh");
+  argv.push_back("-c");
+  argv.push_back(script);
+  return argv;
+}
+
+double Seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+}  // namespace
+
+class SubprocessTest : public ::testing::Test { };
+
+TEST(SubprocessTest, ExitStatus) {
+  Subprocess exits;
+  EXPECT_TRUE(exits.Start(Shell("exit 3")));
+  EXPECT_TRUE(exits.running());
+  EXPECT_TRUE(exits.Wait(-1));
+  EXPECT_FALSE(exits.running());
+  EXPECT_EQ(exits.status(), 3);
+
+  Subprocess killed;
+  EXPECT_TRUE(killed.Start(Shell("kill -TERM $$")));
+  EXPECT_TRUE(killed.Wait(-1));
+  EXPECT_EQ(killed.status(), 128 + 15);
+
+  // Arguments go through untouched, with no shell to split them.
+  Subprocess literal;
+  vector<string> argv(1, "/bin/sh");
+  argv.push_back("-c");
+  argv.push_back("test \"$0\" = 'a b;$HOME'");
+  argv.push_back("a b;$HOME");
+  EXPECT_TRUE(literal.Start(argv));
+  EXPECT_TRUE(literal.Wait(-1));
+  EXPECT_EQ(literal.status(), 0);
+
+  Subprocess bogus;
+  EXPECT_FALSE(bogus.Start(vector<string>(1, "/bin/bogus")));
+  EXPECT_EQ(errno, ENOENT);
+  EXPECT_FALSE(bogus.running());
+  EXPECT_EQ(bogus.status(), -1);
+}
+
+TEST(SubprocessTest, CapturesOutput) {
+  Subprocess child;
+  child.set_capture(true);
+  EXPECT_TRUE(child.Start(Shell("echo out; echo err >&2")));
+  EXPECT_TRUE(child.Wait(-1));
+  EXPECT_EQ(child.status(), 0);
+  EXPECT_EQ(child.output(), "out\n");
+  EXPECT_EQ(child.error(), "err\n");
+
+  // More than a pipe holds, so it has to be read while waiting.
+  Subprocess big;
+  big.set_capture(true);
+  EXPECT_TRUE(big.Start(Shell("head -c 1000000 /dev/zero")));
+  EXPECT_TRUE(big.Wait(-1));
+  EXPECT_EQ(big.status(), 0);
+  EXPECT_EQ(big.output().size(), 1000000u);
+}
+
+TEST(SubprocessTest, Timeout) {
+  Subprocess child;
+  double start = Seconds();
+  EXPECT_TRUE(child.Start(Shell("exec sleep 10")));
+  EXPECT_FALSE(child.Wait(100));
+  EXPECT_LT(Seconds() - start, 5);
+  EXPECT_FALSE(child.running());
+  EXPECT_EQ(child.status(), 128 + 9);
+}
+
+TEST(SubprocessTest, WaitAny) {
+  Subprocess slow, fast, never;
+  vector<Subprocess*> children;
+  children.push_back(&slow);
+  children.push_back(&fast);
+  children.push_back(&never);
+
+  // Never started, so never waited for.
+  EXPECT_EQ(WaitAny(children, 0), -1);
+
+  fast.set_capture(true);
+  EXPECT_TRUE(slow.Start(Shell("exec sleep 10")));
+  EXPECT_TRUE(fast.Start(Shell("sleep 0.1; echo fast")));
+
+  EXPECT_EQ(WaitAny(children, -1), 1);
+  EXPECT_EQ(fast.status(), 0);
+  EXPECT_EQ(fast.output(), "fast\n");
+
+  // The slow one is left running after a timeout.
+  EXPECT_EQ(WaitAny(children, 50), -1);
+  EXPECT_TRUE(slow.running());
+}
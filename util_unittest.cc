@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "chromeos_install_config.h"
@@ -56,6 +57,24 @@ TEST(UtilTest, RunCommandTest) {
   EXPECT_EQ(RunCommand("/bin/echo RunCommand*Test"), 0);
 }
 
+TEST(UtilTest, RunArgvTest) {
+  // Unlike RunCommand, these are exit codes rather than wait statuses.
+  std::vector<string> argv;
+  argv.push_back("/bin/true");
+  EXPECT_EQ(RunArgv(argv), 0);
+
+  argv[0] = "/bin/false";
+  EXPECT_EQ(RunArgv(argv), 1);
+
+  argv[0] = "/bin/bogus";
+  EXPECT_EQ(RunArgv(argv), -1);
+
+  argv[0] = "/bin/bash";
+  argv.push_back("-c");
+  argv.push_back("exit 2");
+  EXPECT_EQ(RunArgv(argv), 2);
+}
+
 TEST(UtilTest, ReadFileToStringTest) {
   string result;
 
@@ -149,6 +168,104 @@ TEST(UtilTest, CopyFileTest) {
   unlink(file2.c_str());
 }
 
+TEST(UtilTest, CopyFileMethodsTest) {
+  const string file1 = "/tmp/fuzzy";
+  const string file2 = "/tmp/wuzzy";
+
+  // Bigger than the copy buffer, and not a multiple of anything
+  string contents(5 * 1024 * 1024 + 123, '\0');
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = i * 2654435761u >> 24;
+
+  const CopyMethod methods[] = {
+    kCopyReflink, kCopyFileRange, kCopySendfile, kCopyBuffer
+  };
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    CopyFileStats stats;
+    string read_contents;
+
+    // Whatever this filesystem can do, the copy is the same
+    ASSERT_EQ(WriteStringToFile(contents, file1), true);
+    EXPECT_EQ(CopyFile(file1, file2, methods[i], &stats), true);
+    EXPECT_GE(stats.method, methods[i]);
+    EXPECT_GE(stats.calls, 1);
+    EXPECT_EQ(ReadFileToString(file2, &read_contents), true);
+    EXPECT_TRUE(contents == read_contents);
+
+    // Empty file
+    ASSERT_EQ(WriteStringToFile("", file1), true);
+    EXPECT_EQ(CopyFile(file1, file2, methods[i], &stats), true);
+    EXPECT_EQ(ReadFileToString(file2, &read_contents), true);
+    EXPECT_EQ(read_contents, "");
+  }
+
+  // Not a regular file, so it is read
+  CopyFileStats stats;
+  EXPECT_EQ(CopyFile("/dev/null", file2, kCopyReflink, &stats), true);
+  EXPECT_EQ(stats.method, kCopyBuffer);
+
+  unlink(file1.c_str());
+  unlink(file2.c_str());
+}
+
+TEST(UtilTest, CopyFilesTest) {
+  const string dir = "/tmp/copy_files";
+  const string names[] = { "menu.lst", "vmlinuz", "root.A.cfg" };
+  std::vector<std::pair<string, string> > copies;
+  string read_contents;
+
+  RunCommand("rm -rf " + dir);
+  ASSERT_EQ(mkdir(dir.c_str(), 0755), 0);
+  ASSERT_EQ(mkdir((dir + "/to").c_str(), 0755), 0);
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(WriteStringToFile("new " + names[i], dir + "/" + names[i]),
+              true);
+    ASSERT_EQ(WriteStringToFile("old " + names[i], dir + "/to/" + names[i]),
+              true);
+    copies.push_back(std::make_pair(dir + "/" + names[i],
+                                    dir + "/to/" + names[i]));
+  }
+
+  // Nothing to do
+  EXPECT_EQ(CopyFiles(std::vector<std::pair<string, string> >()), true);
+
+  // One missing source, none of them are replaced
+  copies.push_back(std::make_pair(dir + "/missing", dir + "/to/missing"));
+  EXPECT_EQ(CopyFiles(copies), false);
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ(ReadFileToString(dir + "/to/" + names[i], &read_contents),
+              true);
+    EXPECT_EQ(read_contents, "old " + names[i]);
+    EXPECT_NE(access((dir + "/to/" + names[i] + ".new").c_str(), F_OK), 0);
+  }
+
+  // All there, all replaced
+  copies.pop_back();
+  EXPECT_EQ(CopyFiles(copies), true);
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ(ReadFileToString(dir + "/to/" + names[i], &read_contents),
+              true);
+    EXPECT_EQ(read_contents, "new " + names[i]);
+    EXPECT_NE(access((dir + "/to/" + names[i] + ".new").c_str(), F_OK), 0);
+  }
+
+  // A rename that fails, over a directory, leaves the earlier ones in
+  // place but no temporary files behind.
+  ASSERT_EQ(WriteStringToFile("newer", dir + "/" + names[0]), true);
+  ASSERT_EQ(mkdir((dir + "/to/dir").c_str(), 0755), 0);
+  ASSERT_EQ(WriteStringToFile("", dir + "/to/dir/file"), true);
+  copies.insert(copies.begin() + 1,
+                std::make_pair(dir + "/" + names[1], dir + "/to/dir"));
+  EXPECT_EQ(CopyFiles(copies), false);
+  EXPECT_EQ(ReadFileToString(dir + "/to/" + names[0], &read_contents), true);
+  EXPECT_EQ(read_contents, "newer");
+  EXPECT_NE(access((dir + "/to/dir.new").c_str(), F_OK), 0);
+  for (size_t i = 0; i < 3; i++)
+    EXPECT_NE(access((dir + "/to/" + names[i] + ".new").c_str(), F_OK), 0);
+
+  RunCommand("rm -rf " + dir);
+}
+
 TEST(UtilTest, LsbReleaseValueTest) {
   string result_string;
   string lsb_file = GetSourceFile("lsb-release-test.txt");
@@ -399,6 +516,86 @@ TEST(UtilTest, SetKernelArgTest) {
   EXPECT_EQ(working_config, kernel_config);
 }
 
+TEST(UtilTest, SetVerityKernelArgsTest) {
+  const string kernel_config =
+      "root=/dev/dm-0 dm=\"vroot none ro,0 2539520 verity"
+      " payload=ROOT_DEV hashtree=HASH_DEV hashstart=2539520 alg=sha1"
+      " root_hexdigest=2a1c\" cros_secure";
+  const string digest =
+      "6f4e0fa1b1e2f3a4b5c6d7e8f90a1b2c3d4e5f60718293a4b5c6d7e8f9a0b1c2";
+
+  string working_config;
+
+  // Switch the table to blake2 and add a salt
+  working_config = kernel_config;
+  EXPECT_EQ(SetVerityKernelArgs("blake2b-256", digest, "9cc05bcf",
+                                &working_config), true);
+  EXPECT_EQ(working_config,
+            "root=/dev/dm-0 dm=\"vroot none ro,0 2539520 verity"
+            " payload=ROOT_DEV hashtree=HASH_DEV hashstart=2539520"
+            " alg=blake2b-256 root_hexdigest=" + digest + " salt=9cc05bcf\""
+            " cros_secure");
+
+  // Change the salt it now has, and read everything back
+  EXPECT_EQ(SetVerityKernelArgs("blake2s-256", "abcd", "0123",
+                                &working_config), true);
+  string dm_config = ExtractKernelArg(working_config, "dm");
+  EXPECT_EQ(ExtractKernelArg(dm_config, "alg"), "blake2s-256");
+  EXPECT_EQ(ExtractKernelArg(dm_config, "root_hexdigest"), "abcd");
+  EXPECT_EQ(ExtractKernelArg(dm_config, "salt"), "0123");
+  EXPECT_EQ(ExtractKernelArg(working_config, "root"), "/dev/dm-0");
+
+  // An empty salt leaves the table's alone
+  EXPECT_EQ(SetVerityKernelArgs("sha256", "ef01", "", &working_config), true);
+  dm_config = ExtractKernelArg(working_config, "dm");
+  EXPECT_EQ(ExtractKernelArg(dm_config, "alg"), "sha256");
+  EXPECT_EQ(ExtractKernelArg(dm_config, "salt"), "0123");
+
+  // No verity table to change
+  working_config = "root=/dev/sda3 cros_secure";
+  EXPECT_EQ(SetVerityKernelArgs("sha256", digest, "", &working_config),
+            false);
+  EXPECT_EQ(working_config, "root=/dev/sda3 cros_secure");
+
+  // A table without an alg is left alone
+  working_config = "dm=\"vroot none ro,0 8 linear ROOT_DEV 0\"";
+  EXPECT_EQ(SetVerityKernelArgs("sha256", digest, "", &working_config),
+            false);
+  EXPECT_EQ(working_config, "dm=\"vroot none ro,0 8 linear ROOT_DEV 0\"");
+}
+
+TEST(UtilTest, FlushBlockDeviceTest) {
+  ASSERT_EQ(WriteStringToFile("data", "/tmp/fuzzy"), true);
+
+  // A plain file has no buffers to drop, but flushes
+  EXPECT_EQ(FlushBlockDevice("/tmp/fuzzy"), true);
+
+  // Bad device
+  EXPECT_EQ(FlushBlockDevice("/fuzzy/wuzzy"), false);
+
+  unlink("/tmp/fuzzy");
+}
+
+TEST(UtilTest, SyncSetTest) {
+  ASSERT_EQ(WriteStringToFile("data", "/tmp/fuzzy"), true);
+
+  SyncSet written;
+  written.AddFile("/tmp/fuzzy");
+  written.AddFilesystem("/tmp");
+  written.AddDevice("/tmp/fuzzy");
+  EXPECT_EQ(written.Sync(), true);
+
+  // Everything is still tried when one fails
+  written.AddFile("/fuzzy/wuzzy");
+  written.AddFilesystem("/tmp");
+  EXPECT_EQ(written.Sync(), false);
+
+  // Which is then forgotten
+  EXPECT_EQ(written.Sync(), true);
+
+  unlink("/tmp/fuzzy");
+}
+
 TEST(UtilTest, IsReadonlyTest) {
   EXPECT_EQ(IsReadonly("/dev/sda3"), false);
   EXPECT_EQ(IsReadonly("/dev/dm-0"), true);
@@ -418,4 +615,22 @@ TEST(UtilTest, ReplaceAllTest) {
   EXPECT_EQ(b, "arsxyzrse");
 }
 
+TEST(UtilTest, MountInfoSourceTest) {
+  string mountinfo =
+      "15 1 8:3 / / rw,relatime shared:1 - ext4 /dev/sda3 rw\n"
+      "16 15 0:4 / /proc rw,nosuid - proc proc rw\n"
+      "17 15 8:9 / /usr ro shared:2 master:1 - ext2 /dev/sda9 ro\n";
+
+  EXPECT_EQ(MountInfoSource(mountinfo, "/"), "/dev/sda3");
+  EXPECT_EQ(MountInfoSource(mountinfo, "/usr"), "/dev/sda9");
+  EXPECT_EQ(MountInfoSource(mountinfo, "/proc"), "proc");
+  EXPECT_EQ(MountInfoSource(mountinfo, "/var"), "");
 
+  // The last mount on a point is the one in use
+  mountinfo += "30 15 8:4 / / rw - ext4 /dev/sda4 rw\n";
+  EXPECT_EQ(MountInfoSource(mountinfo, "/"), "/dev/sda4");
+
+  // Malformed lines
+  EXPECT_EQ(MountInfoSource("15 1 8:3 / / rw - ext4", "/"), "");
+  EXPECT_EQ(MountInfoSource("", "/"), "");
+}
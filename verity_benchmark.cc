@@ -0,0 +1,348 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Runs chromeos_verity over synthetic images and reports how fast it went.
+//
+//   verity_benchmark [--size=<MiB>] [--dir=<path>] [--images=<list>]
+//                    [--algs=<list>] [--blocksizes=<list>] [--threads=<n>]
+//                    [--repeat=<n>] [--direct] [--keep]
+//
+// Each run happens in a child process so its cpu time and peak rss can be
+// read back with wait4. Results go to stdout as CSV, one line per run;
+// everything else goes to stderr.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "chromeos_verity.h"
+
+using std::string;
+using std::vector;
+
+const char* usage = (
+    "verity_benchmark:\n"
+    "   --size=<MiB>          size of each image, default 256\n"
+    "   --dir=<path>          where to make the temp dir, default /tmp\n"
+    "   --images=<list>       random,zero,mixed\n"
+    "   --algs=<list>         md5,sha1,sha256,blake2b-256,blake2s-256\n"
+    "   --blocksizes=<list>   4096\n"
+    "   --threads=<n>         hashing threads, default one per cpu\n"
+    "   --repeat=<n>          runs of each combination, default 1\n"
+    "   --direct              use O_DIRECT\n"
+    "   --keep                don't delete the temp dir afterwards\n");
+
+const char* kSalt =
+    "9cc05bcf7d1b6fb1dae9d5f8e4e57a3ef1e1de2ec4d9af63b8e1f1d0f0a0a0a0";
+
+const size_t kBlockSize = 4096;
+
+// Splits a comma separated list.
+vector<string> SplitList(const string& list) {
+  vector<string> items;
+  size_t start = 0;
+
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos)
+      end = list.size();
+    if (end > start)
+      items.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+double Seconds(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Cheap pseudo random data that won't compress or look like zeros.
+void FillRandom(char* buf, size_t size, uint64_t* state) {
+  for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    memcpy(buf + i, state, sizeof(*state));
+  }
+}
+
+// Writes a synthetic image of the given kind:
+//   random - nothing but random blocks
+//   zero   - 90% zero blocks, half of those left as holes
+//   mixed  - random and zero runs of 1 to 64 blocks, in turn
+bool MakeImage(const string& path, const string& kind, uint64_t size) {
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  uint64_t blocks = size / kBlockSize;
+  vector<char> block(kBlockSize);
+  bool zero_run = false;
+  uint64_t run_left = 0;
+
+  if (kind != "random" && kind != "zero" && kind != "mixed") {
+    fprintf(stderr, "unknown image kind %s\n", kind.c_str());
+    return false;
+  }
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "error creating %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  bool ok = ftruncate(fd, size) == 0;
+  for (uint64_t i = 0; ok && i < blocks; i++) {
+    if (kind == "zero") {
+      // one random block in ten, every other zero block left as a hole
+      if (i % 10 == 9) {
+        FillRandom(&block[0], kBlockSize, &state);
+      } else if (i % 2) {
+        continue;
+      } else {
+        memset(&block[0], 0, kBlockSize);
+      }
+    } else if (kind == "mixed") {
+      if (!run_left) {
+        zero_run = !zero_run;
+        run_left = 1 + state % 64;
+        FillRandom(&block[0], sizeof(uint64_t), &state);
+      }
+      run_left--;
+      if (zero_run)
+        memset(&block[0], 0, kBlockSize);
+      else
+        FillRandom(&block[0], kBlockSize, &state);
+    } else {
+      FillRandom(&block[0], kBlockSize, &state);
+    }
+    ok = pwrite(fd, &block[0], kBlockSize, i * kBlockSize) ==
+         static_cast<ssize_t>(kBlockSize);
+  }
+
+  if (!ok)
+    fprintf(stderr, "error writing %s: %s\n", path.c_str(), strerror(errno));
+  close(fd);
+  return ok;
+}
+
+// Writes back and drops the image from the page cache, so every run starts
+// cold rather than with whatever the previous run left behind.
+void DropCache(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Runs chromeos_verity on the image in a child process. Fills in the
+// verity stats it reports and its resource usage.
+bool RunVerity(const string& path, const string& alg, unsigned blocksize,
+               uint64_t size, struct verity_options opts,
+               struct verity_stats* stats, struct rusage* usage,
+               double* seconds) {
+  int fds[2];
+  if (pipe(fds)) {
+    fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Don't let the child inherit and repeat anything still buffered.
+  fflush(stdout);
+  fflush(stderr);
+
+  DropCache(path);
+  double start = Now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "fork failed: %s\n", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    // chromeos_verity talks on stdout, keep that for the results.
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    close(fds[0]);
+    opts.stats = stats;
+    int result = chromeos_verity(alg.c_str(), path.c_str(), blocksize,
+                                 size / blocksize, kSalt, "", 0, &opts);
+    fflush(stdout);
+    if (result == 0 &&
+        write(fds[1], stats, sizeof(*stats)) != sizeof(*stats))
+      result = 1;
+    _exit(result != 0);
+  }
+
+  close(fds[1]);
+  bool got_stats = read(fds[0], stats, sizeof(*stats)) == sizeof(*stats);
+  close(fds[0]);
+
+  int status;
+  if (wait4(pid, &status, 0, usage) != pid) {
+    fprintf(stderr, "wait4 failed: %s\n", strerror(errno));
+    return false;
+  }
+  *seconds = Now() - start;
+
+  return got_stats && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+  struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"size", required_argument, NULL, 's'},
+    {"dir", required_argument, NULL, 'D'},
+    {"images", required_argument, NULL, 'i'},
+    {"algs", required_argument, NULL, 'a'},
+    {"blocksizes", required_argument, NULL, 'B'},
+    {"threads", required_argument, NULL, 't'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"direct", no_argument, NULL, 'd'},
+    {"keep", no_argument, NULL, 'k'},
+    {NULL, 0, NULL, 0},
+  };
+
+  uint64_t size = 256ULL << 20;
+  string dir = "/tmp";
+  vector<string> images = SplitList("random,zero,mixed");
+  vector<string> algs = SplitList("md5,sha1,sha256,blake2b-256,blake2s-256");
+  vector<string> blocksizes = SplitList("4096");
+  int repeat = 1;
+  bool keep = false;
+  struct verity_options opts;
+  memset(&opts, 0, sizeof(opts));
+
+  while (true) {
+    int option_index;
+    int c = getopt_long(argc, argv, "h", long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 's':
+        size = strtoull(optarg, NULL, 0) << 20;
+        break;
+      case 'D':
+        dir = optarg;
+        break;
+      case 'i':
+        images = SplitList(optarg);
+        break;
+      case 'a':
+        algs = SplitList(optarg);
+        break;
+      case 'B':
+        blocksizes = SplitList(optarg);
+        break;
+      case 't':
+        opts.threads = strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        repeat = atoi(optarg);
+        break;
+      case 'd':
+        opts.direct_io = 1;
+        break;
+      case 'k':
+        keep = true;
+        break;
+      default:
+        printf("%s", usage);
+        return 1;
+    }
+  }
+
+  if (!size || repeat < 1 || optind != argc) {
+    printf("%s", usage);
+    return 1;
+  }
+
+  string tmpl = dir + "/verity_benchmark.XXXXXX";
+  vector<char> tmpdir(tmpl.begin(), tmpl.end());
+  tmpdir.push_back('\0');
+  if (!mkdtemp(&tmpdir[0])) {
+    fprintf(stderr, "error creating %s: %s\n", tmpl.c_str(), strerror(errno));
+    return 1;
+  }
+
+  printf("image,alg,blocksize,threads,direct,fs_bytes,bytes_read,seconds,"
+         "mb_per_s,user_seconds,system_seconds,peak_rss_kb,zero_blocks,"
+         "hole_blocks\n");
+
+  bool failed = false;
+  for (size_t i = 0; i < images.size(); i++) {
+    string path = string(&tmpdir[0]) + "/" + images[i] + ".img";
+
+    fprintf(stderr, "writing %s\n", path.c_str());
+    if (!MakeImage(path, images[i], size)) {
+      failed = true;
+      continue;
+    }
+
+    for (size_t a = 0; a < algs.size(); a++) {
+      for (size_t b = 0; b < blocksizes.size(); b++) {
+        unsigned blocksize = strtoul(blocksizes[b].c_str(), NULL, 0);
+
+        for (int r = 0; r < repeat; r++) {
+          struct verity_stats stats;
+          struct rusage usage;
+          double seconds;
+
+          memset(&stats, 0, sizeof(stats));
+          if (!blocksize || size % blocksize ||
+              !RunVerity(path, algs[a], blocksize, size, opts, &stats,
+                         &usage, &seconds)) {
+            fprintf(stderr, "%s %s %s failed\n", images[i].c_str(),
+                    algs[a].c_str(), blocksizes[b].c_str());
+            failed = true;
+            break;
+          }
+
+          // mb_per_s is over the whole filesystem, holes included, since
+          // that is what an install waits on.
+          printf("%s,%s,%u,%u,%d,%llu,%llu,%.3f,%.1f,%.3f,%.3f,%ld,%llu,"
+                 "%llu\n",
+                 images[i].c_str(), algs[a].c_str(), blocksize, opts.threads,
+                 opts.direct_io, static_cast<unsigned long long>(size),
+                 static_cast<unsigned long long>(stats.bytes_read),
+                 seconds, size / seconds / 1e6,
+                 Seconds(usage.ru_utime), Seconds(usage.ru_stime),
+                 usage.ru_maxrss,
+                 static_cast<unsigned long long>(stats.zero_blocks),
+                 static_cast<unsigned long long>(stats.hole_blocks));
+          fflush(stdout);
+        }
+      }
+    }
+
+    if (!keep)
+      unlink(path.c_str());
+  }
+
+  if (keep)
+    fprintf(stderr, "images left in %s\n", &tmpdir[0]);
+  else
+    rmdir(&tmpdir[0]);
+
+  return failed;
+}
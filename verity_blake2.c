@@ -0,0 +1,588 @@
+/* Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VERITY_BLAKE2_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "verity_blake2.h"
+
+/* A message is a block followed by the salt. BLAKE2 marks its last block */
+/* with a flag rather than padding the message, so the final block is the */
+/* salt zero filled to a whole BLAKE2 block, the same for every message; */
+/* it is built once per call. Without a salt the last block of data is */
+/* the final one. */
+#define BLAKE2B_BLOCK_SIZE 128
+#define BLAKE2S_BLOCK_SIZE 64
+
+/* Number of messages hashed side by side by the AVX2 code */
+#define BLAKE2B_LANES 4
+#define BLAKE2S_LANES 8
+
+enum blake2_impl {
+  BLAKE2_IMPL_SCALAR,
+  BLAKE2_IMPL_AVX2,
+};
+
+static const char *blake2_impl_names[] = { "scalar", "avx2" };
+
+static const uint64_t blake2b_iv[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+  0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+  0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const uint32_t blake2s_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* BLAKE2b runs 12 rounds and BLAKE2s 10; rounds 10 and 11 reuse 0 and 1 */
+static const uint8_t blake2_sigma[12][16] = {
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+static pthread_once_t blake2_once = PTHREAD_ONCE_INIT;
+/* which implementations this cpu can run, filled in by blake2_detect */
+static int blake2_usable[] = { 1, 0 };
+static enum blake2_impl blake2_selected = BLAKE2_IMPL_SCALAR;
+
+/* One round: the four column steps, then the four diagonal ones. G does */
+/* the mixing, on plain words or on vectors of them. */
+#define BLAKE2_ROUND(G, v, m, s) \
+  do { \
+    G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]); \
+    G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]); \
+    G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]); \
+    G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]); \
+    G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]); \
+    G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]); \
+    G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]); \
+    G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]); \
+  } while (0)
+
+static uint64_t load_le64(const uint8_t *p)
+{
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+         ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) |
+         ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+         ((uint64_t)p[7] << 56);
+}
+
+static uint32_t load_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define BLAKE2B_G(a, b, c, d, x, y) \
+  do { \
+    a = a + b + (x); \
+    d = ROR64(d ^ a, 32); \
+    c = c + d; \
+    b = ROR64(b ^ c, 24); \
+    a = a + b + (y); \
+    d = ROR64(d ^ a, 16); \
+    c = c + d; \
+    b = ROR64(b ^ c, 63); \
+  } while (0)
+
+#define BLAKE2S_G(a, b, c, d, x, y) \
+  do { \
+    a = a + b + (x); \
+    d = ROR32(d ^ a, 16); \
+    c = c + d; \
+    b = ROR32(b ^ c, 12); \
+    a = a + b + (y); \
+    d = ROR32(d ^ a, 8); \
+    c = c + d; \
+    b = ROR32(b ^ c, 7); \
+  } while (0)
+
+/* counter is the number of message bytes up to and including this block */
+static void blake2b_compress_scalar(uint64_t h[8], const uint8_t *block,
+                                    uint64_t counter, int last)
+{
+  uint64_t m[16], v[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load_le64(block + 8 * i);
+  for (i = 0; i < 8; i++) {
+    v[i] = h[i];
+    v[i + 8] = blake2b_iv[i];
+  }
+  v[12] ^= counter;
+  if (last)
+    v[14] = ~v[14];
+
+  for (i = 0; i < 12; i++)
+    BLAKE2_ROUND(BLAKE2B_G, v, m, blake2_sigma[i]);
+
+  for (i = 0; i < 8; i++)
+    h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void blake2s_compress_scalar(uint32_t h[8], const uint8_t *block,
+                                    uint64_t counter, int last)
+{
+  uint32_t m[16], v[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load_le32(block + 4 * i);
+  for (i = 0; i < 8; i++) {
+    v[i] = h[i];
+    v[i + 8] = blake2s_iv[i];
+  }
+  v[12] ^= (uint32_t)counter;
+  v[13] ^= (uint32_t)(counter >> 32);
+  if (last)
+    v[14] = ~v[14];
+
+  for (i = 0; i < 10; i++)
+    BLAKE2_ROUND(BLAKE2S_G, v, m, blake2_sigma[i]);
+
+  for (i = 0; i < 8; i++)
+    h[i] ^= v[i] ^ v[i + 8];
+}
+
+/* The parameter block of an unkeyed hash only sets the digest size, */
+/* fanout and depth, all in the first word. */
+static uint64_t blake2b_h0(size_t digest_size)
+{
+  return blake2b_iv[0] ^ 0x01010000 ^ digest_size;
+}
+
+static uint32_t blake2s_h0(size_t digest_size)
+{
+  return blake2s_iv[0] ^ 0x01010000 ^ (uint32_t)digest_size;
+}
+
+static void blake2b_message(const uint8_t *data, size_t block_size,
+                            const uint8_t *tail, size_t salt_size,
+                            size_t digest_size, uint8_t *digest)
+{
+  size_t blocks = block_size / BLAKE2B_BLOCK_SIZE;
+  uint64_t h[8];
+  size_t i;
+
+  memcpy(h, blake2b_iv, sizeof(h));
+  h[0] = blake2b_h0(digest_size);
+
+  for (i = 0; i < blocks; i++)
+    blake2b_compress_scalar(h, data + i * BLAKE2B_BLOCK_SIZE,
+                            (i + 1) * BLAKE2B_BLOCK_SIZE,
+                            !salt_size && i == blocks - 1);
+  if (salt_size)
+    blake2b_compress_scalar(h, tail, block_size + salt_size, 1);
+
+  for (i = 0; i < digest_size; i++)
+    digest[i] = h[i / 8] >> (8 * (i % 8));
+}
+
+static void blake2s_message(const uint8_t *data, size_t block_size,
+                            const uint8_t *tail, size_t salt_size,
+                            size_t digest_size, uint8_t *digest)
+{
+  size_t blocks = block_size / BLAKE2S_BLOCK_SIZE;
+  uint32_t h[8];
+  size_t i;
+
+  memcpy(h, blake2s_iv, sizeof(h));
+  h[0] = blake2s_h0(digest_size);
+
+  for (i = 0; i < blocks; i++)
+    blake2s_compress_scalar(h, data + i * BLAKE2S_BLOCK_SIZE,
+                            (i + 1) * BLAKE2S_BLOCK_SIZE,
+                            !salt_size && i == blocks - 1);
+  if (salt_size)
+    blake2s_compress_scalar(h, tail, block_size + salt_size, 1);
+
+  for (i = 0; i < digest_size; i++)
+    digest[i] = h[i / 4] >> (8 * (i % 4));
+}
+
+#ifdef VERITY_BLAKE2_X86
+
+/* Rotations by whole bytes are a shuffle, the rest shifts. The shuffle */
+/* masks are locals of the function using these. */
+#define V_ROR64_32(x) _mm256_shuffle_epi32(x, 0xB1)
+#define V_ROR64_24(x) _mm256_shuffle_epi8(x, ror24)
+#define V_ROR64_16(x) _mm256_shuffle_epi8(x, ror16)
+#define V_ROR64_63(x) \
+  _mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+
+#define V_ROR32_16(x) _mm256_shuffle_epi8(x, ror16)
+#define V_ROR32_12(x) \
+  _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20))
+#define V_ROR32_8(x) _mm256_shuffle_epi8(x, ror8)
+#define V_ROR32_7(x) \
+  _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25))
+
+#define BLAKE2B_G_X4(a, b, c, d, x, y) \
+  do { \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, b), x); \
+    d = V_ROR64_32(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = V_ROR64_24(_mm256_xor_si256(b, c)); \
+    a = _mm256_add_epi64(_mm256_add_epi64(a, b), y); \
+    d = V_ROR64_16(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = V_ROR64_63(_mm256_xor_si256(b, c)); \
+  } while (0)
+
+#define BLAKE2S_G_X8(a, b, c, d, x, y) \
+  do { \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), x); \
+    d = V_ROR32_16(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi32(c, d); \
+    b = V_ROR32_12(_mm256_xor_si256(b, c)); \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), y); \
+    d = V_ROR32_8(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi32(c, d); \
+    b = V_ROR32_7(_mm256_xor_si256(b, c)); \
+  } while (0)
+
+/* Loads one 128 byte block at offset from each of the 4 lanes and */
+/* transposes it so m[i] holds word i of every lane. */
+__attribute__((target("avx2")))
+static void blake2b_load_x4(__m256i m[16], const uint8_t *const lanes[4],
+                            size_t offset)
+{
+  int i, l;
+
+  for (i = 0; i < 16; i += 4) {
+    __m256i r[4], t[4];
+
+    for (l = 0; l < 4; l++)
+      r[l] = _mm256_loadu_si256((const __m256i *)(lanes[l] + offset + 8 * i));
+    t[0] = _mm256_unpacklo_epi64(r[0], r[1]);
+    t[1] = _mm256_unpackhi_epi64(r[0], r[1]);
+    t[2] = _mm256_unpacklo_epi64(r[2], r[3]);
+    t[3] = _mm256_unpackhi_epi64(r[2], r[3]);
+    m[i] = _mm256_permute2x128_si256(t[0], t[2], 0x20);
+    m[i + 1] = _mm256_permute2x128_si256(t[1], t[3], 0x20);
+    m[i + 2] = _mm256_permute2x128_si256(t[0], t[2], 0x31);
+    m[i + 3] = _mm256_permute2x128_si256(t[1], t[3], 0x31);
+  }
+}
+
+/* Same for one 64 byte block from each of the 8 lanes. */
+__attribute__((target("avx2")))
+static void blake2s_load_x8(__m256i m[16], const uint8_t *const lanes[8],
+                            size_t offset)
+{
+  int half, i;
+
+  for (half = 0; half < 16; half += 8) {
+    __m256i r[8], t[8];
+
+    for (i = 0; i < 8; i++)
+      r[i] = _mm256_loadu_si256((const __m256i *)(lanes[i] + offset +
+                                                  4 * half));
+    for (i = 0; i < 8; i += 2) {
+      t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+      t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+      r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+      r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+      r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+      r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (i = 0; i < 4; i++) {
+      m[half + i] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x20);
+      m[half + i + 4] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x31);
+    }
+  }
+}
+
+/* Compresses one block of each of 4 independent messages. Lane l of h[i] */
+/* is word i of message l's state. */
+__attribute__((target("avx2")))
+static void blake2b_compress_x4(__m256i h[8], const uint8_t *const lanes[4],
+                                size_t offset, uint64_t counter, int last)
+{
+  const __m256i ror24 = _mm256_setr_epi8(
+      3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+      3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+  const __m256i ror16 = _mm256_setr_epi8(
+      2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+      2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+  __m256i m[16], v[16];
+  int i;
+
+  blake2b_load_x4(m, lanes, offset);
+  for (i = 0; i < 8; i++) {
+    v[i] = h[i];
+    v[i + 8] = _mm256_set1_epi64x(blake2b_iv[i]);
+  }
+  v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi64x(counter));
+  if (last)
+    v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi64x(-1));
+
+  for (i = 0; i < 12; i++)
+    BLAKE2_ROUND(BLAKE2B_G_X4, v, m, blake2_sigma[i]);
+
+  for (i = 0; i < 8; i++)
+    h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+}
+
+__attribute__((target("avx2")))
+static void blake2s_compress_x8(__m256i h[8], const uint8_t *const lanes[8],
+                                size_t offset, uint64_t counter, int last)
+{
+  const __m256i ror16 = _mm256_setr_epi8(
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+      2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i ror8 = _mm256_setr_epi8(
+      1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+      1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+  __m256i m[16], v[16];
+  int i;
+
+  blake2s_load_x8(m, lanes, offset);
+  for (i = 0; i < 8; i++) {
+    v[i] = h[i];
+    v[i + 8] = _mm256_set1_epi32(blake2s_iv[i]);
+  }
+  v[12] = _mm256_xor_si256(v[12], _mm256_set1_epi32((uint32_t)counter));
+  v[13] = _mm256_xor_si256(v[13],
+                           _mm256_set1_epi32((uint32_t)(counter >> 32)));
+  if (last)
+    v[14] = _mm256_xor_si256(v[14], _mm256_set1_epi32(-1));
+
+  for (i = 0; i < 10; i++)
+    BLAKE2_ROUND(BLAKE2S_G_X8, v, m, blake2_sigma[i]);
+
+  for (i = 0; i < 8; i++)
+    h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+}
+
+/* Hashes 4 blocks plus the shared final block in parallel. */
+__attribute__((target("avx2")))
+static void blake2b_blocks_x4(const uint8_t *data, size_t block_size,
+                              const uint8_t *tail, size_t salt_size,
+                              size_t digest_size, uint8_t *digests)
+{
+  size_t blocks = block_size / BLAKE2B_BLOCK_SIZE;
+  const uint8_t *lanes[BLAKE2B_LANES];
+  uint64_t words[8][BLAKE2B_LANES];
+  __m256i h[8];
+  size_t i, lane;
+
+  h[0] = _mm256_set1_epi64x(blake2b_h0(digest_size));
+  for (i = 1; i < 8; i++)
+    h[i] = _mm256_set1_epi64x(blake2b_iv[i]);
+
+  for (lane = 0; lane < BLAKE2B_LANES; lane++)
+    lanes[lane] = data + lane * block_size;
+  for (i = 0; i < blocks; i++)
+    blake2b_compress_x4(h, lanes, i * BLAKE2B_BLOCK_SIZE,
+                        (i + 1) * BLAKE2B_BLOCK_SIZE,
+                        !salt_size && i == blocks - 1);
+
+  if (salt_size) {
+    for (lane = 0; lane < BLAKE2B_LANES; lane++)
+      lanes[lane] = tail;
+    blake2b_compress_x4(h, lanes, 0, block_size + salt_size, 1);
+  }
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256((__m256i *)words[i], h[i]);
+  for (lane = 0; lane < BLAKE2B_LANES; lane++) {
+    for (i = 0; i < digest_size; i++)
+      digests[lane * digest_size + i] = words[i / 8][lane] >> (8 * (i % 8));
+  }
+}
+
+/* Hashes 8 blocks plus the shared final block in parallel. */
+__attribute__((target("avx2")))
+static void blake2s_blocks_x8(const uint8_t *data, size_t block_size,
+                              const uint8_t *tail, size_t salt_size,
+                              size_t digest_size, uint8_t *digests)
+{
+  size_t blocks = block_size / BLAKE2S_BLOCK_SIZE;
+  const uint8_t *lanes[BLAKE2S_LANES];
+  uint32_t words[8][BLAKE2S_LANES];
+  __m256i h[8];
+  size_t i, lane;
+
+  h[0] = _mm256_set1_epi32(blake2s_h0(digest_size));
+  for (i = 1; i < 8; i++)
+    h[i] = _mm256_set1_epi32(blake2s_iv[i]);
+
+  for (lane = 0; lane < BLAKE2S_LANES; lane++)
+    lanes[lane] = data + lane * block_size;
+  for (i = 0; i < blocks; i++)
+    blake2s_compress_x8(h, lanes, i * BLAKE2S_BLOCK_SIZE,
+                        (i + 1) * BLAKE2S_BLOCK_SIZE,
+                        !salt_size && i == blocks - 1);
+
+  if (salt_size) {
+    for (lane = 0; lane < BLAKE2S_LANES; lane++)
+      lanes[lane] = tail;
+    blake2s_compress_x8(h, lanes, 0, block_size + salt_size, 1);
+  }
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256((__m256i *)words[i], h[i]);
+  for (lane = 0; lane < BLAKE2S_LANES; lane++) {
+    for (i = 0; i < digest_size; i++)
+      digests[lane * digest_size + i] = words[i / 4][lane] >> (8 * (i % 4));
+  }
+}
+
+static void blake2_detect(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  int have_avx = 0;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return;
+
+  /* AVX registers are only usable if the OS saves them (OSXSAVE + XCR0) */
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    have_avx = (xcr0_lo & 6) == 6;
+  }
+
+  if (__get_cpuid_max(0, NULL) < 7)
+    return;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+  blake2_usable[BLAKE2_IMPL_AVX2] = have_avx && (ebx & bit_AVX2);
+  if (blake2_usable[BLAKE2_IMPL_AVX2])
+    blake2_selected = BLAKE2_IMPL_AVX2;
+}
+
+#else
+
+static void blake2_detect(void)
+{
+}
+
+#endif  /* VERITY_BLAKE2_X86 */
+
+static enum blake2_impl blake2_current(void)
+{
+  pthread_once(&blake2_once, blake2_detect);
+  return blake2_selected;
+}
+
+const char *verity_blake2_impl(void)
+{
+  return blake2_impl_names[blake2_current()];
+}
+
+int verity_blake2_use_impl(const char *name)
+{
+  enum blake2_impl impl;
+
+  pthread_once(&blake2_once, blake2_detect);
+
+  for (impl = BLAKE2_IMPL_SCALAR; impl <= BLAKE2_IMPL_AVX2; impl++) {
+    if (strcmp(name, blake2_impl_names[impl]) || !blake2_usable[impl])
+      continue;
+    blake2_selected = impl;
+    return 0;
+  }
+
+  return -1;
+}
+
+int verity_blake2b_blocks(const uint8_t *data, size_t block_size,
+                          size_t count, const uint8_t *salt, size_t salt_size,
+                          size_t digest_size, uint8_t *digests)
+{
+  uint8_t tail[BLAKE2B_BLOCK_SIZE];
+
+  if (!block_size || block_size % BLAKE2B_BLOCK_SIZE ||
+      salt_size > BLAKE2B_BLOCK_SIZE || !digest_size ||
+      digest_size > VERITY_BLAKE2B_MAX_DIGEST_SIZE)
+    return -EINVAL;
+
+  memset(tail, 0, sizeof(tail));
+  if (salt_size)
+    memcpy(tail, salt, salt_size);
+
+#ifdef VERITY_BLAKE2_X86
+  if (blake2_current() == BLAKE2_IMPL_AVX2) {
+    for (; count >= BLAKE2B_LANES; count -= BLAKE2B_LANES) {
+      blake2b_blocks_x4(data, block_size, tail, salt_size, digest_size,
+                        digests);
+      data += BLAKE2B_LANES * block_size;
+      digests += BLAKE2B_LANES * digest_size;
+    }
+  }
+#endif
+
+  /* the scalar code, and whatever the AVX2 lanes left over */
+  for (; count; count--) {
+    blake2b_message(data, block_size, tail, salt_size, digest_size, digests);
+    data += block_size;
+    digests += digest_size;
+  }
+
+  return 0;
+}
+
+int verity_blake2s_blocks(const uint8_t *data, size_t block_size,
+                          size_t count, const uint8_t *salt, size_t salt_size,
+                          size_t digest_size, uint8_t *digests)
+{
+  uint8_t tail[BLAKE2S_BLOCK_SIZE];
+
+  if (!block_size || block_size % BLAKE2S_BLOCK_SIZE ||
+      salt_size > BLAKE2S_BLOCK_SIZE || !digest_size ||
+      digest_size > VERITY_BLAKE2S_MAX_DIGEST_SIZE)
+    return -EINVAL;
+
+  memset(tail, 0, sizeof(tail));
+  if (salt_size)
+    memcpy(tail, salt, salt_size);
+
+#ifdef VERITY_BLAKE2_X86
+  if (blake2_current() == BLAKE2_IMPL_AVX2) {
+    for (; count >= BLAKE2S_LANES; count -= BLAKE2S_LANES) {
+      blake2s_blocks_x8(data, block_size, tail, salt_size, digest_size,
+                        digests);
+      data += BLAKE2S_LANES * block_size;
+      digests += BLAKE2S_LANES * digest_size;
+    }
+  }
+#endif
+
+  for (; count; count--) {
+    blake2s_message(data, block_size, tail, salt_size, digest_size, digests);
+    data += block_size;
+    digests += digest_size;
+  }
+
+  return 0;
+}
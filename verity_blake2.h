@@ -0,0 +1,70 @@
+/* Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef VERITY_BLAKE2_H_
+#define VERITY_BLAKE2_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VERITY_BLAKE2B_MAX_DIGEST_SIZE 64
+#define VERITY_BLAKE2S_MAX_DIGEST_SIZE 32
+
+/* verity_blake2b_blocks
+ * Hashes count consecutive blocks the way dm-bht does, each one followed
+ * by the salt: blake2b(block || salt), unkeyed, with a digest_size byte
+ * output (32 for the kernel's blake2b-256, 64 for blake2b-512). Uses 4-way
+ * AVX2 when the cpu has it and plain C otherwise; both give the same
+ * digests.
+ *
+ * @data - count blocks of block_size bytes, back to back
+ * @block_size - size of each block, a multiple of 128
+ * @count - number of blocks to hash
+ * @salt - bytes appended to every block, may be NULL if salt_size is 0
+ * @salt_size - size of salt, at most 128
+ * @digest_size - size of each digest, 1 to VERITY_BLAKE2B_MAX_DIGEST_SIZE
+ * @digests - receives count digests of digest_size bytes, back to back
+ * return - 0 for success, non-zero if the sizes can't be handled
+ */
+int verity_blake2b_blocks(const uint8_t *data,
+                          size_t block_size,
+                          size_t count,
+                          const uint8_t *salt,
+                          size_t salt_size,
+                          size_t digest_size,
+                          uint8_t *digests);
+
+/* verity_blake2s_blocks
+ * Like verity_blake2b_blocks but with blake2s, 8-way with AVX2. block_size
+ * is a multiple of 64, salt_size at most 64 and digest_size at most
+ * VERITY_BLAKE2S_MAX_DIGEST_SIZE (32 for the kernel's blake2s-256).
+ */
+int verity_blake2s_blocks(const uint8_t *data,
+                          size_t block_size,
+                          size_t count,
+                          const uint8_t *salt,
+                          size_t salt_size,
+                          size_t digest_size,
+                          uint8_t *digests);
+
+/* Name of the implementation both functions are using: "avx2" or
+ * "scalar".
+ */
+const char *verity_blake2_impl(void);
+
+/* Forces both functions to use the named implementation, for tests and
+ * benchmarks. Returns 0 on success, -1 if this cpu can't run it.
+ */
+int verity_blake2_use_impl(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VERITY_BLAKE2_H_
@@ -0,0 +1,261 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// dm-bht hashes every block and tree page as H(block || salt). Blocks are
+// a whole number of 64 byte hash blocks, so the salt and the hash padding
+// after them come out the same for every block: BlockHasher builds that
+// tail once, and each block then costs its own compressions, started from
+// a saved initial state, plus the prebuilt tail. There is no per-block
+// dispatch, allocation or copying of the salt.
+//
+// md5 and sha1 are small traits structs wrapping their block compression,
+// and BlockHasher is instantiated once for each. sha256 and BLAKE2 have
+// their own multi-block functions that take the salt as is, and
+// DirectHasher just forwards to them.
+
+// MD5_Transform and SHA1_Transform are exactly the primitive needed here
+// (and use OpenSSL's assembly); newer OpenSSL releases mark them deprecated.
+#define OPENSSL_SUPPRESS_DEPRECATED 1
+
+#include "verity_hash.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "verity_blake2.h"
+#include "verity_sha256.h"
+
+namespace {
+
+const size_t kHashBlockSize = 64;
+
+// Salt, 0x80, zero padding and the 64 bit message length fit in two blocks.
+const size_t kMaxSaltSize = kHashBlockSize;
+const size_t kMaxTailSize = 2 * kHashBlockSize;
+
+void StoreLe32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+void StoreBe32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+struct Md5 {
+  typedef MD5_CTX Context;
+  static const unsigned kDigestSize = MD5_DIGEST_LENGTH;
+  static const bool kBigEndian = false;
+
+  static void Init(Context* context) { MD5_Init(context); }
+
+  static void Compress(Context* context, const uint8_t* data, size_t blocks) {
+    for (; blocks; blocks--, data += kHashBlockSize)
+      MD5_Transform(context, data);
+  }
+
+  static void Store(const Context& context, uint8_t* digest) {
+    StoreLe32(digest, context.A);
+    StoreLe32(digest + 4, context.B);
+    StoreLe32(digest + 8, context.C);
+    StoreLe32(digest + 12, context.D);
+  }
+
+  static const char* Impl() { return "openssl"; }
+};
+
+struct Sha1 {
+  typedef SHA_CTX Context;
+  static const unsigned kDigestSize = SHA_DIGEST_LENGTH;
+  static const bool kBigEndian = true;
+
+  static void Init(Context* context) { SHA1_Init(context); }
+
+  static void Compress(Context* context, const uint8_t* data, size_t blocks) {
+    for (; blocks; blocks--, data += kHashBlockSize)
+      SHA1_Transform(context, data);
+  }
+
+  static void Store(const Context& context, uint8_t* digest) {
+    StoreBe32(digest, context.h0);
+    StoreBe32(digest + 4, context.h1);
+    StoreBe32(digest + 8, context.h2);
+    StoreBe32(digest + 12, context.h3);
+    StoreBe32(digest + 16, context.h4);
+  }
+
+  static const char* Impl() { return "openssl"; }
+};
+
+}  // namespace
+
+struct verity_hasher {
+  explicit verity_hasher(unsigned size) : digest_size(size) {}
+  virtual ~verity_hasher() {}
+
+  virtual int Blocks(const uint8_t* data, size_t count,
+                     uint8_t* digests) const = 0;
+  virtual const char* Impl() const = 0;
+
+  const unsigned digest_size;
+};
+
+namespace {
+
+template <class Algorithm>
+class BlockHasher : public verity_hasher {
+ public:
+  BlockHasher(const uint8_t* salt, size_t salt_size, size_t block_size)
+      : verity_hasher(Algorithm::kDigestSize),
+        block_size_(block_size) {
+    uint64_t bits = (static_cast<uint64_t>(block_size) + salt_size) * 8;
+    size_t tail_size = salt_size + 1 + 8 <= kHashBlockSize ?
+                       kHashBlockSize : kMaxTailSize;
+    uint8_t* length = tail_ + tail_size - 8;
+
+    memset(tail_, 0, sizeof(tail_));
+    if (salt_size)
+      memcpy(tail_, salt, salt_size);
+    tail_[salt_size] = 0x80;
+    if (Algorithm::kBigEndian) {
+      StoreBe32(length, bits >> 32);
+      StoreBe32(length + 4, bits);
+    } else {
+      StoreLe32(length, bits);
+      StoreLe32(length + 4, bits >> 32);
+    }
+    tail_blocks_ = tail_size / kHashBlockSize;
+
+    Algorithm::Init(&start_);
+  }
+
+  virtual int Blocks(const uint8_t* data, size_t count,
+                     uint8_t* digests) const {
+    for (; count; count--) {
+      typename Algorithm::Context context = start_;
+
+      Algorithm::Compress(&context, data, block_size_ / kHashBlockSize);
+      Algorithm::Compress(&context, tail_, tail_blocks_);
+      Algorithm::Store(context, digests);
+      data += block_size_;
+      digests += Algorithm::kDigestSize;
+    }
+    return 0;
+  }
+
+  virtual const char* Impl() const { return Algorithm::Impl(); }
+
+ private:
+  // The state every block starts from.
+  typename Algorithm::Context start_;
+  size_t block_size_;
+  uint8_t tail_[kMaxTailSize];
+  size_t tail_blocks_;
+};
+
+// sha256 runs the per-block loop itself, several blocks at a time where
+// the cpu allows. BLAKE2 flags its last block instead of padding, so it
+// has no tail to build either.
+class DirectHasher : public verity_hasher {
+ public:
+  enum Algorithm { kSha256, kBlake2b, kBlake2s };
+
+  DirectHasher(Algorithm algorithm, unsigned digest_size,
+               const uint8_t* salt, size_t salt_size, size_t block_size)
+      : verity_hasher(digest_size),
+        algorithm_(algorithm),
+        block_size_(block_size),
+        salt_size_(salt_size) {
+    memset(salt_, 0, sizeof(salt_));
+    if (salt_size)
+      memcpy(salt_, salt, salt_size);
+  }
+
+  virtual int Blocks(const uint8_t* data, size_t count,
+                     uint8_t* digests) const {
+    switch (algorithm_) {
+      case kSha256:
+        return verity_sha256_blocks(data, block_size_, count, salt_,
+                                    salt_size_, digests);
+      case kBlake2b:
+        return verity_blake2b_blocks(data, block_size_, count, salt_,
+                                     salt_size_, digest_size, digests);
+      case kBlake2s:
+        return verity_blake2s_blocks(data, block_size_, count, salt_,
+                                     salt_size_, digest_size, digests);
+    }
+    return -EINVAL;
+  }
+
+  virtual const char* Impl() const {
+    return algorithm_ == kSha256 ? verity_sha256_impl() :
+                                   verity_blake2_impl();
+  }
+
+ private:
+  Algorithm algorithm_;
+  size_t block_size_;
+  uint8_t salt_[kMaxSaltSize];
+  size_t salt_size_;
+};
+
+}  // namespace
+
+struct verity_hasher* verity_hasher_create(const char* alg,
+                                           const uint8_t* salt,
+                                           size_t salt_size,
+                                           size_t block_size) {
+  if (!block_size || block_size % kHashBlockSize ||
+      salt_size > kMaxSaltSize || (salt_size && !salt))
+    return NULL;
+
+  if (!strcmp(alg, "md5"))
+    return new BlockHasher<Md5>(salt, salt_size, block_size);
+  if (!strcmp(alg, "sha1"))
+    return new BlockHasher<Sha1>(salt, salt_size, block_size);
+  if (!strcmp(alg, "sha256"))
+    return new DirectHasher(DirectHasher::kSha256, VERITY_SHA256_DIGEST_SIZE,
+                            salt, salt_size, block_size);
+  // The kernel's names for them, which dm-verity hands to the crypto api.
+  if (!strcmp(alg, "blake2b-256") && block_size % 128 == 0)
+    return new DirectHasher(DirectHasher::kBlake2b, 32, salt, salt_size,
+                            block_size);
+  if (!strcmp(alg, "blake2b-512") && block_size % 128 == 0)
+    return new DirectHasher(DirectHasher::kBlake2b, 64, salt, salt_size,
+                            block_size);
+  if (!strcmp(alg, "blake2s-256"))
+    return new DirectHasher(DirectHasher::kBlake2s,
+                            VERITY_BLAKE2S_MAX_DIGEST_SIZE, salt, salt_size,
+                            block_size);
+  return NULL;
+}
+
+void verity_hasher_free(struct verity_hasher* hasher) {
+  delete hasher;
+}
+
+int verity_hasher_blocks(const struct verity_hasher* hasher,
+                         const uint8_t* data,
+                         size_t count,
+                         uint8_t* digests) {
+  if (!hasher)
+    return -EINVAL;
+  return hasher->Blocks(data, count, digests);
+}
+
+unsigned verity_hasher_digest_size(const struct verity_hasher* hasher) {
+  return hasher->digest_size;
+}
+
+const char* verity_hasher_impl(const struct verity_hasher* hasher) {
+  return hasher->Impl();
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef VERITY_HASH_H_
+#define VERITY_HASH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hashes dm-bht blocks and tree pages with one algorithm, without going
+ * through libdm-bht. Each algorithm has its own compiled-in block loop;
+ * the name passed to verity_hasher_create only picks which one is used.
+ * A hasher is never changed after it is created, so any number of threads
+ * can share one.
+ */
+struct verity_hasher;
+
+/* verity_hasher_create
+ * @alg - md5, sha1, sha256, blake2b-256, blake2b-512 or blake2s-256
+ * @salt - bytes that follow every block, may be NULL if salt_size is 0
+ * @salt_size - size of salt, at most 64
+ * @block_size - size of every block hashed, a multiple of 64 (of 128 for
+ *               blake2b)
+ * return - the hasher, or NULL if alg or the sizes aren't supported, in
+ *          which case the caller has to fall back to libdm-bht
+ */
+struct verity_hasher *verity_hasher_create(const char *alg,
+                                           const uint8_t *salt,
+                                           size_t salt_size,
+                                           size_t block_size);
+
+void verity_hasher_free(struct verity_hasher *hasher);
+
+/* verity_hasher_blocks
+ * Hashes count consecutive blocks the way dm-bht does, each one followed
+ * by the salt: H(block || salt).
+ *
+ * @data - count blocks back to back
+ * @count - number of blocks to hash
+ * @digests - receives count digests of verity_hasher_digest_size bytes
+ * return - 0 for success, non-zero on failure
+ */
+int verity_hasher_blocks(const struct verity_hasher *hasher,
+                         const uint8_t *data,
+                         size_t count,
+                         uint8_t *digests);
+
+unsigned verity_hasher_digest_size(const struct verity_hasher *hasher);
+
+/* Name of the code doing the work, e.g. "sha-ni", "avx2" or "openssl". */
+const char *verity_hasher_impl(const struct verity_hasher *hasher);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VERITY_HASH_H_
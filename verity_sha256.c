@@ -0,0 +1,457 @@
+/* Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VERITY_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "verity_sha256.h"
+
+/* Every block is followed by the salt and the sha256 padding, which for */
+/* a fixed block size and salt is the same tail on every block. It is */
+/* built once per call and fits in at most two 64 byte sha256 blocks. */
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_MAX_TAIL (2 * SHA256_BLOCK_SIZE)
+
+/* Number of blocks hashed side by side by the AVX2 code */
+#define SHA256_LANES 8
+
+enum sha256_impl {
+  SHA256_IMPL_SCALAR,
+  SHA256_IMPL_AVX2,
+  SHA256_IMPL_SHANI,
+};
+
+static const char *sha256_impl_names[] = { "scalar", "avx2", "sha-ni" };
+
+static const uint32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+/* which implementations this cpu can run, filled in by sha256_detect */
+static int sha256_usable[] = { 1, 0, 0 };
+static enum sha256_impl sha256_selected = SHA256_IMPL_SCALAR;
+
+static uint32_t load_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress_scalar(uint32_t state[8], const uint8_t *data,
+                                   size_t nblocks)
+{
+  while (nblocks--) {
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    int i;
+
+    for (i = 0; i < 16; i++)
+      w[i] = load_be32(data + 4 * i);
+    for (i = 16; i < 64; i++) {
+      uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for (i = 0; i < 64; i++) {
+      uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+                    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    data += SHA256_BLOCK_SIZE;
+  }
+}
+
+#ifdef VERITY_SHA256_X86
+
+/* Four rounds on w, then extends the schedule four words in place. */
+#define SHANI_STEP(i, w, w1, w2, w3) \
+  do { \
+    __m128i m = _mm_add_epi32(w, \
+        _mm_loadu_si128((const __m128i *)&sha256_k[4 * (i)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m); \
+    m = _mm_shuffle_epi32(m, 0x0E); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, m); \
+    if ((i) < 12) \
+      w = _mm_sha256msg2_epu32( \
+          _mm_add_epi32(_mm_sha256msg1_epu32(w, w1), \
+                        _mm_alignr_epi8(w3, w2, 4)), w3); \
+  } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_compress_shani(uint32_t state[8], const uint8_t *data,
+                                  size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+  __m128i state0, state1, tmp;
+
+  /* the sha instructions want the state as ABEF and CDGH */
+  tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);
+  state1 = _mm_shuffle_epi32(state1, 0x1B);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while (nblocks--) {
+    __m128i abef = state0, cdgh = state1;
+    __m128i m0, m1, m2, m3;
+    int i;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), mask);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+
+    /* Named registers rather than an array so the schedule never spills. */
+    for (i = 0; i < 16; i += 4) {
+      SHANI_STEP(i, m0, m1, m2, m3);
+      SHANI_STEP(i + 1, m1, m2, m3, m0);
+      SHANI_STEP(i + 2, m2, m3, m0, m1);
+      SHANI_STEP(i + 3, m3, m0, m1, m2);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define V_ROR32(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/* Loads 32 bytes at offset from each of the 8 lanes and transposes them so */
+/* w[i] holds big endian word i of every lane. */
+__attribute__((target("avx2")))
+static void sha256_load_x8(__m256i w[8], const uint8_t *const lanes[8],
+                           size_t offset)
+{
+  const __m256i bswap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  __m256i r[8], t[8];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    r[i] = _mm256_loadu_si256((const __m256i *)(lanes[i] + offset));
+
+  for (i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+  }
+  for (i = 0; i < 8; i += 4) {
+    r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+    r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+    r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+  for (i = 0; i < 4; i++) {
+    w[i] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x20);
+    w[i + 4] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x31);
+  }
+  for (i = 0; i < 8; i++)
+    w[i] = _mm256_shuffle_epi8(w[i], bswap);
+}
+
+/* Runs nblocks sha256 blocks on 8 independent messages at once. Lane l of */
+/* s[i] is word i of message l's state. */
+__attribute__((target("avx2")))
+static void sha256_compress_x8(__m256i s[8], const uint8_t *const lanes[8],
+                               size_t nblocks)
+{
+  size_t block;
+
+  for (block = 0; block < nblocks; block++) {
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+    __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+    __m256i w[16];
+    int i;
+
+    sha256_load_x8(&w[0], lanes, block * SHA256_BLOCK_SIZE);
+    sha256_load_x8(&w[8], lanes, block * SHA256_BLOCK_SIZE + 32);
+
+    for (i = 0; i < 64; i++) {
+      __m256i t1, t2;
+
+      if (i >= 16) {
+        __m256i w15 = w[(i + 1) & 15], w2 = w[(i + 14) & 15];
+        __m256i s0 = _mm256_xor_si256(
+            _mm256_xor_si256(V_ROR32(w15, 7), V_ROR32(w15, 18)),
+            _mm256_srli_epi32(w15, 3));
+        __m256i s1 = _mm256_xor_si256(
+            _mm256_xor_si256(V_ROR32(w2, 17), V_ROR32(w2, 19)),
+            _mm256_srli_epi32(w2, 10));
+        w[i & 15] = _mm256_add_epi32(
+            _mm256_add_epi32(w[i & 15], s0),
+            _mm256_add_epi32(w[(i + 9) & 15], s1));
+      }
+
+      t1 = _mm256_add_epi32(h, _mm256_xor_si256(
+          _mm256_xor_si256(V_ROR32(e, 6), V_ROR32(e, 11)), V_ROR32(e, 25)));
+      t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(e, f),
+                                                 _mm256_andnot_si256(e, g)));
+      t1 = _mm256_add_epi32(t1, _mm256_add_epi32(
+          _mm256_set1_epi32(sha256_k[i]), w[i & 15]));
+      t2 = _mm256_add_epi32(_mm256_xor_si256(
+          _mm256_xor_si256(V_ROR32(a, 2), V_ROR32(a, 13)), V_ROR32(a, 22)),
+          _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b),
+                                            _mm256_and_si256(a, c)),
+                           _mm256_and_si256(b, c)));
+      h = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = _mm256_add_epi32(t1, t2);
+    }
+
+    s[0] = _mm256_add_epi32(s[0], a);
+    s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c);
+    s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e);
+    s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g);
+    s[7] = _mm256_add_epi32(s[7], h);
+  }
+}
+
+/* Hashes 8 blocks plus the shared tail in parallel. */
+__attribute__((target("avx2")))
+static void sha256_blocks_x8(const uint8_t *data, size_t block_size,
+                             const uint8_t *tail, size_t tail_blocks,
+                             uint8_t *digests)
+{
+  const uint8_t *lanes[SHA256_LANES];
+  uint32_t words[8][SHA256_LANES];
+  __m256i s[8];
+  int i, lane;
+
+  for (i = 0; i < 8; i++)
+    s[i] = _mm256_set1_epi32(sha256_iv[i]);
+
+  for (lane = 0; lane < SHA256_LANES; lane++)
+    lanes[lane] = data + lane * block_size;
+  sha256_compress_x8(s, lanes, block_size / SHA256_BLOCK_SIZE);
+
+  for (lane = 0; lane < SHA256_LANES; lane++)
+    lanes[lane] = tail;
+  sha256_compress_x8(s, lanes, tail_blocks);
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256((__m256i *)words[i], s[i]);
+  for (lane = 0; lane < SHA256_LANES; lane++) {
+    for (i = 0; i < 8; i++)
+      store_be32(digests + lane * VERITY_SHA256_DIGEST_SIZE + 4 * i,
+                 words[i][lane]);
+  }
+}
+
+static void sha256_detect(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  int have_avx = 0, have_ssse3 = 0, have_sse41 = 0;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return;
+
+  have_ssse3 = !!(ecx & bit_SSSE3);
+  have_sse41 = !!(ecx & bit_SSE4_1);
+
+  /* AVX registers are only usable if the OS saves them (OSXSAVE + XCR0) */
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    have_avx = (xcr0_lo & 6) == 6;
+  }
+
+  if (__get_cpuid_max(0, NULL) < 7)
+    return;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+  sha256_usable[SHA256_IMPL_AVX2] = have_avx && (ebx & bit_AVX2);
+  sha256_usable[SHA256_IMPL_SHANI] = have_ssse3 && have_sse41 &&
+                                     (ebx & bit_SHA);
+
+  /* one SHA-NI stream beats eight AVX2 lanes */
+  if (sha256_usable[SHA256_IMPL_SHANI])
+    sha256_selected = SHA256_IMPL_SHANI;
+  else if (sha256_usable[SHA256_IMPL_AVX2])
+    sha256_selected = SHA256_IMPL_AVX2;
+}
+
+#else
+
+static void sha256_detect(void)
+{
+}
+
+#endif  /* VERITY_SHA256_X86 */
+
+static enum sha256_impl sha256_current(void)
+{
+  pthread_once(&sha256_once, sha256_detect);
+  return sha256_selected;
+}
+
+const char *verity_sha256_impl(void)
+{
+  return sha256_impl_names[sha256_current()];
+}
+
+int verity_sha256_use_impl(const char *name)
+{
+  enum sha256_impl impl;
+
+  pthread_once(&sha256_once, sha256_detect);
+
+  for (impl = SHA256_IMPL_SCALAR; impl <= SHA256_IMPL_SHANI; impl++) {
+    if (strcmp(name, sha256_impl_names[impl]) || !sha256_usable[impl])
+      continue;
+    sha256_selected = impl;
+    return 0;
+  }
+
+  return -1;
+}
+
+/* Builds the salt and sha256 padding that follow every block_size block. */
+/* Returns the number of 64 byte blocks in the tail. */
+static size_t sha256_build_tail(uint8_t tail[SHA256_MAX_TAIL],
+                                const uint8_t *salt, size_t salt_size,
+                                size_t block_size)
+{
+  uint64_t bits = ((uint64_t)block_size + salt_size) * 8;
+  size_t tail_size = salt_size + 1 + 8 <= SHA256_BLOCK_SIZE ?
+                     SHA256_BLOCK_SIZE : SHA256_MAX_TAIL;
+
+  memset(tail, 0, SHA256_MAX_TAIL);
+  if (salt_size)
+    memcpy(tail, salt, salt_size);
+  tail[salt_size] = 0x80;
+  store_be32(tail + tail_size - 8, bits >> 32);
+  store_be32(tail + tail_size - 4, bits);
+
+  return tail_size / SHA256_BLOCK_SIZE;
+}
+
+int verity_sha256_blocks(const uint8_t *data, size_t block_size, size_t count,
+                         const uint8_t *salt, size_t salt_size,
+                         uint8_t *digests)
+{
+  enum sha256_impl impl = sha256_current();
+  uint8_t tail[SHA256_MAX_TAIL];
+  size_t tail_blocks;
+  size_t i;
+
+  if (!block_size || block_size % SHA256_BLOCK_SIZE ||
+      salt_size > SHA256_BLOCK_SIZE)
+    return -EINVAL;
+
+  tail_blocks = sha256_build_tail(tail, salt, salt_size, block_size);
+
+#ifdef VERITY_SHA256_X86
+  if (impl == SHA256_IMPL_AVX2) {
+    for (; count >= SHA256_LANES; count -= SHA256_LANES) {
+      sha256_blocks_x8(data, block_size, tail, tail_blocks, digests);
+      data += SHA256_LANES * block_size;
+      digests += SHA256_LANES * VERITY_SHA256_DIGEST_SIZE;
+    }
+  }
+#endif
+
+  /* SHA-NI, the scalar code, and whatever the AVX2 lanes left over */
+  for (; count; count--) {
+    uint32_t state[8];
+
+    memcpy(state, sha256_iv, sizeof(state));
+#ifdef VERITY_SHA256_X86
+    if (impl == SHA256_IMPL_SHANI) {
+      sha256_compress_shani(state, data, block_size / SHA256_BLOCK_SIZE);
+      sha256_compress_shani(state, tail, tail_blocks);
+    } else
+#endif
+    {
+      sha256_compress_scalar(state, data, block_size / SHA256_BLOCK_SIZE);
+      sha256_compress_scalar(state, tail, tail_blocks);
+    }
+
+    for (i = 0; i < 8; i++)
+      store_be32(digests + 4 * i, state[i]);
+    data += block_size;
+    digests += VERITY_SHA256_DIGEST_SIZE;
+  }
+
+  return 0;
+}
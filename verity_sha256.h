@@ -0,0 +1,52 @@
+/* Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef VERITY_SHA256_H_
+#define VERITY_SHA256_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VERITY_SHA256_DIGEST_SIZE 32
+
+/* verity_sha256_blocks
+ * Hashes count consecutive blocks the way dm-bht does, each one followed
+ * by the salt: sha256(block || salt). Uses SHA-NI or 8-way AVX2 when the
+ * cpu has them and plain C otherwise; all of them give the same digests.
+ *
+ * @data - count blocks of block_size bytes, back to back
+ * @block_size - size of each block, a multiple of 64
+ * @count - number of blocks to hash
+ * @salt - bytes appended to every block, may be NULL if salt_size is 0
+ * @salt_size - size of salt, at most 64
+ * @digests - receives count digests of VERITY_SHA256_DIGEST_SIZE, back to back
+ * return - 0 for success, non-zero if the sizes can't be handled
+ */
+int verity_sha256_blocks(const uint8_t *data,
+                         size_t block_size,
+                         size_t count,
+                         const uint8_t *salt,
+                         size_t salt_size,
+                         uint8_t *digests);
+
+/* Name of the implementation verity_sha256_blocks is using: "sha-ni",
+ * "avx2" or "scalar".
+ */
+const char *verity_sha256_impl(void);
+
+/* Forces verity_sha256_blocks to use the named implementation, for tests
+ * and benchmarks. Returns 0 on success, -1 if this cpu can't run it.
+ */
+int verity_sha256_use_impl(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VERITY_SHA256_H_
@@ -0,0 +1,902 @@
+// Copyright (c) 2012 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+#include <verity/dm-bht.h>
+#include <verity/dm-bht-userspace.h>
+}
+
+#include "chromeos_verity.h"
+#include "inst_util.h"
+#include "verity_blake2.h"
+#include "verity_hash.h"
+#include "verity_sha256.h"
+
+using std::string;
+
+class VerityTest : public ::testing::Test { };
+
+const char* kVeritySalt =
+    "9cc05bcf7d1b6fb1dae9d5f8e4e57a3ef1e1de2ec4d9af63b8e1f1d0f0a0a0a0";
+
+// Write a file of fs_blocks pseudo random 4k blocks, with room for the tree.
+void MakeVerityImage(const string& path, uint64_t fs_blocks) {
+  string contents(fs_blocks * 4096, '\0');
+  uint32_t seed = 0x12345678;
+
+  for (size_t i = 0; i < contents.size(); i++) {
+    seed = seed * 1103515245 + 12345;
+    contents[i] = seed >> 16;
+  }
+
+  ASSERT_TRUE(WriteStringToFile(contents, path));
+}
+
+// Returns everything past the end of the filesystem, the hash tree.
+string ReadVerityTree(const string& path, uint64_t fs_blocks) {
+  string contents;
+  EXPECT_TRUE(ReadFileToString(path, &contents));
+  return contents.substr(fs_blocks * 4096);
+}
+
+TEST(VerityTest, ThreadCountDoesNotChangeTree) {
+  const string file = "/tmp/verity_image";
+  // Not a multiple of the io size, so the last chunk is a partial one.
+  const uint64_t fs_blocks = 1000;
+
+  MakeVerityImage(file, fs_blocks);
+
+  struct verity_options opts = {};
+  opts.threads = 1;
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  string single = ReadVerityTree(file, fs_blocks);
+  EXPECT_FALSE(single.empty());
+
+  opts.threads = 3;
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), single);
+
+  // A single read ahead buffer pair still produces the same tree.
+  opts.threads = 2;
+  opts.queue_depth = 2;
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), single);
+
+  // Direct io bypasses the cache (or falls back if /tmp can't do it), but
+  // must not change the tree.
+  struct verity_stats stats = {};
+  opts.direct_io = 1;
+  opts.stats = &stats;
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), single);
+  EXPECT_EQ(stats.bytes_read, fs_blocks * 4096);
+  EXPECT_EQ(stats.bytes_written, single.size());
+  EXPECT_TRUE(stats.uncached_bytes == 0 ||
+              stats.uncached_bytes == stats.bytes_read + stats.bytes_written);
+  EXPECT_GT(stats.peak_rss_kb, 0);
+
+  // Default options pick the thread count themselves.
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), single);
+
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, RootHashMismatch) {
+  const string file = "/tmp/verity_image";
+  const uint64_t fs_blocks = 16;
+
+  MakeVerityImage(file, fs_blocks);
+
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt,
+                            "0000000000000000000000000000000000000000000000000"
+                            "000000000000000",
+                            1, NULL), -1);
+
+  // A mismatch must not write out the tree.
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), "");
+
+  // Bigger trees are written out while they are built, but never the top
+  // page, and the one an earlier build left is cleared before the lower
+  // levels are replaced, so what is there doesn't validate against any
+  // root hash.
+  MakeVerityImage(file, 1000);
+  ASSERT_EQ(chromeos_verity("sha256", file.c_str(), 4096, 1000, kVeritySalt,
+                            "", 0, NULL), 0);
+  ASSERT_NE(ReadVerityTree(file, 1000).substr(0, 4096), string(4096, '\0'));
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, 1000, kVeritySalt,
+                            "0000000000000000000000000000000000000000000000000"
+                            "000000000000000",
+                            1, NULL), -1);
+  EXPECT_EQ(ReadVerityTree(file, 1000).substr(0, 4096), string(4096, '\0'));
+
+  // Unusable block size
+  EXPECT_NE(chromeos_verity("sha256", file.c_str(), 3000, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+
+  // Missing device
+  EXPECT_NE(chromeos_verity("sha256", "/fuzzy/wuzzy", 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+
+  unlink(file.c_str());
+}
+
+// Overwrites count blocks of the image, starting at first_block.
+void ChangeVerityBlocks(const string& path, uint64_t first_block,
+                        uint64_t count, char fill) {
+  string contents;
+  ASSERT_TRUE(ReadFileToString(path, &contents));
+  contents.replace(first_block * 4096, count * 4096, count * 4096, fill);
+  ASSERT_TRUE(WriteStringToFile(contents, path));
+}
+
+TEST(VerityTest, UpdateMatchesFullRebuild) {
+  const string file = "/tmp/verity_image";
+  const uint64_t fs_blocks = 1000;
+  const char* algs[] = { "sha256", "sha1" };
+
+  for (size_t i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+    MakeVerityImage(file, fs_blocks);
+    EXPECT_EQ(chromeos_verity(algs[i], file.c_str(), 4096, fs_blocks,
+                              kVeritySalt, "", 0, NULL), 0);
+
+    // Out of order and overlapping, one crossing a leaf page boundary, the
+    // last block of the filesystem, and an empty one.
+    struct verity_extent changed[] = {
+      { 999, 1 }, { 120, 20 }, { 0, 3 }, { 130, 5 }, { 500, 0 },
+    };
+    ChangeVerityBlocks(file, 0, 3, 'a');
+    ChangeVerityBlocks(file, 120, 20, 'b');
+    ChangeVerityBlocks(file, 999, 1, 'c');
+
+    struct verity_stats stats = {};
+    struct verity_options opts = {};
+    opts.stats = &stats;
+    EXPECT_EQ(chromeos_verity_update(algs[i], file.c_str(), 4096, fs_blocks,
+                                     kVeritySalt, "", 0, changed,
+                                     sizeof(changed) / sizeof(changed[0]),
+                                     &opts), 0);
+    string updated = ReadVerityTree(file, fs_blocks);
+    EXPECT_EQ(stats.bytes_read, 24 * 4096);
+    EXPECT_LT(stats.bytes_written, updated.size());
+
+    EXPECT_EQ(chromeos_verity(algs[i], file.c_str(), 4096, fs_blocks,
+                              kVeritySalt, "", 0, NULL), 0);
+    EXPECT_EQ(ReadVerityTree(file, fs_blocks), updated) << algs[i];
+  }
+
+  // Blocks past the end of the filesystem
+  struct verity_extent past_end = { 990, 11 };
+  EXPECT_NE(chromeos_verity_update("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, "", 0, &past_end, 1, NULL), 0);
+
+  // Root hash mismatch leaves the tree alone.
+  string before = ReadVerityTree(file, fs_blocks);
+  struct verity_extent first = { 0, 1 };
+  ChangeVerityBlocks(file, 0, 1, 'd');
+  EXPECT_EQ(chromeos_verity_update("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt,
+                                   "0000000000000000000000000000000000000000"
+                                   "000000000000000000000000",
+                                   1, &first, 1, NULL), -1);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), before);
+
+  // No tree on the device to update
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_NE(chromeos_verity_update("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, "", 0, &first, 1, NULL), 0);
+
+  unlink(file.c_str());
+}
+
+// The root hash is the digest of the first page of the tree.
+string VerityRootHash(const string& tree) {
+  uint8_t salt[32];
+  uint8_t digest[VERITY_SHA256_DIGEST_SIZE];
+  string hex;
+  char buf[3];
+
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+  EXPECT_EQ(verity_sha256_blocks(reinterpret_cast<const uint8_t*>(tree.data()),
+                                 4096, 1, salt, sizeof(salt), digest), 0);
+  for (int i = 0; i < VERITY_SHA256_DIGEST_SIZE; i++) {
+    snprintf(buf, sizeof(buf), "%02x", digest[i]);
+    hex += buf;
+  }
+  return hex;
+}
+
+TEST(VerityTest, VerifyFindsDamage) {
+  const string file = "/tmp/verity_image";
+  const uint64_t fs_blocks = 1000;
+  string contents;
+
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  string root_hash = VerityRootHash(ReadVerityTree(file, fs_blocks));
+  ASSERT_TRUE(ReadFileToString(file, &contents));
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.threads = 2;
+  opts.stats = &stats;
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, root_hash.c_str(), &opts), 0);
+  EXPECT_EQ(stats.bytes_read, fs_blocks * 4096);
+  EXPECT_EQ(stats.bytes_written, 0);
+
+  // Nothing was written
+  string after;
+  ASSERT_TRUE(ReadFileToString(file, &after));
+  EXPECT_TRUE(after == contents);
+
+  // Wrong root hash
+  string wrong_root = root_hash;
+  wrong_root[10] = wrong_root[10] == '0' ? '1' : '0';
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, wrong_root.c_str(), NULL), -1);
+
+  // A changed data block
+  ChangeVerityBlocks(file, 700, 1, 'x');
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, root_hash.c_str(), NULL), -1);
+  ASSERT_TRUE(WriteStringToFile(contents, file));
+
+  // A changed leaf page is caught before reading any data.
+  string damaged = contents;
+  damaged[damaged.size() - 100] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, file));
+  stats.bytes_read = 1;
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, root_hash.c_str(), &opts), -1);
+  EXPECT_EQ(stats.bytes_read, 1);
+
+  // No tree at all
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_NE(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, root_hash.c_str(), NULL), 0);
+
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, ZeroBlocksAndHoles) {
+  const string file = "/tmp/verity_image";
+  const uint64_t fs_blocks = 300;
+
+  // Mostly a hole, with 10 blocks of data and 50 written zero blocks.
+  unlink(file.c_str());
+  ASSERT_TRUE(WriteStringToFile("", file));
+  ASSERT_EQ(truncate(file.c_str(), fs_blocks * 4096), 0);
+  string data(60 * 4096, '\0');
+  for (size_t i = 0; i < 10 * 4096; i++)
+    data[i] = i * 7 + 3;
+  FILE* fp = fopen(file.c_str(), "r+");
+  ASSERT_TRUE(fp != NULL);
+  ASSERT_EQ(fseek(fp, 100 * 4096, SEEK_SET), 0);
+  ASSERT_EQ(fwrite(data.data(), 1, data.size(), fp), data.size());
+  fclose(fp);
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.stats = &stats;
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(stats.zero_blocks, fs_blocks - 10);
+  EXPECT_LE(stats.hole_blocks, fs_blocks - 60);
+
+  // Every leaf still holds the real digest of its block.
+  string contents;
+  ASSERT_TRUE(ReadFileToString(file, &contents));
+  string tree = contents.substr(fs_blocks * 4096);
+  uint8_t salt[32];
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+  for (uint64_t block = 0; block < fs_blocks; block++) {
+    uint8_t digest[VERITY_SHA256_DIGEST_SIZE];
+    verity_sha256_blocks(
+        reinterpret_cast<const uint8_t*>(contents.data()) + block * 4096,
+        4096, 1, salt, sizeof(salt), digest);
+    EXPECT_EQ(memcmp(tree.data() + 4096 + block * VERITY_SHA256_DIGEST_SIZE,
+                     digest, sizeof(digest)), 0) << "block " << block;
+  }
+
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, VerityRootHash(tree).c_str(),
+                                   NULL), 0);
+
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, WriteMatchesTwoPasses) {
+  const string image = "/tmp/verity_image";
+  const string device = "/tmp/verity_device";
+  const uint64_t fs_blocks = 1000;
+
+  // What writing the image and then running verity over it leaves behind.
+  MakeVerityImage(image, fs_blocks);
+  EXPECT_EQ(chromeos_verity("sha256", image.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  string expected;
+  ASSERT_TRUE(ReadFileToString(image, &expected));
+
+  // Stale data on the device must be overwritten.
+  ASSERT_TRUE(WriteStringToFile(string(expected.size(), 'x'), device));
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.stats = &stats;
+  int fd = open(image.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(chromeos_verity_write("sha256", fd, device.c_str(), 4096,
+                                  fs_blocks, kVeritySalt, "", 0, &opts), 0);
+  close(fd);
+  string contents;
+  ASSERT_TRUE(ReadFileToString(device, &contents));
+  EXPECT_TRUE(contents == expected);
+  EXPECT_EQ(stats.bytes_read, fs_blocks * 4096);
+  EXPECT_EQ(stats.data_bytes_written, fs_blocks * 4096);
+
+  // Streamed through a pipe, with the expected root hash.
+  ASSERT_TRUE(WriteStringToFile(string(expected.size(), 'x'), device));
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    close(fds[0]);
+    size_t size = fs_blocks * 4096;
+    _exit(write(fds[1], expected.data(), size) != (ssize_t)size);
+  }
+  close(fds[1]);
+  string root_hash = VerityRootHash(expected.substr(fs_blocks * 4096));
+  EXPECT_EQ(chromeos_verity_write("sha256", fds[0], device.c_str(), 4096,
+                                  fs_blocks, kVeritySalt, root_hash.c_str(),
+                                  1, NULL), 0);
+  close(fds[0]);
+  int status;
+  EXPECT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(ReadFileToString(device, &contents));
+  EXPECT_TRUE(contents == expected);
+
+  // An image shorter than the filesystem is an error.
+  fd = open(image.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_NE(chromeos_verity_write("sha256", fd, device.c_str(), 4096,
+                                  expected.size() / 4096 + 1, kVeritySalt,
+                                  "", 0, NULL), 0);
+  close(fd);
+
+  unlink(image.c_str());
+  unlink(device.c_str());
+}
+
+TEST(VerityTest, CacheSkipsUnchangedFilesystem) {
+  const string file = "/tmp/verity_image";
+  const string cache = "/tmp/verity_cache";
+  const uint64_t fs_blocks = 1000;
+
+  MakeVerityImage(file, fs_blocks);
+  unlink(cache.c_str());
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.stats = &stats;
+  opts.cache_path = cache.c_str();
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(stats.cached, 0);
+  string tree = ReadVerityTree(file, fs_blocks);
+  string root_hash = VerityRootHash(tree);
+
+  // Same filesystem, same tree: nothing is hashed.
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, root_hash.c_str(), 1, &opts), 0);
+  EXPECT_EQ(stats.cached, 1);
+  EXPECT_EQ(stats.bytes_read, 0);
+
+  // A different expected root hash doesn't trust the cache.
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt,
+                            "0000000000000000000000000000000000000000000000000"
+                            "000000000000000",
+                            1, &opts), -1);
+
+  // Nor does a different salt.
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            "00", "", 0, &opts), 0);
+  EXPECT_EQ(stats.cached, 0);
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(stats.cached, 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), tree);
+
+  // A changed block the fingerprint samples means a rebuild.
+  ChangeVerityBlocks(file, 0, 1, 'z');
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(stats.cached, 0);
+  EXPECT_NE(ReadVerityTree(file, fs_blocks), tree);
+
+  // So does damage to the top of the tree.
+  tree = ReadVerityTree(file, fs_blocks);
+  string contents;
+  ASSERT_TRUE(ReadFileToString(file, &contents));
+  contents[fs_blocks * 4096] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(contents, file));
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, &opts), 0);
+  EXPECT_EQ(stats.cached, 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), tree);
+
+  // One line per device.
+  ASSERT_TRUE(ReadFileToString(cache, &contents));
+  EXPECT_EQ(contents.find('\n'), contents.size() - 1);
+
+  unlink(cache.c_str());
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, InstallTreeChecksTree) {
+  const string file = "/tmp/verity_image";
+  const string tree_file = "/tmp/verity_tree";
+  const uint64_t fs_blocks = 1000;
+
+  // The tree a build would ship with the payload.
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  string tree = ReadVerityTree(file, fs_blocks);
+  string root_hash = VerityRootHash(tree);
+  ASSERT_TRUE(WriteStringToFile(tree, tree_file));
+  ASSERT_EQ(truncate(file.c_str(), fs_blocks * 4096), 0);
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.stats = &stats;
+  EXPECT_EQ(chromeos_verity_install_tree("sha256", tree_file.c_str(),
+                                         file.c_str(), 4096, fs_blocks,
+                                         kVeritySalt, root_hash.c_str(),
+                                         &opts), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), tree);
+  EXPECT_EQ(stats.bytes_read, 0);
+  EXPECT_EQ(stats.bytes_written, tree.size());
+  EXPECT_EQ(chromeos_verity_verify("sha256", file.c_str(), 4096, fs_blocks,
+                                   kVeritySalt, root_hash.c_str(), NULL), 0);
+
+  // A tree that doesn't match the root hash is never written.
+  ASSERT_EQ(truncate(file.c_str(), fs_blocks * 4096), 0);
+  EXPECT_EQ(chromeos_verity_install_tree("sha256", tree_file.c_str(),
+                                         file.c_str(), 4096, fs_blocks,
+                                         kVeritySalt,
+                                         "00000000000000000000000000000000"
+                                         "00000000000000000000000000000000",
+                                         NULL), -1);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), "");
+
+  // Nor is one with a damaged leaf page.
+  string damaged = tree;
+  damaged[damaged.size() - 4096] ^= 1;
+  ASSERT_TRUE(WriteStringToFile(damaged, tree_file));
+  EXPECT_EQ(chromeos_verity_install_tree("sha256", tree_file.c_str(),
+                                         file.c_str(), 4096, fs_blocks,
+                                         kVeritySalt, root_hash.c_str(),
+                                         NULL), -1);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), "");
+
+  // Or a short one, or one without a root hash to check against.
+  ASSERT_TRUE(WriteStringToFile(tree.substr(0, 4096), tree_file));
+  EXPECT_NE(chromeos_verity_install_tree("sha256", tree_file.c_str(),
+                                         file.c_str(), 4096, fs_blocks,
+                                         kVeritySalt, root_hash.c_str(),
+                                         NULL), 0);
+  EXPECT_NE(chromeos_verity_install_tree("sha256", tree_file.c_str(),
+                                         file.c_str(), 4096, fs_blocks,
+                                         kVeritySalt, "", NULL), 0);
+  EXPECT_EQ(ReadVerityTree(file, fs_blocks), "");
+
+  unlink(tree_file.c_str());
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, ScrubCarriesOnFromCheckpoint) {
+  const string file = "/tmp/verity_image";
+  const string checkpoint = "/tmp/verity_checkpoint";
+  const uint64_t fs_blocks = 1000;
+
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  string root_hash = VerityRootHash(ReadVerityTree(file, fs_blocks));
+  string key = file + " sha256 4096 1000 " + kVeritySalt + " " + root_hash;
+  unlink(checkpoint.c_str());
+
+  struct verity_stats stats = {};
+  struct verity_options opts = {};
+  opts.stats = &stats;
+  EXPECT_EQ(chromeos_verity_scrub("sha256", file.c_str(), 4096, fs_blocks,
+                                  kVeritySalt, root_hash.c_str(),
+                                  checkpoint.c_str(), &opts), 0);
+  EXPECT_EQ(stats.bytes_read, fs_blocks * 4096);
+  EXPECT_NE(access(checkpoint.c_str(), F_OK), 0);
+
+  // Damage before the checkpoint was already checked for.
+  ChangeVerityBlocks(file, 100, 1, 'x');
+  ASSERT_TRUE(WriteStringToFile(key + " 500\n", checkpoint));
+  EXPECT_EQ(chromeos_verity_scrub("sha256", file.c_str(), 4096, fs_blocks,
+                                  kVeritySalt, root_hash.c_str(),
+                                  checkpoint.c_str(), &opts), 0);
+  EXPECT_EQ(stats.bytes_read, 500 * 4096);
+
+  // A checkpoint for another tree is ignored.
+  ASSERT_TRUE(WriteStringToFile("/dev/other" + key.substr(file.size()) +
+                                " 500\n", checkpoint));
+  EXPECT_EQ(chromeos_verity_scrub("sha256", file.c_str(), 4096, fs_blocks,
+                                  kVeritySalt, root_hash.c_str(),
+                                  checkpoint.c_str(), &opts), -1);
+  EXPECT_NE(access(checkpoint.c_str(), F_OK), 0);
+
+  // Stopping keeps the checkpoint for the next run.
+  volatile sig_atomic_t cancel = 1;
+  opts.cancel = &cancel;
+  ASSERT_TRUE(WriteStringToFile(key + " 500\n", checkpoint));
+  EXPECT_EQ(chromeos_verity_scrub("sha256", file.c_str(), 4096, fs_blocks,
+                                  kVeritySalt, root_hash.c_str(),
+                                  checkpoint.c_str(), &opts), -EINTR);
+  string contents;
+  EXPECT_TRUE(ReadFileToString(checkpoint, &contents));
+  EXPECT_EQ(contents, key + " 500\n");
+  opts.cancel = NULL;
+
+  // The rate cap holds reads to about 4 MiB/s: the first 1 MiB read is
+  // free, the other 3 take most of a second.
+  MakeVerityImage(file, fs_blocks);
+  EXPECT_EQ(chromeos_verity("sha256", file.c_str(), 4096, fs_blocks,
+                            kVeritySalt, "", 0, NULL), 0);
+  root_hash = VerityRootHash(ReadVerityTree(file, fs_blocks));
+  opts.max_bytes_per_sec = 4 << 20;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  EXPECT_EQ(chromeos_verity_scrub("sha256", file.c_str(), 4096, fs_blocks,
+                                  kVeritySalt, root_hash.c_str(), NULL,
+                                  &opts), 0);
+  gettimeofday(&end, NULL);
+  EXPECT_GE((end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_usec - start.tv_usec), 500000);
+
+  unlink(checkpoint.c_str());
+  unlink(file.c_str());
+}
+
+TEST(VerityTest, ReadExtents) {
+  const string file = "/tmp/verity_extents";
+  struct verity_extent* extents;
+  size_t count;
+
+  ASSERT_TRUE(WriteStringToFile("# changed by the update\n"
+                                "10 5\n"
+                                "\n"
+                                "  0x100\t1\n", file));
+  EXPECT_EQ(verity_read_extents(file.c_str(), &extents, &count), 0);
+  ASSERT_EQ(count, 2);
+  EXPECT_EQ(extents[0].first_block, 10);
+  EXPECT_EQ(extents[0].count, 5);
+  EXPECT_EQ(extents[1].first_block, 0x100);
+  EXPECT_EQ(extents[1].count, 1);
+  free(extents);
+
+  ASSERT_TRUE(WriteStringToFile("10\n", file));
+  EXPECT_NE(verity_read_extents(file.c_str(), &extents, &count), 0);
+  ASSERT_TRUE(WriteStringToFile("10 5 junk\n", file));
+  EXPECT_NE(verity_read_extents(file.c_str(), &extents, &count), 0);
+  EXPECT_NE(verity_read_extents("/fuzzy/wuzzy", &extents, &count), 0);
+
+  unlink(file.c_str());
+}
+
+string DigestToHex(const uint8_t* digest,
+                   size_t size = VERITY_SHA256_DIGEST_SIZE) {
+  string hex;
+  char buf[3];
+
+  for (size_t i = 0; i < size; i++) {
+    snprintf(buf, sizeof(buf), "%02x", digest[i]);
+    hex += buf;
+  }
+  return hex;
+}
+
+TEST(VerityTest, Sha256KnownAnswers) {
+  uint8_t block[4096];
+  uint8_t salt[32];
+  uint8_t digest[VERITY_SHA256_DIGEST_SIZE];
+
+  for (size_t i = 0; i < sizeof(block); i++)
+    block[i] = i * 7 + 3;
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+
+  EXPECT_EQ(verity_sha256_blocks(block, sizeof(block), 1, salt, sizeof(salt),
+                                 digest), 0);
+  EXPECT_EQ(DigestToHex(digest),
+            "d223c720931dacfad97e72398b8053b2244b01d3e07bdbae30b706df028eb111");
+
+  // No salt at all
+  memset(block, 0, sizeof(block));
+  EXPECT_EQ(verity_sha256_blocks(block, sizeof(block), 1, NULL, 0, digest), 0);
+  EXPECT_EQ(DigestToHex(digest),
+            "ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7");
+
+  // A salt too big to share the padding block
+  uint8_t big_salt[60];
+  memset(big_salt, 'x', sizeof(big_salt));
+  EXPECT_EQ(verity_sha256_blocks(block, 64, 1, big_salt, sizeof(big_salt),
+                                 digest), 0);
+  EXPECT_EQ(DigestToHex(digest),
+            "a04cca149389e2a4ba22f4cbf54128a3986f9751138504e5359a8a2b6ead3351");
+
+  // Unsupported sizes
+  EXPECT_NE(verity_sha256_blocks(block, 100, 1, NULL, 0, digest), 0);
+  EXPECT_NE(verity_sha256_blocks(block, 64, 1, block, 65, digest), 0);
+}
+
+TEST(VerityTest, Sha256ImplementationsAgree) {
+  const char* impls[] = { "sha-ni", "avx2" };
+  const size_t kMaxBlocks = 17;
+  string data(kMaxBlocks * 4096, '\0');
+  uint8_t salt[32];
+  uint8_t expected[kMaxBlocks * VERITY_SHA256_DIGEST_SIZE];
+  uint8_t digests[kMaxBlocks * VERITY_SHA256_DIGEST_SIZE];
+  string saved = verity_sha256_impl();
+
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 13) ^ (i >> 12);
+  for (size_t i = 0; i < sizeof(salt); i++)
+    salt[i] = i;
+  const uint8_t* blocks = reinterpret_cast<const uint8_t*>(data.data());
+
+  EXPECT_NE(verity_sha256_use_impl("bogus"), 0);
+  ASSERT_EQ(verity_sha256_use_impl("scalar"), 0);
+  EXPECT_STREQ(verity_sha256_impl(), "scalar");
+  EXPECT_EQ(verity_sha256_blocks(blocks, 4096, kMaxBlocks, salt, sizeof(salt),
+                                 expected), 0);
+
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    // Not every cpu has every implementation.
+    if (verity_sha256_use_impl(impls[i]) != 0)
+      continue;
+    // Every count, so both the batched and the leftover paths get used.
+    for (size_t count = 1; count <= kMaxBlocks; count++) {
+      memset(digests, 0, sizeof(digests));
+      EXPECT_EQ(verity_sha256_blocks(blocks, 4096, count, salt, sizeof(salt),
+                                     digests), 0);
+      EXPECT_EQ(memcmp(digests, expected, count * VERITY_SHA256_DIGEST_SIZE),
+                0) << impls[i] << " with " << count << " blocks";
+    }
+  }
+
+  EXPECT_EQ(verity_sha256_use_impl(saved.c_str()), 0);
+}
+
+TEST(VerityTest, HashersMatchDmBht) {
+  const char* algs[] = { "md5", "sha1", "sha256" };
+  const size_t kBlocks = 9;
+  string data(kBlocks * 4096, '\0');
+  uint8_t salt[DM_BHT_SALT_SIZE];
+
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 29) ^ (i >> 11);
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+  uint8_t* blocks = reinterpret_cast<uint8_t*>(&data[0]);
+
+  for (size_t i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+    // With and without a salt.
+    for (int salted = 0; salted < 2; salted++) {
+      struct dm_bht bht;
+      ASSERT_EQ(dm_bht_create(&bht, kBlocks, algs[i]), 0);
+      string tree(dm_bht_sectors(&bht) << 9, '\0');
+      dm_bht_set_buffer(&bht, &tree[0]);
+      if (salted)
+        dm_bht_set_salt(&bht, kVeritySalt);
+      for (size_t block = 0; block < kBlocks; block++)
+        ASSERT_EQ(dm_bht_store_block(&bht, block, blocks + block * 4096), 0);
+      const uint8_t* expected = bht.levels[bht.depth - 1].entries[0].nodes;
+
+      struct verity_hasher* hasher = verity_hasher_create(
+          algs[i], salted ? salt : NULL, salted ? sizeof(salt) : 0, 4096);
+      ASSERT_TRUE(hasher != NULL);
+      EXPECT_EQ(verity_hasher_digest_size(hasher), bht.digest_size);
+      string digests(kBlocks * bht.digest_size, '\0');
+      EXPECT_EQ(verity_hasher_blocks(hasher, blocks, kBlocks,
+                                     reinterpret_cast<uint8_t*>(&digests[0])),
+                0);
+      EXPECT_EQ(memcmp(digests.data(), expected, digests.size()), 0)
+          << algs[i] << (salted ? " salted" : " unsalted");
+      verity_hasher_free(hasher);
+    }
+  }
+
+  EXPECT_TRUE(verity_hasher_create("crc32", NULL, 0, 4096) == NULL);
+  EXPECT_TRUE(verity_hasher_create("sha1", NULL, 0, 100) == NULL);
+}
+
+TEST(VerityTest, Blake2KnownAnswers) {
+  const size_t kBlocks = 9;
+  string data(kBlocks * 4096, '\0');
+  uint8_t salt[32];
+  uint8_t digests[kBlocks * VERITY_BLAKE2B_MAX_DIGEST_SIZE];
+
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 29) ^ (i >> 11);
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+  const uint8_t* blocks = reinterpret_cast<const uint8_t*>(data.data());
+
+  // Past the AVX2 lanes, so the last block comes from the leftover path.
+  EXPECT_EQ(verity_blake2b_blocks(blocks, 4096, kBlocks, salt, sizeof(salt),
+                                  32, digests), 0);
+  EXPECT_EQ(DigestToHex(digests, 32),
+            "87522121f1c47845a166a783351140de248d36d3dc9b6870d4b642e9a0c524f7");
+  EXPECT_EQ(DigestToHex(digests + 8 * 32, 32),
+            "839f7f23f3dfa701d4a8ffc7296405ea962fb783b35b608755294ad9fd4cfa29");
+
+  EXPECT_EQ(verity_blake2b_blocks(blocks, 4096, kBlocks, salt, sizeof(salt),
+                                  64, digests), 0);
+  EXPECT_EQ(DigestToHex(digests, 64),
+            "dc378a6b020ae67e8e10eddfe94b9de12719ab6f685745e58a0a9b25fd5638ba"
+            "668912e5f442469024bf424d7470224bb32f5ac74ec996b2569fff3ae5505142");
+  EXPECT_EQ(DigestToHex(digests + 8 * 64, 64),
+            "941f3a5bc0a0000f068f7fcfc6558653fb6bef7e25f04809019dab2d616a4fee"
+            "f1f5bf94998c4e1173965d099a54aa7cc9505dfadca85d9e4f19d19d14c04685");
+
+  EXPECT_EQ(verity_blake2s_blocks(blocks, 4096, kBlocks, salt, sizeof(salt),
+                                  32, digests), 0);
+  EXPECT_EQ(DigestToHex(digests, 32),
+            "5582e8526a019b1e3eb183f57ce8e7ff54ac8faf294ff58a77f6f1d8efcbd05c");
+  EXPECT_EQ(DigestToHex(digests + 8 * 32, 32),
+            "5e2d88e4448df0b607b1422e032156dc255126ac07646923fd618f1cc351154f");
+
+  // Without a salt the last block of data is the final one.
+  EXPECT_EQ(verity_blake2b_blocks(blocks, 4096, 1, NULL, 0, 32, digests), 0);
+  EXPECT_EQ(DigestToHex(digests, 32),
+            "3fa89135aca01a76cf9b184d4afb0c343e866b338d11cda4a68ba41bd917b32e");
+  EXPECT_EQ(verity_blake2s_blocks(blocks, 4096, 1, NULL, 0, 32, digests), 0);
+  EXPECT_EQ(DigestToHex(digests, 32),
+            "b040d6dc26d2d24155a50d2c5a0110082611e023fd56c44a6ed4d20f87159f94");
+
+  // Unsupported sizes
+  EXPECT_NE(verity_blake2b_blocks(blocks, 64, 1, NULL, 0, 32, digests), 0);
+  EXPECT_NE(verity_blake2b_blocks(blocks, 4096, 1, NULL, 0, 65, digests), 0);
+  EXPECT_NE(verity_blake2s_blocks(blocks, 4096, 1, NULL, 0, 33, digests), 0);
+  EXPECT_NE(verity_blake2s_blocks(blocks, 4096, 1, blocks, 65, 32, digests),
+            0);
+  EXPECT_TRUE(verity_hasher_create("blake2b-256", NULL, 0, 64) == NULL);
+}
+
+TEST(VerityTest, Blake2ImplementationsAgree) {
+  const size_t kMaxBlocks = 17;
+  const size_t sizes[] = { 32, 64 };
+  string data(kMaxBlocks * 4096, '\0');
+  uint8_t salt[32];
+  uint8_t expected[kMaxBlocks * VERITY_BLAKE2B_MAX_DIGEST_SIZE];
+  uint8_t digests[kMaxBlocks * VERITY_BLAKE2B_MAX_DIGEST_SIZE];
+  string saved = verity_blake2_impl();
+
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (i * 13) ^ (i >> 12);
+  for (size_t i = 0; i < sizeof(salt); i++)
+    salt[i] = i;
+  const uint8_t* blocks = reinterpret_cast<const uint8_t*>(data.data());
+
+  EXPECT_NE(verity_blake2_use_impl("bogus"), 0);
+  // Not every cpu has AVX2.
+  if (verity_blake2_use_impl("avx2") != 0)
+    return;
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+
+    ASSERT_EQ(verity_blake2_use_impl("scalar"), 0);
+    EXPECT_EQ(verity_blake2b_blocks(blocks, 4096, kMaxBlocks, salt,
+                                    sizeof(salt), size, expected), 0);
+    ASSERT_EQ(verity_blake2_use_impl("avx2"), 0);
+    // Every count, so both the batched and the leftover paths get used.
+    for (size_t count = 1; count <= kMaxBlocks; count++) {
+      memset(digests, 0, sizeof(digests));
+      EXPECT_EQ(verity_blake2b_blocks(blocks, 4096, count, salt, sizeof(salt),
+                                      size, digests), 0);
+      EXPECT_EQ(memcmp(digests, expected, count * size), 0)
+          << "blake2b-" << size * 8 << " with " << count << " blocks";
+    }
+  }
+
+  ASSERT_EQ(verity_blake2_use_impl("scalar"), 0);
+  EXPECT_EQ(verity_blake2s_blocks(blocks, 4096, kMaxBlocks, NULL, 0, 32,
+                                  expected), 0);
+  ASSERT_EQ(verity_blake2_use_impl("avx2"), 0);
+  for (size_t count = 1; count <= kMaxBlocks; count++) {
+    memset(digests, 0, sizeof(digests));
+    EXPECT_EQ(verity_blake2s_blocks(blocks, 4096, count, NULL, 0, 32,
+                                    digests), 0);
+    EXPECT_EQ(memcmp(digests, expected, count * 32), 0)
+        << "blake2s-256 with " << count << " blocks";
+  }
+
+  EXPECT_EQ(verity_blake2_use_impl(saved.c_str()), 0);
+}
+
+TEST(VerityTest, Blake2Trees) {
+  const string file = "/tmp/verity_image";
+  const char* algs[] = { "blake2b-256", "blake2b-512", "blake2s-256" };
+  // Root hashes of the 16 block image, from an independent implementation.
+  const char* roots[] = {
+    "933b1babb62c139ba518c8dc8eecbdb6fbc4880270a4daad856295f20fa82fad",
+    "7fb39af38f2495138e61f1aa24ac70663ddaa93d8d2791f44dae698017ecfffa"
+    "e495609513d87ca711cd2ce14a5d9b746be5a39a4615bc31e1c00bdea4d6222f",
+    "53618d274f6a6b336171123717d6e9601f7df9ccfd1cd1a11b124556778df180",
+  };
+  const uint64_t fs_blocks = 1000;
+  uint8_t salt[32];
+
+  for (size_t i = 0; i < sizeof(salt); i++)
+    sscanf(kVeritySalt + i * 2, "%2hhx", &salt[i]);
+
+  for (size_t i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+    MakeVerityImage(file, 16);
+    EXPECT_EQ(chromeos_verity(algs[i], file.c_str(), 4096, 16, kVeritySalt,
+                              roots[i], 1, NULL), 0) << algs[i];
+    // One leaf page, half or a quarter full of digests.
+    EXPECT_EQ(ReadVerityTree(file, 16).size(), 4096) << algs[i];
+
+    // A tree deep enough for the digest size to matter to the layout.
+    struct verity_options opts = {};
+    opts.threads = 2;
+    MakeVerityImage(file, fs_blocks);
+    EXPECT_EQ(chromeos_verity(algs[i], file.c_str(), 4096, fs_blocks,
+                              kVeritySalt, "", 0, &opts), 0) << algs[i];
+    string tree = ReadVerityTree(file, fs_blocks);
+    struct verity_hasher* hasher = verity_hasher_create(algs[i], salt,
+                                                        sizeof(salt), 4096);
+    ASSERT_TRUE(hasher != NULL);
+    unsigned digest_size = verity_hasher_digest_size(hasher);
+    uint8_t digest[VERITY_BLAKE2B_MAX_DIGEST_SIZE];
+    EXPECT_EQ(verity_hasher_blocks(
+        hasher, reinterpret_cast<const uint8_t*>(tree.data()), 1, digest), 0);
+    verity_hasher_free(hasher);
+    string root_hash = DigestToHex(digest, digest_size);
+
+    // A top page and as many leaf pages as the digests need.
+    size_t leaves = (fs_blocks * digest_size + 4095) / 4096;
+    EXPECT_EQ(tree.size(), (1 + leaves) * 4096) << algs[i];
+
+    EXPECT_EQ(chromeos_verity_verify(algs[i], file.c_str(), 4096, fs_blocks,
+                                     kVeritySalt, root_hash.c_str(), &opts),
+              0) << algs[i];
+    ChangeVerityBlocks(file, 700, 1, 'x');
+    EXPECT_EQ(chromeos_verity_verify(algs[i], file.c_str(), 4096, fs_blocks,
+                                     kVeritySalt, root_hash.c_str(), &opts),
+              -1) << algs[i];
+  }
+
+  unlink(file.c_str());
+}